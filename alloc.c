@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "diskimg.h"
+#include "blockcache.h"
+#include "inode.h"
+#include "directory.h"
+#include "chksumfile.h"
+#include "fserror.h"
+
+#define INODES_PER_BLOCK (DISKIMG_SECTOR_SIZE / sizeof(struct inode))
+#define NFREE (sizeof(((struct filsys *) 0)->s_free) / sizeof(uint16_t))
+#define NINODE (sizeof(((struct filsys *) 0)->s_inode) / sizeof(uint16_t))
+
+/**
+ * A free-list chain block: the count and the list it held when it was
+ * spilled out of the superblock.
+ */
+struct alloc_chain {
+  uint16_t nfree;
+  uint16_t free[NFREE];
+  uint16_t unused[DISKIMG_SECTOR_SIZE / sizeof(uint16_t) - NFREE - 1];
+};
+
+/**
+ * Returns 1 if bno lies in the data area of the filesystem (V6 badblock()).
+ */
+static int alloc_isdatablock(struct unixfilesystem *fs, int bno) {
+  if (bno < INODE_START_SECTOR + fs->superblock.s_isize || bno >= fs->superblock.s_fsize) {
+    fserror_record(fs, FSERR_CORRUPT, "Bad block %d on free list", NULL, bno, 0, 0);
+    return 0;
+  }
+  return 1;
+}
+
+int alloc_block(struct unixfilesystem *fs) {
+  unixfilesystem_beginbatch(fs);
+  struct filsys *sb = &fs->superblock;
+  int bno;
+  int err = FSERR_NOSPC;
+  do {
+    if (sb->s_nfree == 0 || sb->s_nfree > NFREE) goto nospace;
+    bno = sb->s_free[--sb->s_nfree];
+    sb->s_fmod = 1;
+    if (bno == 0) goto nospace;
+  } while (!alloc_isdatablock(fs, bno));
+
+  if (sb->s_nfree == 0) {
+    // The last entry names the next chain block: its list replaces ours.
+    struct alloc_chain chain;
+    if (blockcache_readsector(fs->cache, bno, &chain) != DISKIMG_SECTOR_SIZE || chain.nfree > NFREE) {
+      err = fserror_record(fs, FSERR_CORRUPT, "Bad free list chain block %d", NULL, bno, 0, 0);
+      goto nospace;
+    }
+    sb->s_nfree = chain.nfree;
+    memcpy(sb->s_free, chain.free, sizeof(sb->s_free));
+  }
+  unixfilesystem_endbatch(fs);
+  return bno;
+
+nospace:
+  sb->s_nfree = 0;
+  sb->s_fmod = 1;
+  unixfilesystem_endbatch(fs);
+  return err;
+}
+
+int alloc_freeblock(struct unixfilesystem *fs, int bno) {
+  if (!alloc_isdatablock(fs, bno)) return FSERR_CORRUPT;
+
+  unixfilesystem_beginbatch(fs);
+  struct filsys *sb = &fs->superblock;
+  int err = 0;
+  if (sb->s_nfree == 0 || sb->s_nfree > NFREE) {
+    // An empty list starts with the 0 that ends the chain.
+    sb->s_nfree = 1;
+    sb->s_free[0] = 0;
+  }
+  if (sb->s_nfree == NFREE) {
+    // Spill the full list into bno, which becomes the new chain head.
+    struct alloc_chain chain;
+    memset(&chain, 0, sizeof(chain));
+    chain.nfree = sb->s_nfree;
+    memcpy(chain.free, sb->s_free, sizeof(chain.free));
+    if (blockcache_writesector(fs->cache, bno, &chain) != DISKIMG_SECTOR_SIZE) {
+      err = fserror_record(fs, FSERR_IO, "Failed to write free list chain block %d", NULL, bno, 0, 0);
+      goto done;
+    }
+    sb->s_nfree = 0;
+  }
+  sb->s_free[sb->s_nfree++] = bno;
+  sb->s_fmod = 1;
+
+done:
+  if (unixfilesystem_endbatch(fs) < 0 && err == 0) err = FSERR_IO;
+  return err;
+}
+
+/**
+ * Returns the mode word of inumber straight from the inode table, whether
+ * or not the inode is allocated, or -1 if it can't be read.
+ */
+static int alloc_getmode(struct unixfilesystem *fs, int inumber) {
+  if (fs->inodes != NULL) {
+    return fs->inodes[inumber - 1].i_mode;
+  }
+  unsigned char buf[DISKIMG_SECTOR_SIZE];
+  const struct inode *inodes =
+    blockcache_getsector(fs->cache, INODE_START_SECTOR + (inumber - 1) / INODES_PER_BLOCK, buf);
+  return inodes != NULL ? inodes[(inumber - 1) % INODES_PER_BLOCK].i_mode : -1;
+}
+
+/**
+ * Refills s_inode with free inodes found by scanning the inode table from
+ * the start (V6 ialloc).  Returns the number found.
+ */
+static int alloc_scaninodes(struct unixfilesystem *fs) {
+  struct filsys *sb = &fs->superblock;
+  int maxInumber = sb->s_isize * INODES_PER_BLOCK;
+  int found = 0;
+  for (int inumber = ROOT_INUMBER; inumber <= maxInumber && sb->s_ninode < NINODE; inumber++) {
+    if (alloc_getmode(fs, inumber) == 0) {
+      sb->s_inode[sb->s_ninode++] = inumber;
+      found++;
+    }
+  }
+  if (found > 0) sb->s_fmod = 1;
+  return found;
+}
+
+int alloc_inode(struct unixfilesystem *fs, int mode) {
+  unixfilesystem_beginbatch(fs);
+  struct filsys *sb = &fs->superblock;
+  int maxInumber = sb->s_isize * INODES_PER_BLOCK;
+  int inumber = FSERR_NOSPC;
+  for (;;) {
+    if (sb->s_ninode > NINODE) sb->s_ninode = 0;   // Damaged: rebuild it.
+    if (sb->s_ninode > 0) {
+      int candidate = sb->s_inode[--sb->s_ninode];
+      sb->s_fmod = 1;
+      // The cache may name inodes that were allocated after all.
+      if (candidate >= ROOT_INUMBER && candidate <= maxInumber && alloc_getmode(fs, candidate) == 0) {
+        inumber = candidate;
+        break;
+      }
+      continue;
+    }
+    if (alloc_scaninodes(fs) == 0) {
+      break;
+    }
+  }
+
+  if (inumber > 0) {
+    struct inode in;
+    memset(&in, 0, sizeof(in));
+    uint32_t now = time(NULL);
+    in.i_mode = IALLOC | (mode & ~IALLOC);
+    in.i_nlink = 1;
+    in.i_atime[0] = in.i_mtime[0] = now >> 16;
+    in.i_atime[1] = in.i_mtime[1] = now & 0xffff;
+    int err = inode_iwrite(fs, inumber, &in);
+    if (err < 0) {
+      inumber = err;
+    }
+  }
+  if (unixfilesystem_endbatch(fs) < 0 && inumber > 0) inumber = FSERR_IO;
+  return inumber;
+}
+
+int alloc_freeinode(struct unixfilesystem *fs, int inumber) {
+  unixfilesystem_beginbatch(fs);
+  struct inode in;
+  int err = inode_iget(fs, inumber, &in);
+  if (err == 0) {
+    err = inode_truncate(fs, &in);
+  }
+  if (err == 0) {
+    memset(&in, 0, sizeof(in));
+    err = inode_iwrite(fs, inumber, &in);
+  }
+  if (err == 0) {
+    chksumfile_invalidate(fs, inumber);
+    directory_invalidate(fs, inumber);
+    struct filsys *sb = &fs->superblock;
+    if (sb->s_ninode < NINODE) {
+      sb->s_inode[sb->s_ninode++] = inumber;
+      sb->s_fmod = 1;
+    }
+  }
+  if (unixfilesystem_endbatch(fs) < 0 && err == 0) err = FSERR_IO;
+  return err;
+}
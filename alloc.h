@@ -0,0 +1,45 @@
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+#include "unixfilesystem.h"
+
+/**
+ * Block and inode allocation through the superblock free lists, as in V6
+ * alloc.c.  The superblock holds up to 100 free block numbers in s_free;
+ * s_free[0] of a full list names a block whose first word is the count and
+ * whose next 100 words are the previous list, and so on down to a 0 that
+ * ends the chain.  s_inode caches up to 100 free inumbers and is refilled by
+ * scanning the inode table for zero i_mode when it runs dry.
+ *
+ * Every function runs inside a write batch (see unixfilesystem_beginbatch),
+ * so the superblock is flushed once per batch.
+ */
+
+/**
+ * Takes a block off the free list.  The block's contents are not cleared.
+ * Returns the block number, FSERR_NOSPC if the filesystem is full or
+ * FSERR_CORRUPT if the free list is damaged.
+ */
+int alloc_block(struct unixfilesystem *fs);
+
+/**
+ * Puts block bno back on the free list.  Returns 0, FSERR_CORRUPT if bno
+ * is not a data block or FSERR_IO if the chain block couldn't be written.
+ */
+int alloc_freeblock(struct unixfilesystem *fs, int bno);
+
+/**
+ * Allocates an inode and initialises it as an empty file with the given
+ * mode (IALLOC is added) and one link.  Returns the inumber, FSERR_NOSPC if
+ * there are no free inodes or another negative FSERR_* code on error.
+ */
+int alloc_inode(struct unixfilesystem *fs, int mode);
+
+/**
+ * Frees inumber: its blocks are released, i_mode is cleared and the
+ * inumber goes back on the superblock's free inode cache if there's room.
+ * Returns 0 on success or a negative FSERR_* code.
+ */
+int alloc_freeinode(struct unixfilesystem *fs, int inumber);
+
+#endif // _ALLOC_H_
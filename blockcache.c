@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "blockcache.h"
+#include "diskimg.h"
+#include "fsstats.h"
+
+struct cacheslot {
+  int sector;        // Sector held by this slot, or -1 if the slot is empty.
+  int referenced;    // CLOCK reference bit.
+  int dirty;         // Newer than the disk image (write-back mode only).
+};
+
+struct blockcache {
+  int dfd;
+  int capacity;
+  int numSectors;          // Sectors in the disk image, size of slotOf.
+  int *slotOf;             // Sector number -> slot index, or -1 if not resident.
+  struct cacheslot *slots;
+  unsigned char *data;     // capacity * DISKIMG_SECTOR_SIZE bytes.
+  int hand;                // CLOCK hand.
+  int used;                // Number of slots filled so far.
+  pthread_mutex_t lock;    // Protects slotOf, slots, data, hand, used and numDirty.
+  int writeback;           // Keep written sectors dirty in the cache.
+  int metaEnd;             // Sectors below this are metadata, flushed last.
+  int numDirty;
+  unsigned generation;     // Bumped whenever the image or a cached sector changes.
+  struct blockcache_stats stats;
+  struct fsstats *fsstats; // Filesystem counters to update, or NULL.
+};
+
+// Times blockcache_readsectors() reads without the lock before holding it.
+#define BLOCKCACHE_READ_RETRIES 3
+
+// Counters are bumped without taking the lock.
+#define BLOCKCACHE_COUNT(bc, field, n) \
+  __atomic_fetch_add(&(bc)->stats.field, (n), __ATOMIC_RELAXED)
+
+struct blockcache *blockcache_create(int dfd, int capacity) {
+  if (capacity < 0) return NULL;
+
+  struct blockcache *bc = calloc(1, sizeof(struct blockcache));
+  if (bc == NULL) return NULL;
+
+  int disksize = diskimg_getsize(dfd);
+  if (disksize < 0) {
+    free(bc);
+    return NULL;
+  }
+
+  bc->dfd = dfd;
+  bc->capacity = capacity;
+  bc->numSectors = disksize / DISKIMG_SECTOR_SIZE;
+  bc->stats.capacity = capacity;
+  pthread_mutex_init(&bc->lock, NULL);
+
+  if (capacity > 0) {
+    bc->slotOf = malloc(bc->numSectors * sizeof(int));
+    bc->slots = malloc(capacity * sizeof(struct cacheslot));
+    bc->data = malloc((size_t) capacity * DISKIMG_SECTOR_SIZE);
+    if (bc->slotOf == NULL || bc->slots == NULL || bc->data == NULL) {
+      blockcache_free(bc);
+      return NULL;
+    }
+    memset(bc->slotOf, 0xff, bc->numSectors * sizeof(int));
+    for (int i = 0; i < capacity; i++) {
+      bc->slots[i].sector = -1;
+      bc->slots[i].referenced = 0;
+      bc->slots[i].dirty = 0;
+    }
+  }
+  return bc;
+}
+
+static int blockcache_flushlocked(struct blockcache *bc, int barrier);
+
+/**
+ * Picks the slot that the next miss will be loaded into, evicting its
+ * current sector if needed.  Dirty sectors are never evicted; when every
+ * slot is dirty they are all written back first.  Returns the slot, or -1
+ * if every slot is dirty and writing them back failed.  Called with the
+ * lock held.
+ */
+static int blockcache_victim(struct blockcache *bc) {
+  if (bc->used < bc->capacity) {
+    return bc->used++;
+  }
+
+  int scanned = 0;
+  for (;;) {
+    struct cacheslot *s = &bc->slots[bc->hand];
+    int slot = bc->hand;
+    bc->hand = (bc->hand + 1) % bc->capacity;
+    if (s->dirty) {
+      // Two sweeps clear every reference bit, so a third means no slot
+      // is clean.
+      if (++scanned > 2 * bc->capacity) {
+        // Nothing would ever become clean: give up rather than spin.
+        if (blockcache_flushlocked(bc, 0) < 0) {
+          return -1;
+        }
+        scanned = 0;
+      }
+      continue;
+    }
+    if (s->referenced) {
+      s->referenced = 0;   // Second chance.
+      continue;
+    }
+    bc->slotOf[s->sector] = -1;
+    s->sector = -1;
+    BLOCKCACHE_COUNT(bc, evictions, 1);
+    return slot;
+  }
+}
+
+void blockcache_setstats(struct blockcache *bc, struct fsstats *stats) {
+  bc->fsstats = stats;
+}
+
+/**
+ * Reads sectors from the disk image, accounting for them in the filesystem
+ * statistics.
+ */
+static int blockcache_diskread(struct blockcache *bc, int startSector, int numSectors, void *buf) {
+  FSSTATS_COUNT(bc->fsstats, FSSTATS_SECTORS_READ, numSectors);
+  FSSTATS_TIME_BEGIN(bc->fsstats, start);
+  int nbytes = numSectors == 1 ? diskimg_readsector(bc->dfd, startSector, buf)
+                               : diskimg_readsectors(bc->dfd, startSector, numSectors, buf);
+  FSSTATS_TIME_END(bc->fsstats, FSSTATS_LAYER_DISKIMG, start);
+  return nbytes;
+}
+
+int blockcache_readsector(struct blockcache *bc, int sectorNum, void *buf) {
+  if (sectorNum < 0) return -1;
+
+  const void *mapped = diskimg_mapsector(bc->dfd, sectorNum);
+  if (mapped != NULL) {
+    BLOCKCACHE_COUNT(bc, mapped, 1);
+    memcpy(buf, mapped, DISKIMG_SECTOR_SIZE);
+    return DISKIMG_SECTOR_SIZE;
+  }
+
+  if (bc->capacity == 0 || sectorNum >= bc->numSectors) {
+    BLOCKCACHE_COUNT(bc, misses, 1);
+    return blockcache_diskread(bc, sectorNum, 1, buf);
+  }
+
+  pthread_mutex_lock(&bc->lock);
+  int slot = bc->slotOf[sectorNum];
+  if (slot >= 0) {
+    bc->slots[slot].referenced = 1;
+    memcpy(buf, bc->data + (size_t) slot * DISKIMG_SECTOR_SIZE, DISKIMG_SECTOR_SIZE);
+    pthread_mutex_unlock(&bc->lock);
+    BLOCKCACHE_COUNT(bc, hits, 1);
+    return DISKIMG_SECTOR_SIZE;
+  }
+  unsigned generation = bc->generation;
+  pthread_mutex_unlock(&bc->lock);
+
+  // Do the disk read without holding the lock so other threads' hits
+  // aren't stalled behind it.
+  BLOCKCACHE_COUNT(bc, misses, 1);
+  int nbytes = blockcache_diskread(bc, sectorNum, 1, buf);
+  if (nbytes != DISKIMG_SECTOR_SIZE) {
+    // Don't cache errors or a short sector at the end of the image.
+    return nbytes;
+  }
+
+  pthread_mutex_lock(&bc->lock);
+  if (bc->slotOf[sectorNum] < 0 && bc->generation == generation) {
+    // Another thread may have loaded the sector while we were reading it,
+    // and a write that raced with the read may have left it stale: either
+    // way the cache isn't given our copy.  Nor is it when there is no
+    // slot to put it in: the read has simply bypassed the cache.
+    slot = blockcache_victim(bc);
+    if (slot >= 0) {
+      bc->slots[slot].sector = sectorNum;
+      bc->slots[slot].referenced = 1;
+      bc->slotOf[sectorNum] = slot;
+      memcpy(bc->data + (size_t) slot * DISKIMG_SECTOR_SIZE, buf, DISKIMG_SECTOR_SIZE);
+    }
+  }
+  pthread_mutex_unlock(&bc->lock);
+  return nbytes;
+}
+
+const void *blockcache_getsector(struct blockcache *bc, int sectorNum, void *scratch) {
+  if (sectorNum < 0) return NULL;
+
+  const void *mapped = diskimg_mapsector(bc->dfd, sectorNum);
+  if (mapped != NULL) {
+    BLOCKCACHE_COUNT(bc, mapped, 1);
+    return mapped;
+  }
+
+  if (blockcache_readsector(bc, sectorNum, scratch) != DISKIMG_SECTOR_SIZE) {
+    return NULL;
+  }
+  return scratch;
+}
+
+int blockcache_readsectors(struct blockcache *bc, int startSector, int numSectors, void *buf) {
+  if (startSector < 0 || numSectors < 0) return -1;
+  BLOCKCACHE_COUNT(bc, streamed, numSectors);
+  if (!bc->writeback) return blockcache_diskread(bc, startSector, numSectors, buf);
+
+  // Sectors not written back yet are newer in the cache than on disk.  A
+  // flush that lands between the disk read and the overlay would leave
+  // neither copy current, so then the read is done again; after a few
+  // tries it is done with the lock held.
+  int nbytes;
+  pthread_mutex_lock(&bc->lock);
+  for (int tries = 0; ; tries++) {
+    unsigned generation = bc->generation;
+    if (tries < BLOCKCACHE_READ_RETRIES) pthread_mutex_unlock(&bc->lock);
+    nbytes = blockcache_diskread(bc, startSector, numSectors, buf);
+    if (tries < BLOCKCACHE_READ_RETRIES) pthread_mutex_lock(&bc->lock);
+    if (nbytes <= 0 || bc->generation == generation) break;
+  }
+  for (int i = 0; bc->numDirty > 0 && i < nbytes / DISKIMG_SECTOR_SIZE; i++) {
+    int sector = startSector + i;
+    int slot = sector < bc->numSectors ? bc->slotOf[sector] : -1;
+    if (slot >= 0 && bc->slots[slot].dirty) {
+      memcpy((unsigned char *) buf + (size_t) i * DISKIMG_SECTOR_SIZE,
+             bc->data + (size_t) slot * DISKIMG_SECTOR_SIZE, DISKIMG_SECTOR_SIZE);
+    }
+  }
+  pthread_mutex_unlock(&bc->lock);
+  return nbytes;
+}
+
+void blockcache_setwriteback(struct blockcache *bc, int metaEnd) {
+  // A mapped image is read straight from the mapping, which must not fall
+  // behind the cache.
+  if (bc->capacity == 0 || diskimg_mapsector(bc->dfd, 0) != NULL) return;
+  pthread_mutex_lock(&bc->lock);
+  bc->writeback = 1;
+  bc->metaEnd = metaEnd;
+  pthread_mutex_unlock(&bc->lock);
+}
+
+int blockcache_writesectors(struct blockcache *bc, int startSector, int numSectors, const void *buf) {
+  if (startSector < 0 || numSectors <= 0) return -1;
+  const unsigned char *src = buf;
+  int nbytes = numSectors * DISKIMG_SECTOR_SIZE;
+  BLOCKCACHE_COUNT(bc, written, numSectors);
+
+  // Write-back: the sectors become dirty in the cache.  Runs of data too
+  // big to be worth holding (they would only push everything else out) go
+  // straight to the image as before; metadata always waits, so it can't
+  // reach the image ahead of the data it describes.
+  int hold = numSectors <= bc->capacity / 4 || startSector < bc->metaEnd;
+  if (bc->writeback && hold && startSector + numSectors <= bc->numSectors) {
+    pthread_mutex_lock(&bc->lock);
+    bc->generation++;
+    for (int i = 0; i < numSectors; i++) {
+      int sector = startSector + i;
+      int slot = bc->slotOf[sector];
+      if (slot < 0) {
+        slot = blockcache_victim(bc);
+        if (slot < 0) {
+          // The cache is full of sectors that can't be written back.  The
+          // sectors before this one stay held.
+          pthread_mutex_unlock(&bc->lock);
+          return -1;
+        }
+        bc->slots[slot].sector = sector;
+        bc->slotOf[sector] = slot;
+      }
+      struct cacheslot *s = &bc->slots[slot];
+      s->referenced = 1;
+      if (!s->dirty) {
+        s->dirty = 1;
+        bc->numDirty++;
+      }
+      memcpy(bc->data + (size_t) slot * DISKIMG_SECTOR_SIZE, src + (size_t) i * DISKIMG_SECTOR_SIZE,
+             DISKIMG_SECTOR_SIZE);
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return nbytes;
+  }
+
+  BLOCKCACHE_COUNT(bc, writebacks, numSectors);
+  nbytes = diskimg_writesectors(bc->dfd, startSector, numSectors, buf);
+  if (nbytes < 0 || bc->capacity == 0) return nbytes;
+
+  // Write through: resident copies of the sectors are updated in place and
+  // are now as new as the disk.
+  pthread_mutex_lock(&bc->lock);
+  bc->generation++;
+  for (int i = 0; i < numSectors; i++) {
+    int sector = startSector + i;
+    int slot = sector < bc->numSectors ? bc->slotOf[sector] : -1;
+    if (slot >= 0) {
+      memcpy(bc->data + (size_t) slot * DISKIMG_SECTOR_SIZE, src + (size_t) i * DISKIMG_SECTOR_SIZE,
+             DISKIMG_SECTOR_SIZE);
+      if (bc->slots[slot].dirty) {
+        bc->slots[slot].dirty = 0;
+        bc->numDirty--;
+      }
+    }
+  }
+  pthread_mutex_unlock(&bc->lock);
+  return nbytes;
+}
+
+/**
+ * Writes back the dirty sectors in [first, end) in ascending order, each
+ * run of consecutive sectors with one gathered write.  Returns 0, or -1 if
+ * a write failed (its sectors stay dirty).
+ */
+static int blockcache_flushrange(struct blockcache *bc, int first, int end, const void **iov) {
+  int err = 0;
+  int runStart = -1, runLength = 0;
+  for (int sector = first; sector <= end; sector++) {
+    int slot = sector < end ? bc->slotOf[sector] : -1;
+    if (slot >= 0 && bc->slots[slot].dirty) {
+      if (runLength == 0) runStart = sector;
+      iov[runLength++] = bc->data + (size_t) slot * DISKIMG_SECTOR_SIZE;
+      if (runLength < bc->capacity) continue;
+    }
+    if (runLength == 0) continue;
+
+    if (diskimg_writesectorv(bc->dfd, runStart, iov, runLength) < 0) {
+      err = -1;
+    } else {
+      BLOCKCACHE_COUNT(bc, writebacks, runLength);
+      bc->generation++;
+      for (int s = runStart; s < runStart + runLength; s++) {
+        bc->slots[bc->slotOf[s]].dirty = 0;
+      }
+      bc->numDirty -= runLength;
+    }
+    runLength = 0;
+  }
+  return err;
+}
+
+/**
+ * Writes back every dirty sector: the data area first, then metadata, so
+ * the image never holds metadata pointing at data that hasn't been written.
+ * With barrier set each group is also synced to stable storage before the
+ * next.  Called with the lock held.
+ */
+static int blockcache_flushlocked(struct blockcache *bc, int barrier) {
+  if (bc->numDirty == 0) {
+    return barrier ? diskimg_sync(bc->dfd) : 0;
+  }
+
+  const void **iov = malloc(bc->capacity * sizeof(void *));
+  if (iov == NULL) return -1;
+  BLOCKCACHE_COUNT(bc, flushes, 1);
+  int metaEnd = bc->metaEnd < bc->numSectors ? bc->metaEnd : bc->numSectors;
+  int err = blockcache_flushrange(bc, metaEnd, bc->numSectors, iov);
+  if (barrier && diskimg_sync(bc->dfd) < 0) err = -1;
+  if (blockcache_flushrange(bc, 0, metaEnd, iov) < 0) err = -1;
+  if (barrier && diskimg_sync(bc->dfd) < 0) err = -1;
+  free(iov);
+  return err;
+}
+
+int blockcache_flush(struct blockcache *bc, int barrier) {
+  pthread_mutex_lock(&bc->lock);
+  int err = blockcache_flushlocked(bc, barrier);
+  pthread_mutex_unlock(&bc->lock);
+  return err;
+}
+
+int blockcache_writesector(struct blockcache *bc, int sectorNum, const void *buf) {
+  return blockcache_writesectors(bc, sectorNum, 1, buf);
+}
+
+int blockcache_dirtysectors(struct blockcache *bc) {
+  if (!bc->writeback) return 0;
+  pthread_mutex_lock(&bc->lock);
+  int n = bc->numDirty;
+  pthread_mutex_unlock(&bc->lock);
+  return n;
+}
+
+void blockcache_getstats(struct blockcache *bc, struct blockcache_stats *stats) {
+  stats->hits = __atomic_load_n(&bc->stats.hits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n(&bc->stats.misses, __ATOMIC_RELAXED);
+  stats->evictions = __atomic_load_n(&bc->stats.evictions, __ATOMIC_RELAXED);
+  stats->mapped = __atomic_load_n(&bc->stats.mapped, __ATOMIC_RELAXED);
+  stats->streamed = __atomic_load_n(&bc->stats.streamed, __ATOMIC_RELAXED);
+  stats->written = __atomic_load_n(&bc->stats.written, __ATOMIC_RELAXED);
+  stats->writebacks = __atomic_load_n(&bc->stats.writebacks, __ATOMIC_RELAXED);
+  stats->flushes = __atomic_load_n(&bc->stats.flushes, __ATOMIC_RELAXED);
+  stats->capacity = bc->stats.capacity;
+}
+
+void blockcache_free(struct blockcache *bc) {
+  if (bc == NULL) return;
+  if (bc->numDirty > 0 && blockcache_flush(bc, 0) < 0) {
+    fprintf(stderr, "Error writing back %d dirty sectors\n", bc->numDirty);
+  }
+  pthread_mutex_destroy(&bc->lock);
+  free(bc->slotOf);
+  free(bc->slots);
+  free(bc->data);
+  free(bc);
+}
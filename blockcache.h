@@ -0,0 +1,121 @@
+#ifndef _BLOCKCACHE_H_
+#define _BLOCKCACHE_H_
+
+#include <stdint.h>
+
+/**
+ * A bounded cache of disk sectors sitting between the filesystem layers and
+ * the diskimg module.  Every sector read done by the inode, file and
+ * directory layers goes through here so that inode-table sectors, indirect
+ * blocks and directory blocks are fetched from the disk image only once
+ * while they stay resident.  Eviction uses the CLOCK (second chance)
+ * algorithm.  When the image is memory mapped the mapping already acts as
+ * the cache and sectors are served from it directly.
+ *
+ * Writes go through to the image unless write-back is switched on, in
+ * which case written sectors stay dirty in the cache until a flush, which
+ * merges consecutive dirty sectors into single pwritev calls.  Dirty
+ * sectors are never evicted; a cache full of them is flushed.
+ *
+ * All functions may be called concurrently from several threads.
+ */
+
+// Number of sectors cached when the caller does not ask for a size.
+#define BLOCKCACHE_DEFAULT_SECTORS 1024
+
+struct blockcache;
+struct fsstats;
+
+struct blockcache_stats {
+  uint64_t hits;        // Reads served from the cache.
+  uint64_t misses;      // Reads that had to go to the disk image.
+  uint64_t evictions;   // Resident sectors dropped to make room.
+  uint64_t mapped;      // Reads served straight from a mapped image.
+  uint64_t streamed;    // Sectors read in bulk by blockcache_readsectors().
+  uint64_t written;     // Sectors written by callers.
+  uint64_t writebacks;  // Sectors written to the disk image.
+  uint64_t flushes;     // Write-backs of the dirty sectors.
+  int capacity;         // Maximum number of resident sectors.
+};
+
+/**
+ * Creates a cache of up to capacity sectors in front of the disk image open
+ * on dfd.  A capacity of 0 gives a pass-through cache that only counts
+ * misses.  Returns NULL on error.
+ */
+struct blockcache *blockcache_create(int dfd, int capacity);
+
+/**
+ * Reads the specified sector into buf, from the cache if it is resident.
+ * Returns the number of bytes read, or -1 on error.
+ */
+int blockcache_readsector(struct blockcache *bc, int sectorNum, void *buf);
+
+/**
+ * Returns a pointer to the contents of the specified sector without copying
+ * it when the disk image is memory mapped.  Otherwise the sector is read into
+ * scratch (which must hold DISKIMG_SECTOR_SIZE bytes) and scratch is
+ * returned.  Returns NULL on error.
+ */
+const void *blockcache_getsector(struct blockcache *bc, int sectorNum, void *scratch);
+
+/**
+ * Reads numSectors consecutive sectors into buf with one bulk read.  Meant
+ * for file data, which is read once and would only push metadata out of the
+ * cache, so the sectors are not added to it.  Returns the number of bytes
+ * read, or -1 on error.
+ */
+int blockcache_readsectors(struct blockcache *bc, int startSector, int numSectors, void *buf);
+
+/**
+ * Writes numSectors consecutive sectors from buf.  In write-back mode they
+ * are kept dirty in the cache (unless the run is a large fraction of it);
+ * otherwise they go to the disk image with one bulk write, updating any of
+ * them that are resident.  Returns the number of bytes written, or -1 on
+ * error, including a write-back write that finds every slot dirty and
+ * can't write them back to make room.
+ */
+int blockcache_writesectors(struct blockcache *bc, int startSector, int numSectors, const void *buf);
+
+/**
+ * Writes one sector; see blockcache_writesectors().
+ */
+int blockcache_writesector(struct blockcache *bc, int sectorNum, const void *buf);
+
+/**
+ * Switches on write-back.  Sectors below metaEnd hold metadata (the
+ * superblock and inode table) and are written back after all other dirty
+ * sectors.  Has no effect on a pass-through cache or a mapped image.
+ */
+void blockcache_setwriteback(struct blockcache *bc, int metaEnd);
+
+/**
+ * Writes back every dirty sector, data before metadata.  With barrier set
+ * the image is synced after the data and again after the metadata.
+ * Returns 0 on success, -1 on error.
+ */
+int blockcache_flush(struct blockcache *bc, int barrier);
+
+/**
+ * Returns the number of dirty sectors waiting to be written back.
+ */
+int blockcache_dirtysectors(struct blockcache *bc);
+
+/**
+ * Makes the cache count the sectors it reads from the disk image, and time
+ * those reads, in the given filesystem statistics (NULL to stop).
+ */
+void blockcache_setstats(struct blockcache *bc, struct fsstats *stats);
+
+/**
+ * Copies the hit/miss counters of the cache into stats.
+ */
+void blockcache_getstats(struct blockcache *bc, struct blockcache_stats *stats);
+
+/**
+ * Writes back any dirty sectors and releases all memory held by the cache.
+ * The disk image is not closed.
+ */
+void blockcache_free(struct blockcache *bc);
+
+#endif // _BLOCKCACHE_H_
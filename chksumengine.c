@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+
+#include "chksumengine.h"
+
+/*
+ * OpenSSL engines, through the EVP interface.  The context is the
+ * EVP_MD_CTX itself.
+ */
+
+static void *evp_begin(const EVP_MD *md) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  if (ctx == NULL) return NULL;
+  if (!EVP_DigestInit_ex(ctx, md, NULL)) {
+    EVP_MD_CTX_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+static void *sha1_begin(void) {
+  return evp_begin(EVP_sha1());
+}
+
+static void *sha256_begin(void) {
+  return evp_begin(EVP_sha256());
+}
+
+static int evp_update(void *ctx, const void *buf, size_t len) {
+  return EVP_DigestUpdate(ctx, buf, len) ? 0 : -1;
+}
+
+static int evp_finish(void *ctx, void *digest) {
+  unsigned int len;
+  int ok = EVP_DigestFinal_ex(ctx, digest, &len);
+  EVP_MD_CTX_free(ctx);
+  return ok ? (int) len : -1;
+}
+
+static void evp_abort(void *ctx) {
+  EVP_MD_CTX_free(ctx);
+}
+
+const struct chksumengine chksumengine_sha1 = {
+  "sha1", 20, sha1_begin, evp_update, evp_finish, evp_abort,
+};
+
+const struct chksumengine chksumengine_sha256 = {
+  "sha256", 32, sha256_begin, evp_update, evp_finish, evp_abort,
+};
+
+/*
+ * XXH64 (seed 0), following the reference algorithm.  Input is consumed in
+ * 32-byte stripes by four accumulators; a partial stripe is kept in buf
+ * between updates.  The digest is the canonical big-endian encoding.
+ */
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+struct xxh64_state {
+  uint64_t v[4];
+  uint64_t total;
+  uint8_t buf[32];
+  size_t buffered;
+};
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));   // XXH64 is defined on little-endian words.
+  return v;
+}
+
+static inline uint32_t xxh_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_PRIME2;
+  acc = xxh_rotl(acc, 31);
+  return acc * XXH_PRIME1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh_round(0, val);
+  return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static void xxh64_stripes(struct xxh64_state *s, const uint8_t *p, size_t numStripes) {
+  uint64_t v0 = s->v[0], v1 = s->v[1], v2 = s->v[2], v3 = s->v[3];
+  for (size_t i = 0; i < numStripes; i++, p += 32) {
+    v0 = xxh_round(v0, xxh_read64(p));
+    v1 = xxh_round(v1, xxh_read64(p + 8));
+    v2 = xxh_round(v2, xxh_read64(p + 16));
+    v3 = xxh_round(v3, xxh_read64(p + 24));
+  }
+  s->v[0] = v0; s->v[1] = v1; s->v[2] = v2; s->v[3] = v3;
+}
+
+static void *xxh64_begin(void) {
+  struct xxh64_state *s = calloc(1, sizeof(struct xxh64_state));
+  if (s == NULL) return NULL;
+  s->v[0] = XXH_PRIME1 + XXH_PRIME2;
+  s->v[1] = XXH_PRIME2;
+  s->v[2] = 0;
+  s->v[3] = -XXH_PRIME1;
+  return s;
+}
+
+static int xxh64_update(void *ctx, const void *buf, size_t len) {
+  struct xxh64_state *s = ctx;
+  const uint8_t *p = buf;
+  s->total += len;
+
+  if (s->buffered > 0) {
+    size_t n = 32 - s->buffered;
+    if (n > len) n = len;
+    memcpy(s->buf + s->buffered, p, n);
+    s->buffered += n;
+    p += n;
+    len -= n;
+    if (s->buffered < 32) return 0;
+    xxh64_stripes(s, s->buf, 1);
+    s->buffered = 0;
+  }
+
+  xxh64_stripes(s, p, len / 32);
+  p += len - len % 32;
+  len %= 32;
+
+  memcpy(s->buf, p, len);
+  s->buffered = len;
+  return 0;
+}
+
+static int xxh64_finish(void *ctx, void *digest) {
+  struct xxh64_state *s = ctx;
+  uint64_t h;
+  if (s->total >= 32) {
+    h = xxh_rotl(s->v[0], 1) + xxh_rotl(s->v[1], 7) + xxh_rotl(s->v[2], 12) + xxh_rotl(s->v[3], 18);
+    for (int i = 0; i < 4; i++) h = xxh_merge(h, s->v[i]);
+  } else {
+    h = s->v[2] + XXH_PRIME5;
+  }
+  h += s->total;
+
+  const uint8_t *p = s->buf;
+  size_t len = s->buffered;
+  for (; len >= 8; p += 8, len -= 8) {
+    h ^= xxh_round(0, xxh_read64(p));
+    h = xxh_rotl(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+  }
+  if (len >= 4) {
+    h ^= (uint64_t) xxh_read32(p) * XXH_PRIME1;
+    h = xxh_rotl(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+    p += 4;
+    len -= 4;
+  }
+  for (; len > 0; p++, len--) {
+    h ^= *p * XXH_PRIME5;
+    h = xxh_rotl(h, 11) * XXH_PRIME1;
+  }
+  h ^= h >> 33;
+  h *= XXH_PRIME2;
+  h ^= h >> 29;
+  h *= XXH_PRIME3;
+  h ^= h >> 32;
+
+  uint8_t *out = digest;
+  for (int i = 0; i < 8; i++) {
+    out[i] = h >> (56 - 8 * i);
+  }
+  free(s);
+  return 8;
+}
+
+static void xxh64_abort(void *ctx) {
+  free(ctx);
+}
+
+const struct chksumengine chksumengine_xxh64 = {
+  "xxh64", 8, xxh64_begin, xxh64_update, xxh64_finish, xxh64_abort,
+};
+
+static const struct chksumengine *const engines[] = {
+  &chksumengine_sha1,
+  &chksumengine_sha256,
+  &chksumengine_xxh64,
+};
+
+const struct chksumengine *chksumengine_get(int i) {
+  if (i < 0 || i >= (int) (sizeof(engines) / sizeof(engines[0]))) return NULL;
+  return engines[i];
+}
+
+const struct chksumengine *chksumengine_byname(const char *name) {
+  for (int i = 0; chksumengine_get(i) != NULL; i++) {
+    if (strcmp(engines[i]->name, name) == 0) return engines[i];
+  }
+  return NULL;
+}
@@ -0,0 +1,51 @@
+#ifndef _CHKSUMENGINE_H_
+#define _CHKSUMENGINE_H_
+
+#include <stddef.h>
+
+// Size of the largest digest any engine produces (SHA-256).
+#define CHKSUMENGINE_MAX_SIZE 32
+
+/**
+ * A content hash used by chksumfile.  begin() returns a new hashing context
+ * (NULL on error), update() feeds it data and returns 0 or -1, and finish()
+ * writes the digest, releases the context and returns the digest length or
+ * -1.  abort() releases a context without producing a digest.
+ */
+struct chksumengine {
+  const char *name;
+  int size;                  // Digest length in bytes.
+  void *(*begin)(void);
+  int (*update)(void *ctx, const void *buf, size_t len);
+  int (*finish)(void *ctx, void *digest);
+  void (*abort)(void *ctx);
+};
+
+/**
+ * SHA-1 (the default, and what the path and inode dumps have always shown).
+ */
+extern const struct chksumengine chksumengine_sha1;
+
+/**
+ * SHA-256.  OpenSSL picks its SHA-NI/AVX2 code path at run time.
+ */
+extern const struct chksumengine chksumengine_sha256;
+
+/**
+ * XXH64: a non-cryptographic 64-bit hash for integrity scans that don't
+ * need SHA-1 compatible output.  Runs four independent lanes, so it is
+ * several times faster than either SHA.
+ */
+extern const struct chksumengine chksumengine_xxh64;
+
+/**
+ * Returns the engine with the given name, or NULL if there is none.
+ */
+const struct chksumengine *chksumengine_byname(const char *name);
+
+/**
+ * Returns the i-th engine, or NULL once i is past the last one.
+ */
+const struct chksumengine *chksumengine_get(int i);
+
+#endif // _CHKSUMENGINE_H_
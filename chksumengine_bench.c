@@ -0,0 +1,102 @@
+/**
+ * Checks every chksumengine against known digests, then measures how fast
+ * each one hashes a buffer fed in chunks the size chksumfile uses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chksumengine.h"
+
+#define BENCH_BYTES (64 * 1024 * 1024)
+#define BENCH_CHUNK (64 * 1024)
+
+struct known {
+  const char *engine;
+  const char *input;
+  const char *digest;
+};
+
+static const struct known knowns[] = {
+  { "sha1", "abc", "a9993e364706816aba3e25717850c26c9cd0d89d" },
+  { "sha256", "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+  { "xxh64", "", "ef46db3751d8e999" },
+  { "xxh64", "abc", "44bc2cf5ad770999" },
+  { "xxh64", "Nobody inspects the spammish repetition", "fbcea83c8a378bf1" },
+};
+
+static int digest_string(const struct chksumengine *e, const void *buf, size_t len,
+                         size_t step, char *out) {
+  unsigned char digest[CHKSUMENGINE_MAX_SIZE];
+  void *ctx = e->begin();
+  if (ctx == NULL) return -1;
+  for (size_t off = 0; off < len; off += step) {
+    size_t n = len - off < step ? len - off : step;
+    if (e->update(ctx, (const char *) buf + off, n) < 0) {
+      e->abort(ctx);
+      return -1;
+    }
+  }
+  int size = e->finish(ctx, digest);
+  for (int i = 0; i < size; i++) sprintf(out + 2 * i, "%02x", digest[i]);
+  return size;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void) {
+  int status = 0;
+  char got[2 * CHKSUMENGINE_MAX_SIZE + 1];
+
+  for (size_t i = 0; i < sizeof(knowns) / sizeof(knowns[0]); i++) {
+    const struct chksumengine *e = chksumengine_byname(knowns[i].engine);
+    size_t len = strlen(knowns[i].input);
+    // Feed it whole and one byte at a time; both must give the digest.
+    for (size_t step = len ? len : 1; ; step = 1) {
+      if (digest_string(e, knowns[i].input, len, step, got) < 0 || strcmp(got, knowns[i].digest) != 0) {
+        fprintf(stderr, "%s(\"%s\") in steps of %zu: got %s, want %s\n",
+                e->name, knowns[i].input, step, got, knowns[i].digest);
+        status = 1;
+      }
+      if (step == 1) break;
+    }
+  }
+
+  unsigned char *buf = malloc(BENCH_BYTES);
+  if (buf == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+  srand(13);
+  for (size_t i = 0; i < BENCH_BYTES; i++) buf[i] = rand();
+
+  for (int i = 0; chksumengine_get(i) != NULL; i++) {
+    const struct chksumengine *e = chksumengine_get(i);
+
+    // Unaligned, odd-sized updates must not change the digest.
+    char whole[2 * CHKSUMENGINE_MAX_SIZE + 1];
+    digest_string(e, buf, 100003, 100003, whole);
+    digest_string(e, buf, 100003, 37, got);
+    if (strcmp(whole, got) != 0) {
+      fprintf(stderr, "%s: digest depends on update sizes\n", e->name);
+      status = 1;
+    }
+
+    double start = now_ns();
+    if (digest_string(e, buf, BENCH_BYTES, BENCH_CHUNK, got) < 0) {
+      fprintf(stderr, "%s: hashing failed\n", e->name);
+      status = 1;
+      continue;
+    }
+    double elapsed = now_ns() - start;
+    printf("%-8s %8.1f MB/s\n", e->name, BENCH_BYTES / (elapsed / 1e9) / (1024 * 1024));
+  }
+  free(buf);
+  return status;
+}
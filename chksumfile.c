@@ -11,43 +11,122 @@
 #include "directory.h"
 #include "pathname.h"
 #include "chksumfile.h"
-#include <openssl/sha.h>
+#include "fsstats.h"
+#include "blockcache.h"
+#include "fserror.h"
 
-int chksumfile_byinumber(struct unixfilesystem *fs, int inumber, void *chksum) {
-  SHA_CTX shactx;
-  if (!SHA1_Init(&shactx)) {
-    // An error occurred initializing the SHA1 context.
-    return -1;
-  }
+// Bytes of file data hashed per engine update (one file_reader chunk).
+#define CHKSUMFILE_READ_CHUNK (64 * 1024)
 
-  struct inode in;
-  int err = inode_iget(fs, inumber, &in);
-  if (err < 0) {
-    return err;
+// Longest read of chksumfile_scan(), in sectors.
+#define CHKSUMFILE_SCAN_READ_BLOCKS 128
+
+// File data chksumfile_scan() holds for files whose blocks arrive out of
+// order; a file that would need more is hashed the usual way.
+#define CHKSUMFILE_SCAN_MAX_BUFFERED (16 * 1024 * 1024)
+
+/**
+ * Copies the memoised checksum of inumber into chksum.  Returns its length,
+ * or 0 if there is none.  If generation isn't NULL it is set to the memo's
+ * generation, to be handed to chksumfile_memo_put().
+ */
+static int chksumfile_memo_get(struct unixfilesystem *fs, int inumber, void *chksum, unsigned *generation) {
+  if (fs->chksums == NULL || inumber < 1 || inumber >= fs->numChksums) return 0;
+  pthread_mutex_lock(&fs->chksumLock);
+  struct chksumfile_memo *m = &fs->chksums[inumber];
+  int size = m->size;
+  memcpy(chksum, m->chksum, size);
+  if (generation != NULL) *generation = fs->chksumGeneration;
+  pthread_mutex_unlock(&fs->chksumLock);
+  return size;
+}
+
+/**
+ * Memoises the checksum of inumber, computed from what the file held when
+ * the memo was at generation.  It is dropped if checksums were invalidated
+ * since, as it may be stale.
+ */
+static void chksumfile_memo_put(struct unixfilesystem *fs, int inumber, const void *chksum, int size,
+                                unsigned generation) {
+  if (fs->chksums == NULL || inumber < 1 || inumber >= fs->numChksums) return;
+  pthread_mutex_lock(&fs->chksumLock);
+  if (fs->chksumGeneration == generation) {
+    struct chksumfile_memo *m = &fs->chksums[inumber];
+    memcpy(m->chksum, chksum, size);
+    m->size = size;
   }
+  pthread_mutex_unlock(&fs->chksumLock);
+}
 
-  if (!(in.i_mode & IALLOC)) {
-    // The inode isn't allocated, so we can't hash it.
-    return -1;
+void chksumfile_invalidate(struct unixfilesystem *fs, int inumber) {
+  if (fs->chksums == NULL) return;
+  pthread_mutex_lock(&fs->chksumLock);
+  fs->chksumGeneration++;
+  for (int i = 0; i < fs->numChksums; i++) {
+    if (inumber == 0 || i == inumber) fs->chksums[i].size = 0;
   }
+  pthread_mutex_unlock(&fs->chksumLock);
+}
 
-  int size = inode_getsize(&in);
-  for (int offset = 0; offset < size; offset += DISKIMG_SECTOR_SIZE) {
-    char buf[DISKIMG_SECTOR_SIZE];
-    int bno = offset/DISKIMG_SECTOR_SIZE;
+void chksumfile_setengine(struct unixfilesystem *fs, const struct chksumengine *engine) {
+  fs->chksumEngine = engine;
+  chksumfile_invalidate(fs, 0);
+}
 
-    int bytesMoved = file_getblock(fs, inumber, bno, buf);
-    if (bytesMoved < 0)
-      return -1;
+/**
+ * Hashes the contents of inumber with the engine of fs.
+ */
+static int chksumfile_hash(struct unixfilesystem *fs, int inumber, void *chksum) {
+  // Hash the file in large chunks.  The reader turns each chunk into a few
+  // bulk reads of contiguous blocks and keeps the next chunks' reads in
+  // flight while this one is hashed, so the engine sees few large updates
+  // and rarely waits for the disk.
+  struct file_reader *reader = file_reader_open(fs, inumber, CHKSUMFILE_READ_CHUNK);
+  if (reader == NULL) {
+    return -1;
+  }
 
-    if (!SHA1_Update(&shactx, buf, bytesMoved))
-      return -1;
+  const struct chksumengine *engine = fs->chksumEngine ? fs->chksumEngine : &chksumengine_sha1;
+  void *ctx = engine->begin();
+  if (ctx == NULL) {
+    // An error occurred initializing the hash context.
+    file_reader_close(reader);
+    return -1;
   }
 
-  if (!SHA1_Final(chksum, &shactx))
+  const void *data;
+  int bytesMoved;
+  while ((bytesMoved = file_reader_next(reader, &data)) > 0) {
+    if (engine->update(ctx, data, bytesMoved) < 0) {
+      bytesMoved = -1;
+      break;
+    }
+  }
+  file_reader_close(reader);
+  if (bytesMoved < 0) {
+    engine->abort(ctx);
     return -1;
+  }
 
-  return SHA_DIGEST_LENGTH;
+  return engine->finish(ctx, chksum);
+}
+
+int chksumfile_byinumber(struct unixfilesystem *fs, int inumber, void *chksum) {
+  unsigned generation = 0;
+  int memoSize = chksumfile_memo_get(fs, inumber, chksum, &generation);
+  if (memoSize > 0) {
+    FSSTATS_COUNT(fs->stats, FSSTATS_CHKSUM_MEMO_HITS, 1);
+    return memoSize;
+  }
+
+  FSSTATS_COUNT(fs->stats, FSSTATS_FILES_HASHED, 1);
+  FSSTATS_TIME_BEGIN(fs->stats, start);
+  int size = chksumfile_hash(fs, inumber, chksum);
+  FSSTATS_TIME_END(fs->stats, FSSTATS_LAYER_CHKSUMFILE, start);
+  if (size > 0) {
+    chksumfile_memo_put(fs, inumber, chksum, size, generation);
+  }
+  return size;
 }
 
 int chksumfile_bypathname(struct unixfilesystem *fs, const char *pathname, void *chksum) {
@@ -59,19 +138,314 @@ int chksumfile_bypathname(struct unixfilesystem *fs, const char *pathname, void
   return chksumfile_byinumber(fs, inumber, chksum);
 }
 
-void chksumfile_cvt2string(void *chksum, char *outstring) {
+/**
+ * A run of blocks of one scanned file that are consecutive on disk, at most
+ * CHKSUMFILE_SCAN_READ_BLOCKS long.
+ */
+struct chksumscan_run {
+  int diskBlock;
+  int numBlocks;
+  int fileBlock;
+  int file;                  // Index in chksumscan.files.
+};
+
+/**
+ * Blocks of a file that arrived before the ones preceding them, kept in a
+ * list sorted by fileBlock until the hash reaches them.  The holes of the
+ * file are queued here up front as zeros entries, which carry no data.
+ */
+struct chksumscan_pending {
+  struct chksumscan_pending *next;
+  int fileBlock;
+  int numBlocks;
+  int zeros;                 // A hole: numBlocks blocks of zeros.
+  unsigned char data[];
+};
+
+// What holes are hashed from, CHKSUMFILE_SCAN_READ_BLOCKS at a time.
+static const unsigned char chksumscan_zeros[CHKSUMFILE_SCAN_READ_BLOCKS * DISKIMG_SECTOR_SIZE];
+
+struct chksumscan_file {
+  int inumber;
+  int size;
+  int numBlocks;
+  int nextBlock;             // Next block the hash needs.
+  int failed;                // Left to chksumfile_byinumber().
+  void *ctx;                 // Hash context, begun with the first block.
+  long buffered;             // Bytes in pending.
+  struct chksumscan_pending *pending;
+};
+
+struct chksumscan {
+  struct unixfilesystem *fs;
+  const struct chksumengine *engine;
+  struct chksumscan_file *files;
+  int numFiles;
+  struct chksumscan_run *runs;
+  int numRuns;
+  int capacity;
+  long buffered;             // Bytes pending over all files.
+  int hashed;
+  unsigned generation;       // Of the memo when the scan started.
+};
+
+/**
+ * Drops whatever the scan holds for file f.  chksumfile_byinumber() will
+ * hash it the usual way.
+ */
+static void chksumscan_abandon(struct chksumscan *scan, struct chksumscan_file *f) {
+  if (f->ctx != NULL) {
+    scan->engine->abort(f->ctx);
+    f->ctx = NULL;
+  }
+  while (f->pending != NULL) {
+    struct chksumscan_pending *p = f->pending;
+    f->pending = p->next;
+    free(p);
+  }
+  scan->buffered -= f->buffered;
+  f->buffered = 0;
+  f->failed = 1;
+}
+
+/**
+ * Hashes numBlocks blocks of f, which must be the next ones it needs, from
+ * data or, if data is NULL, as zeros.
+ */
+static void chksumscan_feed(struct chksumscan *scan, struct chksumscan_file *f,
+                            const void *data, int numBlocks) {
+  if (f->ctx == NULL && (f->ctx = scan->engine->begin()) == NULL) {
+    chksumscan_abandon(scan, f);
+    return;
+  }
+  while (numBlocks > 0) {
+    int n = data != NULL || numBlocks < CHKSUMFILE_SCAN_READ_BLOCKS ? numBlocks : CHKSUMFILE_SCAN_READ_BLOCKS;
+    long len = (long) n * DISKIMG_SECTOR_SIZE;
+    long left = f->size - (long) f->nextBlock * DISKIMG_SECTOR_SIZE;
+    if (scan->engine->update(f->ctx, data != NULL ? data : chksumscan_zeros, len < left ? len : left) < 0) {
+      chksumscan_abandon(scan, f);
+      return;
+    }
+    f->nextBlock += n;
+    numBlocks -= n;
+  }
+}
+
+/**
+ * Hashes the pending blocks of f that have become next in line, and
+ * finishes f when it has been hashed completely.
+ */
+static void chksumscan_drain(struct chksumscan *scan, struct chksumscan_file *f) {
+  while (!f->failed && f->pending != NULL && f->pending->fileBlock == f->nextBlock) {
+    struct chksumscan_pending *p = f->pending;
+    f->pending = p->next;
+    long len = p->zeros ? 0 : (long) p->numBlocks * DISKIMG_SECTOR_SIZE;
+    f->buffered -= len;
+    scan->buffered -= len;
+    chksumscan_feed(scan, f, p->zeros ? NULL : p->data, p->numBlocks);
+    free(p);
+  }
+
+  if (!f->failed && f->nextBlock == f->numBlocks) {
+    char chksum[CHKSUMFILE_SIZE];
+    int size = scan->engine->finish(f->ctx, chksum);
+    f->ctx = NULL;
+    if (size > 0) {
+      chksumfile_memo_put(scan->fs, f->inumber, chksum, size, scan->generation);
+      scan->hashed++;
+      FSSTATS_COUNT(scan->fs->stats, FSSTATS_FILES_HASHED, 1);
+    }
+    f->failed = 1;           // Done: nothing more to deliver.
+  }
+}
+
+/**
+ * Hands numBlocks blocks of f starting at fileBlock to its hash, or keeps
+ * a copy of them until the blocks before them have been hashed.
+ */
+static void chksumscan_deliver(struct chksumscan *scan, struct chksumscan_file *f,
+                               int fileBlock, int numBlocks, const void *data) {
+  if (f->failed) return;
+
+  if (fileBlock != f->nextBlock) {
+    long len = (long) numBlocks * DISKIMG_SECTOR_SIZE;
+    struct chksumscan_pending *p = NULL;
+    if (scan->buffered + len <= CHKSUMFILE_SCAN_MAX_BUFFERED) {
+      p = malloc(sizeof(struct chksumscan_pending) + len);
+    }
+    if (p == NULL) {
+      chksumscan_abandon(scan, f);
+      return;
+    }
+    p->fileBlock = fileBlock;
+    p->numBlocks = numBlocks;
+    p->zeros = 0;
+    memcpy(p->data, data, len);
+    struct chksumscan_pending **link = &f->pending;
+    while (*link != NULL && (*link)->fileBlock < fileBlock) link = &(*link)->next;
+    p->next = *link;
+    *link = p;
+    f->buffered += len;
+    scan->buffered += len;
+    return;
+  }
+
+  chksumscan_feed(scan, f, data, numBlocks);
+  chksumscan_drain(scan, f);
+}
+
+/**
+ * Adds the runs of inumber to the scan, split at CHKSUMFILE_SCAN_READ_BLOCKS,
+ * and queues its holes as zeros.  A file made only of holes is hashed right
+ * away.  Files already memoised or empty are left out.  Returns 0, or
+ * FSERR_NOMEM.
+ */
+static int chksumscan_add(struct chksumscan *scan, int inumber) {
+  struct unixfilesystem *fs = scan->fs;
+  char chksum[CHKSUMFILE_SIZE];
+  struct inode in;
+  if (!inode_isallocated(fs, inumber) || chksumfile_memo_get(fs, inumber, chksum, NULL) > 0 ||
+      inode_iget(fs, inumber, &in) < 0 || inode_getsize(&in) == 0) {
+    return 0;
+  }
+  struct inode_blockmap *map = inode_blockmap_build(fs, &in, NULL);
+  if (map == NULL) {
+    return 0;
+  }
+
+  struct chksumscan_file *f = &scan->files[scan->numFiles];
+  memset(f, 0, sizeof(*f));
+  f->inumber = inumber;
+  f->size = map->size;
+  f->numBlocks = map->numBlocks;
+  struct chksumscan_pending **tail = &f->pending;
+  for (int e = 0; e < map->numExtents; e++) {
+    const struct inode_extent *ext = &map->extents[e];
+    if (ext->diskBlock != 0) continue;
+    struct chksumscan_pending *p = malloc(sizeof(struct chksumscan_pending));
+    if (p == NULL) {
+      // Left to chksumfile_byinumber().
+      chksumscan_abandon(scan, f);
+      inode_blockmap_free(map);
+      return 0;
+    }
+    p->next = NULL;
+    p->fileBlock = ext->fileBlock;
+    p->numBlocks = ext->numBlocks;
+    p->zeros = 1;
+    *tail = p;
+    tail = &p->next;
+  }
+
+  for (int e = 0; e < map->numExtents; e++) {
+    const struct inode_extent *ext = &map->extents[e];
+    if (ext->diskBlock == 0) continue;
+    for (int b = 0; b < ext->numBlocks; b += CHKSUMFILE_SCAN_READ_BLOCKS) {
+      if (scan->numRuns == scan->capacity) {
+        int capacity = scan->capacity ? 2 * scan->capacity : 1024;
+        struct chksumscan_run *runs = realloc(scan->runs, capacity * sizeof(struct chksumscan_run));
+        if (runs == NULL) {
+          chksumscan_abandon(scan, f);
+          inode_blockmap_free(map);
+          return FSERR_NOMEM;
+        }
+        scan->runs = runs;
+        scan->capacity = capacity;
+      }
+      struct chksumscan_run *r = &scan->runs[scan->numRuns++];
+      r->diskBlock = ext->diskBlock + b;
+      r->fileBlock = ext->fileBlock + b;
+      r->numBlocks = ext->numBlocks - b < CHKSUMFILE_SCAN_READ_BLOCKS ? ext->numBlocks - b : CHKSUMFILE_SCAN_READ_BLOCKS;
+      r->file = scan->numFiles;
+    }
+  }
+  scan->numFiles++;
+  inode_blockmap_free(map);
+  // A leading hole is hashed now, before any block is read.
+  chksumscan_drain(scan, f);
+  return 0;
+}
+
+static int chksumscan_cmp(const void *a, const void *b) {
+  const struct chksumscan_run *ra = a, *rb = b;
+  return (ra->diskBlock > rb->diskBlock) - (ra->diskBlock < rb->diskBlock);
+}
+
+int chksumfile_scan(struct unixfilesystem *fs, const int *inumbers, int count) {
+  if (fs->chksums == NULL) {
+    return 0;
+  }
+
+  struct chksumscan scan;
+  memset(&scan, 0, sizeof(scan));
+  scan.fs = fs;
+  scan.engine = fs->chksumEngine ? fs->chksumEngine : &chksumengine_sha1;
+  pthread_mutex_lock(&fs->chksumLock);
+  scan.generation = fs->chksumGeneration;
+  pthread_mutex_unlock(&fs->chksumLock);
+  scan.files = malloc((count > 0 ? count : 1) * sizeof(struct chksumscan_file));
+  unsigned char *buf = malloc(CHKSUMFILE_SCAN_READ_BLOCKS * DISKIMG_SECTOR_SIZE);
+  int err = scan.files != NULL && buf != NULL ? 0 : FSERR_NOMEM;
+
+  FSSTATS_TIME_BEGIN(fs->stats, start);
+  // 1. Gather the block maps of every file and sort their runs by sector.
+  for (int i = 0; i < count && err == 0; i++) {
+    err = chksumscan_add(&scan, inumbers[i]);
+  }
+  if (err == 0) {
+    qsort(scan.runs, scan.numRuns, sizeof(struct chksumscan_run), chksumscan_cmp);
+  }
+
+  // 2. One sweep up the disk.  Runs that are adjacent on disk, whichever
+  //    files they belong to, are read together.
+  for (int i = 0; i < scan.numRuns && err == 0; ) {
+    int first = i;
+    int numBlocks = 0;
+    do {
+      numBlocks += scan.runs[i++].numBlocks;
+    } while (i < scan.numRuns && scan.runs[i].diskBlock == scan.runs[first].diskBlock + numBlocks &&
+             numBlocks + scan.runs[i].numBlocks <= CHKSUMFILE_SCAN_READ_BLOCKS);
+
+    int ok = blockcache_readsectors(fs->cache, scan.runs[first].diskBlock, numBlocks, buf) ==
+             numBlocks * DISKIMG_SECTOR_SIZE;
+    for (int r = first, offset = 0; r < i; offset += scan.runs[r++].numBlocks) {
+      struct chksumscan_file *f = &scan.files[scan.runs[r].file];
+      if (ok) {
+        chksumscan_deliver(&scan, f, scan.runs[r].fileBlock, scan.runs[r].numBlocks,
+                           buf + (size_t) offset * DISKIMG_SECTOR_SIZE);
+      } else if (!f->failed) {
+        fserror_record(fs, FSERR_IO, "Failed to read %d sectors at %d for inumber %d", NULL,
+                       numBlocks, scan.runs[first].diskBlock, f->inumber);
+        chksumscan_abandon(&scan, f);
+      }
+    }
+  }
+  FSSTATS_TIME_END(fs->stats, FSSTATS_LAYER_CHKSUMFILE, start);
+
+  // Files left unfinished are hashed later by chksumfile_byinumber().
+  for (int i = 0; i < scan.numFiles; i++) {
+    chksumscan_abandon(&scan, &scan.files[i]);
+  }
+  free(scan.files);
+  free(scan.runs);
+  free(buf);
+  return err < 0 ? err : scan.hashed;
+}
+
+void chksumfile_cvt2string(void *chksum, int size, char *outstring) {
   uint8_t *c = (uint8_t *) chksum;
 
-  for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+  outstring[0] = '\0';
+  for (int i = 0; i < size; i++) {
     sprintf(outstring + 2 * i, "%02x", c[i]);
   }
 }
 
-int chksumfile_compare(void *chksum1, void *chksum2) {
+int chksumfile_compare(void *chksum1, void *chksum2, int size) {
   uint8_t *c1 = (uint8_t *) chksum1;
   uint8_t *c2 = (uint8_t *) chksum2;
 
-  for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+  for (int i = 0; i < size; i++) {
     if (c1[i] != c2[i]) return 0;
   }
   return 1;
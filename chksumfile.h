@@ -1,18 +1,57 @@
 #ifndef _CHKSUMFILE_H_
 #define _CHKSUMFILE_H_
 
+#include <stdint.h>
+
 #include "unixfilesystem.h"
+#include "chksumengine.h"
 
-#define CHKSUMFILE_SIZE 20   
+// Largest checksum of any engine; the length in use is what the
+// chksumfile_by* functions return.
+#define CHKSUMFILE_SIZE CHKSUMENGINE_MAX_SIZE
 #define CHKSUMFILE_STRINGSIZE ((2*CHKSUMFILE_SIZE)+1)
 
+/**
+ * Memoised checksum of one inode (see unixfilesystem.chksums).
+ */
+struct chksumfile_memo {
+  uint8_t size;              // Checksum length, 0 if not computed.
+  uint8_t chksum[CHKSUMFILE_SIZE];
+};
+
+/**
+ * Selects the hash used for the checksums of fs (SHA-1 by default) and
+ * forgets all memoised checksums.  Must not be called while other threads
+ * are computing checksums of fs.
+ */
+void chksumfile_setengine(struct unixfilesystem *fs, const struct chksumengine *engine);
+
 /**
  * Computes the checksum of a inumber.  Assumes chksum arguments points to a
  * CHKSUMFILE_SIZE byte array.  Returns the length of the checksum, or -1 if
  * it encounters an error.
+ *
+ * When the filesystem memoises checksums, each inode is hashed only the
+ * first time it is asked for; later calls return the remembered checksum.
  */
 int chksumfile_byinumber(struct unixfilesystem *fs, int inumber, void *chksum);
 
+/**
+ * Hashes the given inodes in the order their blocks lie on disk rather
+ * than one file after another, and memoises their checksums, so a dump
+ * that then asks for them in its own order reads nothing.  The block maps
+ * of all the files are gathered first and their data is read in one sweep
+ * up the disk, runs adjacent on disk being read together whatever files
+ * they belong to.  Each block is streamed into its file's hash; blocks that
+ * arrive ahead of earlier blocks of the same file wait in a per-file
+ * buffer.  Holes are hashed as zeros without being read.  Files that are
+ * already memoised or empty, or that would push those buffers past their
+ * cap, are left for chksumfile_byinumber().
+ * Does nothing unless the filesystem memoises checksums.  Returns the
+ * number of files hashed, or a negative FSERR_* code.
+ */
+int chksumfile_scan(struct unixfilesystem *fs, const int *inumbers, int count);
+
 /**
  * Compute the checksum of the specified pathname.  Assumes chksum points to a
  * CHKSUMFILE_SIZE byte array. Returns the length of the checksum or -1 if
@@ -21,14 +60,21 @@ int chksumfile_byinumber(struct unixfilesystem *fs, int inumber, void *chksum);
 int chksumfile_bypathname(struct unixfilesystem *fs, const char *pathname, void *chksum);
 
 /**
- * Converts a checksum into a string that can be printed.  Assumes
- * that outstring is CHKSUMFILE_STRINGSIZE in size.
+ * Forgets the memoised checksum of inumber, or of every inode if inumber is
+ * 0.  Must be called by any code that modifies a file.
+ */
+void chksumfile_invalidate(struct unixfilesystem *fs, int inumber);
+
+/**
+ * Converts a checksum of size bytes into a string that can be printed.
+ * Assumes that outstring is CHKSUMFILE_STRINGSIZE in size.
  */
-void chksumfile_cvt2string(void *chksum, char *outstring);
+void chksumfile_cvt2string(void *chksum, int size, char *outstring);
 
 /**
- * Compares two checksums, returning 1 if they're the same and 0 otherwise.
+ * Compares two checksums of size bytes, returning 1 if they're the same and
+ * 0 otherwise.
  */
-int chksumfile_compare(void *chksum1, void *chksum2);
+int chksumfile_compare(void *chksum1, void *chksum2, int size);
 
 #endif // _CHKSUMFILE_H_
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dcache.h"
+#include "direntv6.h"
+
+#define DCACHE_NAMELEN sizeof(((struct direntv6 *) 0)->d_name)
+
+struct dentry {
+  int dirinumber;                // 0 if the slot is empty.
+  int inumber;                   // 0 for a negative entry.
+  char name[DCACHE_NAMELEN];     // NUL padded like a direntv6 name.
+};
+
+struct dcache {
+  int capacity;
+  struct dentry *entries;
+  pthread_mutex_t lock;          // Protects entries and generation.
+  unsigned generation;           // Bumped by every invalidation.
+  struct dcache_stats stats;
+};
+
+#define DCACHE_COUNT(dc, field) \
+  __atomic_fetch_add(&(dc)->stats.field, 1, __ATOMIC_RELAXED)
+
+/**
+ * Copies name into a NUL padded buffer of DCACHE_NAMELEN bytes.  Returns -1
+ * if the name is too long to be stored in a directory entry.
+ */
+static int dcache_padname(const char *name, char *padded) {
+  size_t len = strlen(name);
+  if (len > DCACHE_NAMELEN) return -1;
+  memset(padded, 0, DCACHE_NAMELEN);
+  memcpy(padded, name, len);
+  return 0;
+}
+
+/**
+ * FNV-1a over the directory inumber and the padded name.
+ */
+static int dcache_slot(struct dcache *dc, int dirinumber, const char *padded) {
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < 4; i++) {
+    h = (h ^ ((dirinumber >> (8 * i)) & 0xff)) * 16777619u;
+  }
+  for (size_t i = 0; i < DCACHE_NAMELEN && padded[i] != 0; i++) {
+    h = (h ^ (uint8_t) padded[i]) * 16777619u;
+  }
+  return h % dc->capacity;
+}
+
+struct dcache *dcache_create(int capacity) {
+  if (capacity < 0) return NULL;
+
+  struct dcache *dc = calloc(1, sizeof(struct dcache));
+  if (dc == NULL) return NULL;
+  dc->capacity = capacity;
+  if (capacity > 0) {
+    dc->entries = calloc(capacity, sizeof(struct dentry));
+    if (dc->entries == NULL) {
+      free(dc);
+      return NULL;
+    }
+  }
+  pthread_mutex_init(&dc->lock, NULL);
+  return dc;
+}
+
+int dcache_lookup(struct dcache *dc, int dirinumber, const char *name, int *inumber) {
+  char padded[DCACHE_NAMELEN];
+  if (dc->capacity == 0 || dcache_padname(name, padded) < 0) {
+    DCACHE_COUNT(dc, misses);
+    return 0;
+  }
+
+  int found = 0;
+  pthread_mutex_lock(&dc->lock);
+  struct dentry *e = &dc->entries[dcache_slot(dc, dirinumber, padded)];
+  if (e->dirinumber == dirinumber && memcmp(e->name, padded, DCACHE_NAMELEN) == 0) {
+    *inumber = e->inumber;
+    found = 1;
+  }
+  pthread_mutex_unlock(&dc->lock);
+
+  if (!found) {
+    DCACHE_COUNT(dc, misses);
+  } else if (*inumber == 0) {
+    DCACHE_COUNT(dc, negativeHits);
+  } else {
+    DCACHE_COUNT(dc, hits);
+  }
+  return found;
+}
+
+unsigned dcache_generation(struct dcache *dc) {
+  return __atomic_load_n(&dc->generation, __ATOMIC_ACQUIRE);
+}
+
+void dcache_insert(struct dcache *dc, int dirinumber, const char *name, int inumber, unsigned generation) {
+  char padded[DCACHE_NAMELEN];
+  if (dc->capacity == 0 || dirinumber == 0 || dcache_padname(name, padded) < 0) return;
+
+  pthread_mutex_lock(&dc->lock);
+  if (dc->generation == generation) {
+    struct dentry *e = &dc->entries[dcache_slot(dc, dirinumber, padded)];
+    e->dirinumber = dirinumber;
+    e->inumber = inumber;
+    memcpy(e->name, padded, DCACHE_NAMELEN);
+  }
+  pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_invalidate(struct dcache *dc, int dirinumber) {
+  pthread_mutex_lock(&dc->lock);
+  __atomic_store_n(&dc->generation, dc->generation + 1, __ATOMIC_RELEASE);
+  for (int i = 0; i < dc->capacity; i++) {
+    if (dirinumber == 0 || dc->entries[i].dirinumber == dirinumber) {
+      dc->entries[i].dirinumber = 0;
+    }
+  }
+  pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_getstats(struct dcache *dc, struct dcache_stats *stats) {
+  stats->hits = __atomic_load_n(&dc->stats.hits, __ATOMIC_RELAXED);
+  stats->negativeHits = __atomic_load_n(&dc->stats.negativeHits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n(&dc->stats.misses, __ATOMIC_RELAXED);
+}
+
+void dcache_free(struct dcache *dc) {
+  if (dc == NULL) return;
+  pthread_mutex_destroy(&dc->lock);
+  free(dc->entries);
+  free(dc);
+}
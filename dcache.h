@@ -0,0 +1,63 @@
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+#include <stdint.h>
+
+/**
+ * A cache of directory lookups, mapping (directory inumber, name) to the
+ * inumber the name refers to.  Failed lookups are cached too, as negative
+ * entries, so repeated misses don't rescan the directory either.  The table
+ * is hashed and direct mapped: a new entry simply replaces whatever entry
+ * shares its slot, which keeps the memory bounded.
+ *
+ * All functions may be called concurrently from several threads.
+ */
+
+// Number of entries cached when the caller does not ask for a size.
+#define DCACHE_DEFAULT_ENTRIES 4096
+
+struct dcache;
+
+struct dcache_stats {
+  uint64_t hits;           // Lookups answered by a positive entry.
+  uint64_t negativeHits;   // Lookups answered by a negative entry.
+  uint64_t misses;         // Lookups the caller had to resolve itself.
+};
+
+/**
+ * Creates a cache of up to capacity entries.  A capacity of 0 disables
+ * caching.  Returns NULL on error.
+ */
+struct dcache *dcache_create(int capacity);
+
+/**
+ * Looks up name in directory dirinumber.  Returns 1 and sets *inumber on a
+ * hit (*inumber is 0 for a cached "not found"), or 0 on a miss.
+ */
+int dcache_lookup(struct dcache *dc, int dirinumber, const char *name, int *inumber);
+
+/**
+ * Returns the cache's generation, which every dcache_invalidate() bumps.
+ * Read it before resolving a name the cache missed.
+ */
+unsigned dcache_generation(struct dcache *dc);
+
+/**
+ * Records that name in directory dirinumber refers to inumber, or that it
+ * doesn't exist if inumber is 0, as found when the cache was at
+ * generation.  Nothing is recorded if the cache has been invalidated since:
+ * the directory may have changed under the lookup.
+ */
+void dcache_insert(struct dcache *dc, int dirinumber, const char *name, int inumber, unsigned generation);
+
+/**
+ * Drops every entry of directory dirinumber, or all entries if dirinumber
+ * is 0.  Must be called whenever a directory is modified.
+ */
+void dcache_invalidate(struct dcache *dc, int dirinumber);
+
+void dcache_getstats(struct dcache *dc, struct dcache_stats *stats);
+
+void dcache_free(struct dcache *dc);
+
+#endif // _DCACHE_H_
@@ -1,80 +1,270 @@
 #include "directory.h"
 #include "inode.h"
 #include "diskimg.h"
+#include "blockcache.h"
 #include "file.h"
 #include "unixfilesystem.h"
 #include "direntv6.h"
+#include "dcache.h"
+#include "direntscan.h"
+#include "fsstats.h"
+#include "fserror.h"
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 
-// Helper macro for error returns, can be adapted if specific negative error codes are needed
-#define DIRECTORY_FAILURE -1 
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * In-memory hash index of all names in one directory, built the first time
+ * the directory is searched.  Open addressing with linear probing; a slot
+ * with d_inumber 0 is empty.
+ */
+struct dirindex {
+    unsigned mask;               // Number of slots - 1 (a power of two minus one).
+    struct direntv6 slots[];
+};
+
+#define DIRENT_NAMELEN sizeof(((struct direntv6 *) 0)->d_name)
+
+/**
+ * FNV-1a over a directory entry name (up to its first NUL or 14 bytes).
+ */
+static unsigned dirindex_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < DIRENT_NAMELEN && name[i] != 0; i++) {
+        h = (h ^ (uint8_t) name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Reads every entry of the directory and builds its index.  Returns NULL if
+ * the directory can't be read or has a hole, in which case callers fall
+ * back to scanning as they do when indexDirectories is off.
+ */
+static struct dirindex *dirindex_build(struct unixfilesystem *fs, int dirinumber, int dir_size_bytes) {
+    // V6 directories have no holes.  file_read would return one as zeros,
+    // so a directory with a hole is left to the scan, which reports it as
+    // corrupt like directory_iterator does.
+    int err;
+    struct inode_blockmap *map = inode_getblockmap(fs, dirinumber, &err);
+    if (map == NULL) {
+        return NULL;
+    }
+    int has_hole = 0;
+    for (int i = 0; i < map->numExtents; i++) {
+        if (map->extents[i].diskBlock == 0) {
+            has_hole = 1;
+        }
+    }
+    inode_putblockmap(map);
+    if (has_hole) {
+        return NULL;
+    }
+
+    struct direntv6 *entries = malloc(dir_size_bytes);
+    if (entries == NULL) {
+        return NULL;
+    }
+    if (file_read(fs, dirinumber, 0, dir_size_bytes, entries) != dir_size_bytes) {
+        free(entries);
+        return NULL;
+    }
+
+    // Keep the table at most half full.
+    int num_entries = dir_size_bytes / sizeof(struct direntv6);
+    FSSTATS_COUNT(fs->stats, FSSTATS_DIRINDEX_BUILDS, 1);
+    FSSTATS_COUNT(fs->stats, FSSTATS_DIRENTS_SCANNED, num_entries);
+    unsigned num_slots = 8;
+    while (num_slots < 2u * num_entries) {
+        num_slots *= 2;
+    }
+
+    struct dirindex *index = calloc(1, sizeof(struct dirindex) + num_slots * sizeof(struct direntv6));
+    if (index == NULL) {
+        free(entries);
+        return NULL;
+    }
+    index->mask = num_slots - 1;
+
+    for (int i = 0; i < num_entries; i++) {
+        if (entries[i].d_inumber == 0) {
+            continue;   // Unused entry.
+        }
+        unsigned h = dirindex_hash(entries[i].d_name) & index->mask;
+        int duplicate = 0;
+        while (index->slots[h].d_inumber != 0) {
+            if (strncmp(index->slots[h].d_name, entries[i].d_name, DIRENT_NAMELEN) == 0) {
+                duplicate = 1;   // A scan would stop at the first one, keep that.
+                break;
+            }
+            h = (h + 1) & index->mask;
+        }
+        if (!duplicate) {
+            index->slots[h] = entries[i];
+        }
+    }
+
+    free(entries);
+    return index;
+}
+
+static const struct direntv6 *dirindex_find(const struct dirindex *index, const char *name) {
+    unsigned h = dirindex_hash(name) & index->mask;
+    while (index->slots[h].d_inumber != 0) {
+        if (strncmp(name, index->slots[h].d_name, DIRENT_NAMELEN) == 0) {
+            return &index->slots[h];
+        }
+        h = (h + 1) & index->mask;
+    }
+    return NULL;
+}
+
+/**
+ * Looks name up in the directory's index, building the index first if this
+ * is the first search of the directory.  Returns 1 if found, 0 if not, or -1
+ * if indexing is off or no index could be built.
+ */
+static int dirindex_lookup(struct unixfilesystem *fs, int dirinumber, int dir_size_bytes,
+                           const char *name, struct direntv6 *dirEnt) {
+    if (fs->dirindexes == NULL || dirinumber < 0 || dirinumber >= fs->numDirindexes) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&fs->dirindexLock);
+    struct dirindex *index = fs->dirindexes[dirinumber];
+    struct dirindex *uncached = NULL;
+    if (index == NULL) {
+        unsigned generation = fs->dirindexGeneration;
+        pthread_rwlock_unlock(&fs->dirindexLock);
+
+        // Build outside the lock; if another thread got there first keep its
+        // index.  If a directory was invalidated meanwhile this one may be
+        // stale, so it answers only this search.
+        struct dirindex *built = dirindex_build(fs, dirinumber, dir_size_bytes);
+        if (built == NULL) {
+            return -1;
+        }
+        pthread_rwlock_wrlock(&fs->dirindexLock);
+        if (fs->dirindexGeneration != generation) {
+            uncached = built;
+        } else if (fs->dirindexes[dirinumber] == NULL) {
+            fs->dirindexes[dirinumber] = built;
+        } else {
+            free(built);
+        }
+        index = uncached != NULL ? uncached : fs->dirindexes[dirinumber];
+    }
+
+    const struct direntv6 *entry = dirindex_find(index, name);
+    if (entry != NULL) {
+        memcpy(dirEnt, entry, sizeof(struct direntv6));
+    }
+    pthread_rwlock_unlock(&fs->dirindexLock);
+    free(uncached);
+    return entry != NULL;
+}
+
+/**
+ * Drops the cached lookup state of a directory (or of all directories if
+ * dirinumber is 0).
+ */
+void directory_invalidate(struct unixfilesystem *fs, int dirinumber) {
+    if (fs->dirindexes != NULL) {
+        pthread_rwlock_wrlock(&fs->dirindexLock);
+        fs->dirindexGeneration++;
+        for (int i = 0; i < fs->numDirindexes; i++) {
+            if (dirinumber == 0 || i == dirinumber) {
+                free(fs->dirindexes[i]);
+                fs->dirindexes[i] = NULL;
+            }
+        }
+        pthread_rwlock_unlock(&fs->dirindexLock);
+    }
+    if (fs->dcache != NULL) {
+        dcache_invalidate(fs->dcache, dirinumber);
+    }
+}
 
 /**
  * Looks up the specified name (name) in the specified directory (dirinumber).
  * If found, return the directory entry in space addressed by dirEnt.  Returns 0
- * on success and something negative on failure.
+ * on success and a negative FSERR_* code on failure.
  * ESTA VERSIÓN ESTÁ OPTIMIZADA para evitar lecturas redundantes del inodo del directorio.
  */
-int directory_findname(struct unixfilesystem *fs, const char *name,
-                       int dirinumber, struct direntv6 *dirEnt) {
+static int directory_search(struct unixfilesystem *fs, const char *name,
+                            int dirinumber, struct direntv6 *dirEnt) {
     struct inode dir_inode;
 
     // Preliminary check: if the name to find is too long, it can't exist
     if (strlen(name) > sizeof(dirEnt->d_name)) {
-        // fprintf(stderr, "Error directory_findname: Search name '%s' is longer than max filename length (%lu).\n", name, sizeof(dirEnt->d_name));
-        return DIRECTORY_FAILURE;
+        return FSERR_NAMETOOLONG;
     }
 
     // 1. Get the Directory's Inode
-    if (inode_iget(fs, dirinumber, &dir_inode) < 0) {
-        // inode_iget prints its own error
-        return DIRECTORY_FAILURE;
+    int err = inode_iget(fs, dirinumber, &dir_inode);
+    if (err < 0) {
+        // inode_iget records its own error
+        return err;
     }
 
     // 2. Verify it's a Directory
     if ((dir_inode.i_mode & IFMT) != IFDIR) {
-        fprintf(stderr, "Error directory_findname: Inode %d is not a directory (i_mode: %04x).\n", dirinumber, dir_inode.i_mode);
-        return DIRECTORY_FAILURE;
+        return fserror_record(fs, FSERR_NOTDIR, "directory_findname: Inode %d is not a directory (i_mode: %04o)",
+                              NULL, dirinumber, dir_inode.i_mode, 0);
     }
 
     // 3. Get Directory Size
     int dir_size_bytes = inode_getsize(&dir_inode);
     if (dir_size_bytes == 0) {
-        // fprintf(stderr, "directory_findname: Directory inode %d is empty.\n", dirinumber);
-        return DIRECTORY_FAILURE; // Empty directory, name cannot be found
+        return FSERR_NOENT; // Empty directory, name cannot be found
     }
 
     // Directory size should be a multiple of directory entry size
     if (dir_size_bytes % sizeof(struct direntv6) != 0) {
-        fprintf(stderr, "Error directory_findname: Directory inode %d has corrupted size %d.\n", dirinumber, dir_size_bytes);
-        return DIRECTORY_FAILURE;
+        return fserror_record(fs, FSERR_CORRUPT, "directory_findname: Directory inode %d has corrupted size %d",
+                              NULL, dirinumber, dir_size_bytes, 0);
+    }
+
+    // 4. Use the directory's hash index; it's built by the first search.
+    int indexed = dirindex_lookup(fs, dirinumber, dir_size_bytes, name, dirEnt);
+    if (indexed >= 0) {
+        return indexed ? 0 : FSERR_NOENT;
     }
 
-    // 4. Iterate Through Directory Entries
+    // 5. No index (disabled, or the directory has a hole or couldn't be read
+    // in one go): scan it.
+    // Iterate Through Directory Entries, resolving blocks through the
+    // directory's block map so indirect blocks are walked only once.
+    struct inode_blockmap *map = inode_getblockmap(fs, dirinumber, &err);
+    if (map == NULL) {
+        return err;
+    }
+
+    int result = FSERR_NOENT;
     unsigned char block_buffer[DISKIMG_SECTOR_SIZE];
     int total_bytes_processed = 0;
     int current_logical_block_num = 0;
 
     while (total_bytes_processed < dir_size_bytes) {
         // a. Obtener el número de bloque de disco físico para el bloque lógico actual del directorio.
-        int disk_sector_num = inode_indexlookup(fs, &dir_inode, current_logical_block_num);
+        int disk_sector_num = inode_blockmap_lookup(map, current_logical_block_num);
         
-        if (disk_sector_num < 0) { // Error o bloque no asignado (ej. agujero en el archivo de directorio, aunque inusual)
-            fprintf(stderr, "Error directory_findname: Could not find disk sector for directory inode %d, logical block %d.\n", dirinumber, current_logical_block_num);
-            return DIRECTORY_FAILURE;
-        }
-         if (disk_sector_num == 0) { // Un sector de disco 0 es inválido para datos en Unix V6.
-            fprintf(stderr, "Error directory_findname: inode_indexlookup returned disk_sector_num 0 for dir inode %d, block %d.\n", dirinumber, current_logical_block_num);
-            return DIRECTORY_FAILURE;
+        if (disk_sector_num <= 0) { // Bloque no asignado (agujero en el directorio) o fuera del mapa.
+            result = fserror_record(fs, FSERR_CORRUPT, "directory_findname: No disk sector for directory inode %d, block %d",
+                                    NULL, dirinumber, current_logical_block_num, 0);
+            goto out;
         }
 
-        // b. Leer el bloque de disco.
-        if (diskimg_readsector(fs->dfd, disk_sector_num, block_buffer) != DISKIMG_SECTOR_SIZE) {
-            fprintf(stderr, "Error directory_findname: Failed to read disk sector %d for directory inode %d, block %d.\n",
-                    disk_sector_num, dirinumber, current_logical_block_num);
-            return DIRECTORY_FAILURE;
+        // b. Leer el bloque de disco (en el lugar si la imagen está mapeada).
+        const unsigned char *block = blockcache_getsector(fs->cache, disk_sector_num, block_buffer);
+        if (block == NULL) {
+            result = fserror_record(fs, FSERR_IO, "directory_findname: Failed to read disk sector %d for directory inode %d, block %d",
+                                    NULL, disk_sector_num, dirinumber, current_logical_block_num);
+            goto out;
         }
 
         // c. Calcular cuántos bytes son válidos en este bloque leído.
@@ -89,33 +279,25 @@ int directory_findname(struct unixfilesystem *fs, const char *name,
         }
         
         if (valid_bytes_in_block <= 0) { // No debería ocurrir si total_bytes_processed < dir_size_bytes
-             fprintf(stderr, "Warning directory_findname: Read 0 or negative valid bytes (%d) from dir inode %d, block %d, but expected more data.\n", valid_bytes_in_block, dirinumber, current_logical_block_num);
             break; 
         }
 
         // El contenido de un bloque de directorio también debe ser un múltiplo del tamaño de la entrada.
         if (valid_bytes_in_block % sizeof(struct direntv6) != 0) {
-             fprintf(stderr, "Error directory_findname: Directory block %d (disk sector %d) for inode %d has corrupted content size %d.\n", current_logical_block_num, disk_sector_num, dirinumber, valid_bytes_in_block);
-             return DIRECTORY_FAILURE;
+            result = fserror_record(fs, FSERR_CORRUPT, "directory_findname: Directory inode %d has %d bytes in block %d",
+                                    NULL, dirinumber, valid_bytes_in_block, current_logical_block_num);
+            goto out;
         }
 
-        // d. Iterar a través de las entradas direntv6 en el buffer.
+        // d. Buscar el nombre en todas las entradas del bloque a la vez
+        //    (direntscan salta las entradas libres, d_inumber == 0).
         int num_entries_in_block = valid_bytes_in_block / sizeof(struct direntv6);
-        for (int i = 0; i < num_entries_in_block; i++) {
-            struct direntv6 *current_entry = (struct direntv6 *)(block_buffer + (i * sizeof(struct direntv6)));
-
-            // Skip unused/deleted entries
-            if (current_entry->d_inumber == 0) {
-                continue;
-            }
-
-            // Compare names. d_name is fixed size (14 chars), might not be null-terminated if full.
-            // 'name' is null-terminated. strncmp is suitable here.
-            if (strncmp(name, current_entry->d_name, sizeof(current_entry->d_name)) == 0) {
-                // Match found
-                memcpy(dirEnt, current_entry, sizeof(struct direntv6));
-                return 0; // Success
-            }
+        int found = direntscan_find((const struct direntv6 *) block, num_entries_in_block, name);
+        FSSTATS_COUNT(fs->stats, FSSTATS_DIRENTS_SCANNED, found >= 0 ? found + 1 : num_entries_in_block);
+        if (found >= 0) {
+            memcpy(dirEnt, block + found * sizeof(struct direntv6), sizeof(struct direntv6));
+            result = 0; // Success
+            goto out;
         }
         
         total_bytes_processed += valid_bytes_in_block;
@@ -123,6 +305,163 @@ int directory_findname(struct unixfilesystem *fs, const char *name,
     }
 
     // If loops complete, the name was not found
-    // fprintf(stderr, "directory_findname: Name '%s' not found in directory inode %d.\n", name, dirinumber);
-    return DIRECTORY_FAILURE;
+out:
+    inode_putblockmap(map);
+    return result;
+}
+
+int directory_findname(struct unixfilesystem *fs, const char *name,
+                       int dirinumber, struct direntv6 *dirEnt) {
+    FSSTATS_COUNT(fs->stats, FSSTATS_DIR_LOOKUPS, 1);
+    FSSTATS_TIME_BEGIN(fs->stats, start);
+    int err = directory_search(fs, name, dirinumber, dirEnt);
+    FSSTATS_TIME_END(fs->stats, FSSTATS_LAYER_DIRECTORY, start);
+    return err;
+}
+
+/**
+ * Returns the byte offset of the first free slot of a directory of
+ * dir_size_bytes bytes, or dir_size_bytes if every slot is used.
+ */
+static int directory_freeslot(struct unixfilesystem *fs, int dirinumber, int dir_size_bytes) {
+    struct direntv6 entries[DISKIMG_SECTOR_SIZE / sizeof(struct direntv6)];
+    for (int offset = 0; offset < dir_size_bytes; offset += sizeof(entries)) {
+        int n = file_read(fs, dirinumber, offset, sizeof(entries), entries);
+        if (n <= 0) {
+            return n < 0 ? n : FSERR_CORRUPT;
+        }
+        for (int i = 0; i < n / (int) sizeof(struct direntv6); i++) {
+            if (entries[i].d_inumber == 0) {
+                return offset + i * sizeof(struct direntv6);
+            }
+        }
+    }
+    return dir_size_bytes;
+}
+
+int directory_addentry(struct unixfilesystem *fs, int dirinumber, const char *name, int inumber) {
+    size_t len = strlen(name);
+    if (len > DIRENT_NAMELEN) {
+        return FSERR_NAMETOOLONG;
+    }
+    if (len == 0 || strchr(name, '/') != NULL || inumber < ROOT_INUMBER) {
+        return FSERR_INVAL;
+    }
+
+    unixfilesystem_beginbatch(fs);
+    struct inode dir_inode;
+    struct direntv6 entry;
+    int result = inode_iget(fs, dirinumber, &dir_inode);
+    if (result < 0) {
+        goto out;
+    }
+    if ((dir_inode.i_mode & IFMT) != IFDIR) {
+        result = fserror_record(fs, FSERR_NOTDIR, "directory_addentry: Inode %d is not a directory (i_mode: %04o)",
+                                NULL, dirinumber, dir_inode.i_mode, 0);
+        goto out;
+    }
+    if ((result = directory_findname(fs, name, dirinumber, &entry)) != FSERR_NOENT) {
+        if (result == 0) {
+            result = fserror_record(fs, FSERR_EXIST, "directory_addentry: '%s' already exists in directory inode %d",
+                                    name, dirinumber, 0, 0);
+        }
+        goto out;
+    }
+
+    // Como creat() en V6: se reusa la primera entrada libre.
+    int offset = directory_freeslot(fs, dirinumber, inode_getsize(&dir_inode));
+    if (offset < 0) {
+        result = offset;
+        goto out;
+    }
+    memset(&entry, 0, sizeof(entry));
+    entry.d_inumber = inumber;
+    memcpy(entry.d_name, name, len);
+    // file_write drops the directory's index and cached lookups.
+    int n = file_write(fs, dirinumber, offset, sizeof(entry), &entry);
+    result = n == (int) sizeof(entry) ? 0 : n < 0 ? n : FSERR_NOSPC;
+
+out:
+    unixfilesystem_endbatch(fs);
+    return result;
+}
+
+int directory_iterator_open(struct unixfilesystem *fs, int dirinumber,
+                            struct directory_iterator *it) {
+    struct inode dir_inode;
+    memset(it, 0, offsetof(struct directory_iterator, buf));
+    int err = inode_iget(fs, dirinumber, &dir_inode);
+    if (err < 0) {
+        return err;
+    }
+    if ((dir_inode.i_mode & IFMT) != IFDIR) {
+        return FSERR_NOTDIR;
+    }
+
+    it->map = inode_getblockmap(fs, dirinumber, &err);
+    if (it->map == NULL) {
+        return err;
+    }
+    it->fs = fs;
+    it->dirinumber = dirinumber;
+    it->size = inode_getsize(&dir_inode);
+    return 0;
+}
+
+/**
+ * Loads the next block of the directory.  Returns 1 if there was one, 0 at
+ * the end of the directory or a negative FSERR_* code.
+ */
+static int directory_iterator_fill(struct directory_iterator *it) {
+    long start = (long) it->blockNo * DISKIMG_SECTOR_SIZE;
+    if (start >= it->size) {
+        return 0;
+    }
+
+    int disk_sector_num = inode_blockmap_lookup(it->map, it->blockNo);
+    if (disk_sector_num <= 0) {
+        return fserror_record(it->fs, FSERR_CORRUPT, "directory_iterator: No disk sector for directory inode %d, block %d",
+                              NULL, it->dirinumber, it->blockNo, 0);
+    }
+    const void *block = blockcache_getsector(it->fs->cache, disk_sector_num, it->buf);
+    if (block == NULL) {
+        return fserror_record(it->fs, FSERR_IO, "directory_iterator: Failed to read disk sector %d for directory inode %d",
+                              NULL, disk_sector_num, it->dirinumber, 0);
+    }
+
+    int valid_bytes_in_block = it->size - start;
+    if (valid_bytes_in_block > DISKIMG_SECTOR_SIZE) {
+        valid_bytes_in_block = DISKIMG_SECTOR_SIZE;
+    }
+    it->entries = block;
+    it->numEntries = valid_bytes_in_block / sizeof(struct direntv6);
+    it->next = 0;
+    it->blockNo++;
+    return 1;
+}
+
+int directory_iterator_next(struct directory_iterator *it, struct direntv6 *dirEnt) {
+    if (it->map == NULL) {
+        return 0;
+    }
+    for (;;) {
+        while (it->next < it->numEntries) {
+            const struct direntv6 *entry = &it->entries[it->next++];
+            FSSTATS_COUNT(it->fs->stats, FSSTATS_DIRENTS_SCANNED, 1);
+            if (entry->d_inumber != 0) {
+                memcpy(dirEnt, entry, sizeof(struct direntv6));
+                return 1;
+            }
+        }
+        int filled = directory_iterator_fill(it);
+        if (filled <= 0) {
+            return filled;
+        }
+    }
+}
+
+void directory_iterator_close(struct directory_iterator *it) {
+    inode_putblockmap(it->map);
+    it->map = NULL;
+    it->numEntries = 0;
 }
@@ -3,13 +3,74 @@
 
 #include "unixfilesystem.h"
 #include "direntv6.h"
+#include "diskimg.h"
+#include "inode.h"
 
 /**
  * Looks up the specified name (name) in the specified directory (dirinumber).  
  * If found, return the directory entry in space addressed by dirEnt.  Returns 0
- * on success and something negative on failure. 
+ * on success and a negative FSERR_* code on failure (see fserror.h):
+ * FSERR_NOENT if the name isn't there, FSERR_NAMETOOLONG if it can't be,
+ * FSERR_NOTDIR if dirinumber isn't a directory.
+ *
+ * The first search of a directory reads it completely and builds a hash
+ * index of its names, so later searches of the same directory are O(1).
  */
 int directory_findname(struct unixfilesystem *fs, const char *name,
                        int dirinumber, struct direntv6 *dirEnt);
 
+/**
+ * Drops everything cached about the contents of directory dirinumber (its
+ * name index and name lookup cache entries), or about every directory if
+ * dirinumber is 0.  Must be called by any code that modifies a directory.
+ */
+void directory_invalidate(struct unixfilesystem *fs, int dirinumber);
+
+/**
+ * Adds the entry name -> inumber to directory dirinumber, in the first
+ * free slot or else at the end of the directory.  The link count of
+ * inumber is left alone.  Returns 0 on success, or FSERR_INVAL if the name
+ * is empty or has a '/', FSERR_NAMETOOLONG, FSERR_EXIST if it is already
+ * present, or another negative FSERR_* code on error.
+ */
+int directory_addentry(struct unixfilesystem *fs, int dirinumber, const char *name, int inumber);
+
+/**
+ * Streams the entries of a directory one at a time, a block at a time, so
+ * any directory can be listed with constant memory.  The iterator lives in
+ * caller-provided storage and holds a single sector buffer.
+ */
+struct directory_iterator {
+    struct unixfilesystem *fs;
+    int dirinumber;
+    int size;                         // Directory size in bytes.
+    int blockNo;                      // Next block of the directory to read.
+    int numEntries;                   // Entries in the current block.
+    int next;                         // Next entry of the current block.
+    const struct direntv6 *entries;   // The current block, in place or in buf.
+    struct inode_blockmap *map;
+    unsigned char buf[DISKIMG_SECTOR_SIZE];
+};
+
+/**
+ * Starts iterating over directory dirinumber.  Returns 0 on success or a
+ * negative FSERR_* code if the inode can't be read or isn't an allocated
+ * directory.
+ */
+int directory_iterator_open(struct unixfilesystem *fs, int dirinumber,
+                            struct directory_iterator *it);
+
+/**
+ * Copies the next used entry (d_inumber != 0) of the directory into dirEnt.
+ * Returns 1 if there was one, 0 at the end of the directory, or a negative
+ * FSERR_* code if a block of the directory couldn't be read.
+ */
+int directory_iterator_next(struct directory_iterator *it, struct direntv6 *dirEnt);
+
+/**
+ * Releases the iterator.  May be called at any point, including before the
+ * end of the directory.
+ */
+void directory_iterator_close(struct directory_iterator *it);
+
 #endif // _DIECTORY_H_
@@ -0,0 +1,143 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "direntscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIRENTSCAN_X86 1
+#endif
+
+#define DIRENT_NAMELEN sizeof(((struct direntv6 *) 0)->d_name)
+
+typedef int (*direntscan_fn)(const struct direntv6 *entries, int numEntries,
+                             const unsigned char *key, unsigned cmpMask);
+
+/**
+ * Builds the 16-byte key (two zero bytes where d_inumber goes, then the name
+ * padded with NULs) and the mask of key bytes that have to match: strncmp
+ * stops after the terminating NUL, so only the first strlen(name)+1 name
+ * bytes (at most 14) are compared.
+ */
+static unsigned direntscan_key(const char *name, unsigned char *key) {
+  size_t len = strnlen(name, DIRENT_NAMELEN);
+  size_t ncmp = len < DIRENT_NAMELEN ? len + 1 : DIRENT_NAMELEN;
+  memset(key, 0, sizeof(struct direntv6));
+  memcpy(key + 2, name, len);
+  return ((1u << ncmp) - 1) << 2;
+}
+
+static int direntscan_scalar(const struct direntv6 *entries, int numEntries,
+                             const unsigned char *key, unsigned cmpMask) {
+  (void) cmpMask;
+  for (int i = 0; i < numEntries; i++) {
+    if (entries[i].d_inumber != 0 &&
+        strncmp((const char *) key + 2, entries[i].d_name, DIRENT_NAMELEN) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+#ifdef DIRENTSCAN_X86
+
+static int direntscan_sse2(const struct direntv6 *entries, int numEntries,
+                           const unsigned char *key, unsigned cmpMask) {
+  const __m128i k = _mm_loadu_si128((const __m128i *) key);
+  const __m128i zero = _mm_setzero_si128();
+  for (int i = 0; i < numEntries; i++) {
+    __m128i e = _mm_loadu_si128((const __m128i *) &entries[i]);
+    unsigned eq = _mm_movemask_epi8(_mm_cmpeq_epi8(e, k));
+    unsigned free_slot = _mm_movemask_epi8(_mm_cmpeq_epi8(e, zero)) & 3;
+    if ((eq & cmpMask) == cmpMask && free_slot != 3) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+__attribute__((target("avx2")))
+static int direntscan_avx2(const struct direntv6 *entries, int numEntries,
+                           const unsigned char *key, unsigned cmpMask) {
+  const __m128i k1 = _mm_loadu_si128((const __m128i *) key);
+  const __m256i k = _mm256_broadcastsi128_si256(k1);
+  const __m256i zero = _mm256_setzero_si256();
+  // Masks covering both entries of a 32-byte vector.
+  const uint32_t cmp2 = cmpMask | (cmpMask << 16);
+  const uint32_t inum2 = 0x3u | (0x3u << 16);
+
+  int i = 0;
+  for (; i + 2 <= numEntries; i += 2) {
+    __m256i e = _mm256_loadu_si256((const __m256i *) &entries[i]);
+    uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(e, k));
+    uint32_t zeros = _mm256_movemask_epi8(_mm256_cmpeq_epi8(e, zero)) & inum2;
+    // Bail out early when neither entry can match.
+    if ((eq & cmp2) == 0) continue;
+    if ((eq & cmpMask) == cmpMask && (zeros & 0x3u) != 0x3u) return i;
+    if (((eq >> 16) & cmpMask) == cmpMask && (zeros >> 16) != 0x3u) return i + 1;
+  }
+  if (i < numEntries) {
+    int j = direntscan_sse2(entries + i, numEntries - i, key, cmpMask);
+    if (j >= 0) return i + j;
+  }
+  return -1;
+}
+
+#endif // DIRENTSCAN_X86
+
+static struct {
+  const char *name;
+  direntscan_fn fn;
+} impl;
+
+static pthread_once_t implOnce = PTHREAD_ONCE_INIT;
+
+static void direntscan_select(void) {
+  impl.name = "scalar";
+  impl.fn = direntscan_scalar;
+#ifdef DIRENTSCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    impl.name = "avx2";
+    impl.fn = direntscan_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    impl.name = "sse2";
+    impl.fn = direntscan_sse2;
+  }
+#endif
+}
+
+int direntscan_find(const struct direntv6 *entries, int numEntries, const char *name) {
+  pthread_once(&implOnce, direntscan_select);
+  unsigned char key[sizeof(struct direntv6)];
+  unsigned cmpMask = direntscan_key(name, key);
+  return impl.fn(entries, numEntries, key, cmpMask);
+}
+
+const char *direntscan_impl(void) {
+  pthread_once(&implOnce, direntscan_select);
+  return impl.name;
+}
+
+int direntscan_setimpl(const char *name) {
+  pthread_once(&implOnce, direntscan_select);
+  if (strcmp(name, "scalar") == 0) {
+    impl.fn = direntscan_scalar;
+    impl.name = "scalar";
+    return 0;
+  }
+#ifdef DIRENTSCAN_X86
+  __builtin_cpu_init();
+  if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+    impl.fn = direntscan_sse2;
+    impl.name = "sse2";
+    return 0;
+  }
+  if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    impl.fn = direntscan_avx2;
+    impl.name = "avx2";
+    return 0;
+  }
+#endif
+  return -1;
+}
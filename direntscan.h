@@ -0,0 +1,34 @@
+#ifndef _DIRENTSCAN_H_
+#define _DIRENTSCAN_H_
+
+#include "direntv6.h"
+
+/**
+ * Vectorised search of an array of directory entries.  A direntv6 is exactly
+ * 16 bytes (2-byte inumber + 14-byte name), so one SSE2 register holds an
+ * entry and one AVX2 register holds two.  The search name is padded into a
+ * 16-byte key once and every entry is then checked with a compare and a
+ * movemask.  The kernel is chosen at run time from what the CPU supports,
+ * with a portable scalar version as fallback.
+ */
+
+/**
+ * Returns the index of the first entry with a non-zero d_inumber whose name
+ * matches name (with strncmp semantics over the 14 name bytes), or -1 if
+ * there is none.  name must be at most 14 characters long.
+ */
+int direntscan_find(const struct direntv6 *entries, int numEntries, const char *name);
+
+/**
+ * Returns the name of the kernel direntscan_find() uses: "avx2", "sse2" or
+ * "scalar".
+ */
+const char *direntscan_impl(void);
+
+/**
+ * Forces direntscan_find() to use the named kernel.  Returns 0 on success or
+ * -1 if that kernel is not available on this CPU.  Meant for benchmarks.
+ */
+int direntscan_setimpl(const char *impl);
+
+#endif // _DIRENTSCAN_H_
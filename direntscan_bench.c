@@ -0,0 +1,133 @@
+/**
+ * Microbenchmark of the directory entry scan: the old strncmp loop of
+ * directory_findname against each direntscan kernel the CPU supports.
+ * Every kernel is first checked against the strncmp loop on the same data.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "direntscan.h"
+
+#define NUM_SECTORS 256
+#define ENTRIES_PER_SECTOR 32
+#define NUM_ENTRIES (NUM_SECTORS * ENTRIES_PER_SECTOR)
+#define NUM_NAMES 64
+#define ROUNDS 20
+
+static struct direntv6 entries[NUM_ENTRIES];
+static char names[NUM_NAMES][15];
+
+/**
+ * The per-entry loop directory_findname used before direntscan.
+ */
+static int strncmp_find(const struct direntv6 *dir, int numEntries, const char *name) {
+  for (int i = 0; i < numEntries; i++) {
+    if (dir[i].d_inumber == 0) continue;
+    if (strncmp(name, dir[i].d_name, sizeof(dir[i].d_name)) == 0) return i;
+  }
+  return -1;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Fills the directory with names of every length from 1 to 14 (so some are
+ * not NUL-terminated), about one in eight slots free, and a few free slots
+ * that still hold a name.  The search names are half present and half
+ * absent, several of them prefixes of stored names.
+ */
+static void make_data(void) {
+  srand(6);
+  for (int i = 0; i < NUM_ENTRIES; i++) {
+    int len = 1 + rand() % 14;
+    for (int j = 0; j < len; j++) {
+      entries[i].d_name[j] = 'a' + rand() % 4;
+    }
+    entries[i].d_inumber = (rand() % 8 == 0) ? 0 : 1 + i;
+  }
+  for (int i = 0; i < NUM_NAMES; i++) {
+    const struct direntv6 *e = &entries[rand() % NUM_ENTRIES];
+    int len = strnlen(e->d_name, sizeof(e->d_name));
+    if (i % 4 == 1 && len > 1) len--;                    // A prefix.
+    memcpy(names[i], e->d_name, len);
+    names[i][len] = '\0';
+    if (i % 2 == 1 && len < 14) names[i][len++] = 'z';   // Absent.
+    names[i][len] = '\0';
+  }
+}
+
+typedef int (*find_fn)(const struct direntv6 *, int, const char *);
+
+/**
+ * Times searching every name in every sector, one sector at a time as
+ * directory_findname does.  Returns ns per sector searched.
+ */
+static double time_find(find_fn find, long *checksum) {
+  long sum = 0;
+  double start = now_ns();
+  for (int r = 0; r < ROUNDS; r++) {
+    for (int n = 0; n < NUM_NAMES; n++) {
+      for (int s = 0; s < NUM_SECTORS; s++) {
+        sum += find(&entries[s * ENTRIES_PER_SECTOR], ENTRIES_PER_SECTOR, names[n]);
+      }
+    }
+  }
+  double elapsed = now_ns() - start;
+  *checksum = sum;
+  return elapsed / ((double) ROUNDS * NUM_NAMES * NUM_SECTORS);
+}
+
+static int verify(void) {
+  for (int n = 0; n < NUM_NAMES; n++) {
+    for (int s = 0; s < NUM_SECTORS; s++) {
+      const struct direntv6 *sector = &entries[s * ENTRIES_PER_SECTOR];
+      for (int len = 0; len <= ENTRIES_PER_SECTOR; len++) {
+        int want = strncmp_find(sector, len, names[n]);
+        int got = direntscan_find(sector, len, names[n]);
+        if (want != got) {
+          fprintf(stderr, "%s: name \"%s\" sector %d entries %d: got %d, want %d\n",
+                  direntscan_impl(), names[n], s, len, got, want);
+          return -1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+int main(void) {
+  static const char *impls[] = { "scalar", "sse2", "avx2" };
+  make_data();
+
+  const char *best = direntscan_impl();
+  long base_sum;
+  double base = time_find(strncmp_find, &base_sum);
+  printf("%-10s %8.1f ns/sector\n", "strncmp", base);
+
+  int status = 0;
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+    if (direntscan_setimpl(impls[i]) < 0) {
+      printf("%-10s (not supported)\n", impls[i]);
+      continue;
+    }
+    if (verify() < 0) {
+      status = 1;
+      continue;
+    }
+    long sum;
+    double ns = time_find(direntscan_find, &sum);
+    printf("%-10s %8.1f ns/sector  %5.2fx%s\n", impls[i], ns, base / ns,
+           sum != base_sum ? "  RESULT MISMATCH" : "");
+    if (sum != base_sum) status = 1;
+  }
+  direntscan_setimpl(best);
+  printf("selected: %s\n", best);
+  return status;
+}
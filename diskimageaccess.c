@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <string.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include "diskimg.h"
 #include "unixfilesystem.h"
@@ -12,20 +13,38 @@
 #include "directory.h"
 #include "pathname.h"
 #include "chksumfile.h"
+#include "blockcache.h"
+#include "dcache.h"
+#include "workpool.h"
+#include "fsstats.h"
+#include "fsck.h"
+#include "fsindex.h"
+#include "fserror.h"
 
 int quietFlag = 0; 
 int idumpFlag = 0;
 int pdumpFlag = 0;
+int mmapFlag = 0;
+int verifyFlag = 0;
+int checkFlag = 0;
+int elevatorFlag = 0;
+int statsFlag = 0;        // 1 prints statistics as text, 2 as JSON.
+int cacheSectors = BLOCKCACHE_DEFAULT_SECTORS;
+int numJobs = 1;
+const char *hashName = "sha1";
+const char *indexPath = NULL;
+struct fsindex *pathIndex = NULL;   // Open sidecar index, if any.
 
 static void PrintDirectory(struct unixfilesystem *fs,  char *pathname);
 static void DumpInodeChecksum(struct unixfilesystem *fs, FILE *f);
 static void DumpPathnameChecksum(struct unixfilesystem *fs, FILE *f);
+static int CheckFilesystem(struct unixfilesystem *fs, FILE *f);
+static void ScanFiles(struct unixfilesystem *fs);
 static void PrintUsageAndExit(char *progname);
-static int GetDirEntries(struct unixfilesystem *fs, int inumber, struct direntv6 *entries, int maxNumEntries);
 
 int main(int argc, char *argv[]) {
   int opt;
-  while ((opt = getopt(argc, argv, "iqp")) != -1) {
+  while ((opt = getopt(argc, argv, "iqpmvces::C:j:H:x:")) != -1) {
     switch (opt) {
     case 'q':
       quietFlag = 1;
@@ -36,6 +55,38 @@ int main(int argc, char *argv[]) {
     case 'p':
       pdumpFlag = 1;
       break;
+    case 'm':
+      mmapFlag = 1;
+      break;
+    case 'v':
+      verifyFlag = 1;
+      break;
+    case 'c':
+      checkFlag = 1;
+      break;
+    case 'e':
+      elevatorFlag = 1;
+      break;
+    case 's':
+      if (optarg == NULL || strcmp(optarg, "text") == 0) statsFlag = 1;
+      else if (strcmp(optarg, "json") == 0) statsFlag = 2;
+      else PrintUsageAndExit(argv[0]);
+      break;
+    case 'j':
+      numJobs = atoi(optarg);
+      if (numJobs < 1) PrintUsageAndExit(argv[0]);
+      break;
+    case 'H':
+      hashName = optarg;
+      if (chksumengine_byname(hashName) == NULL) PrintUsageAndExit(argv[0]);
+      break;
+    case 'x':
+      indexPath = optarg;
+      break;
+    case 'C':
+      cacheSectors = atoi(optarg);
+      if (cacheSectors < 0) PrintUsageAndExit(argv[0]);
+      break;
     default: 
       PrintUsageAndExit(argv[0]);
     } 
@@ -46,18 +97,29 @@ int main(int argc, char *argv[]) {
   }
 
   char *diskpath = argv[optind];
-  int fd = diskimg_open(diskpath, 1);
+  int fd = mmapFlag ? diskimg_open_mapped(diskpath, 1) : diskimg_open(diskpath, 1);
 
   if (fd < 0) {
     fprintf(stderr, "Can't open diskimagePath %s\n", diskpath);
     exit(EXIT_FAILURE);
   }
 
-  struct unixfilesystem *fs = unixfilesystem_init(fd);
+  struct unixfilesystem_options opts = {
+    .cacheSectors = cacheSectors,
+    .loadInodeTable = 1,
+    .dcacheEntries = DCACHE_DEFAULT_ENTRIES,
+    .indexDirectories = 1,
+    .memoChecksums = 1,
+    .readahead = UNIXFILESYSTEM_READAHEAD_CHUNKS,
+  };
+  struct unixfilesystem *fs = unixfilesystem_init_options(fd, &opts);
   if (!fs) {
     fprintf(stderr, "Failed to initialize unix filesystem\n");
     exit(EXIT_FAILURE);
   }
+  chksumfile_setengine(fs, chksumengine_byname(hashName));
+  fsstats_settiming(fs->stats, statsFlag != 0);
+  if (indexPath != NULL) pathIndex = fsindex_open(fs, indexPath);
 
   if (!quietFlag) {  
     int disksize = diskimg_getsize(fd);
@@ -66,7 +128,7 @@ int main(int argc, char *argv[]) {
       // Cast the result of diskimg_close to void so the compiler doesn't
       // complain that we're ignoring its return value.
       (void) diskimg_close(fd);
-      free(fs);
+      unixfilesystem_free(fs);
       exit(EXIT_FAILURE);
     }
     printf("Disk %s is %d bytes (%d KB)\n", argv[1],  disksize, disksize/1024);
@@ -76,121 +138,415 @@ int main(int argc, char *argv[]) {
     printf("Superblock s_ninode %d\n",(int)fs->superblock.s_ninode);
   }
 
+  if (checkFlag && CheckFilesystem(fs, stdout) != 0) {
+    // Don't serve anything from an image that failed the check.
+    (void) diskimg_close(fd);
+    unixfilesystem_free(fs);
+    exit(EXIT_FAILURE);
+  }
+  if (elevatorFlag && (idumpFlag || pdumpFlag)) ScanFiles(fs);
   if (idumpFlag) DumpInodeChecksum(fs, stdout);
   if (pdumpFlag) DumpPathnameChecksum(fs, stdout);
+  if (pathIndex != NULL) {
+    (void) fsindex_update(pathIndex);
+    fsindex_close(pathIndex);
+  }
+  // Failures the layers recorded along the way, formatted only now.
+  fserror_print(fs, stderr);
+  if (statsFlag) fsstats_print(fs, stderr, statsFlag == 2);
 
   int err = diskimg_close(fd);
   if (err < 0) fprintf(stderr, "Error closing %s\n", argv[1]);
-  free(fs);
+  unixfilesystem_free(fs);
   exit(EXIT_SUCCESS);
   return 0;
 }
 
+// Outcomes of FormatInodeChecksum().
+#define INODE_LINE   1    // line holds the inode's output line.
+#define INODE_SKIP   0    // Nothing to print for this inode.
+#define INODE_STOP  -1    // The dump must stop at this inode.
+#define INODE_PENDING 2   // Not computed yet (parallel dump only).
+
+// Longest line FormatInodeChecksum() can produce.
+#define INODE_LINE_SIZE 128
+
+/**
+ * Formats the output line of one inode for DumpInodeChecksum.  Safe to call
+ * from several threads at once.
+ */
+static int FormatInodeChecksum(struct unixfilesystem *fs, int inumber, char *line) {
+  if (!inode_isallocated(fs, inumber)) {
+    // Skip free inodes without fetching them.
+    return INODE_SKIP;
+  }
+
+  struct inode in;
+  if (inode_iget(fs, inumber, &in) < 0) {
+    fprintf(stderr,"Can't read inode %d \n", inumber);
+    return INODE_STOP;
+  }
+
+  char chksum[CHKSUMFILE_SIZE];
+  int chksumsize = chksumfile_byinumber(fs, inumber, chksum);
+  if (chksumsize < 0) {
+    fprintf(stderr, "Inode %d can't compute chksum\n", inumber);
+    return INODE_SKIP;
+  }
+
+  char chksumstring[CHKSUMFILE_STRINGSIZE];
+  chksumfile_cvt2string(chksum, chksumsize, chksumstring);
+
+  int size = inode_getsize(&in);
+  snprintf(line, INODE_LINE_SIZE, "Inode %d mode 0x%x size %d checksum %s\n",inumber,in.i_mode, size, chksumstring);
+  return INODE_LINE;
+}
+
+/**
+ * State shared by the DumpInodeChecksum workers.  lines[] is the reorder
+ * buffer: workers fill slots in whatever order they finish and the printing
+ * thread drains them in inumber order.
+ */
+struct inodedump {
+  struct unixfilesystem *fs;
+  int limit;                 // One past the last inumber to dump.
+  int next;                  // Next inumber to hand out.
+  struct inodeslot {
+    int status;              // INODE_* result, or INODE_PENDING.
+    char line[INODE_LINE_SIZE];
+  } *lines;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+};
+
+static void *InodeChecksumWorker(void *arg) {
+  struct inodedump *d = arg;
+  for (;;) {
+    int inumber = __atomic_fetch_add(&d->next, 1, __ATOMIC_RELAXED);
+    if (inumber >= d->limit) break;
+
+    struct inodeslot *slot = &d->lines[inumber];
+    int status = FormatInodeChecksum(d->fs, inumber, slot->line);
+
+    pthread_mutex_lock(&d->lock);
+    slot->status = status;
+    pthread_cond_broadcast(&d->ready);
+    pthread_mutex_unlock(&d->lock);
+  }
+  return NULL;
+}
+
 /**
  * Output to the specified file the checksum of all allocated inodes.
+ * With numJobs > 1 the checksums are computed by a pool of worker threads;
+ * the output is identical to the serial dump.
  *
  * This is used by the grading script, so be careful not to change its output
  * format.
  */
 static void DumpInodeChecksum(struct unixfilesystem *fs, FILE *f) {
-  for (int inumber = 1; inumber < fs->superblock.s_isize*16; inumber++) {
-    struct inode in;
-    if (inode_iget(fs, inumber, &in) < 0) {
-      fprintf(stderr,"Can't read inode %d \n", inumber);
-      return;
-    }
-    if ((in.i_mode & IALLOC) == 0) {
-      // Skip this inode if it's not allocated.
-      continue;
+  int limit = fs->superblock.s_isize*16;
+
+  if (numJobs <= 1) {
+    for (int inumber = 1; inumber < limit; inumber++) {
+      char line[INODE_LINE_SIZE];
+      int status = FormatInodeChecksum(fs, inumber, line);
+      if (status == INODE_STOP) return;
+      if (status == INODE_LINE) fputs(line, f);
     }
+    return;
+  }
 
-    char chksum[CHKSUMFILE_SIZE];
-    if (chksumfile_byinumber(fs, inumber, chksum) < 0) {
-      fprintf(stderr, "Inode %d can't compute chksum\n", inumber);
-      continue;
+  struct inodedump d = { .fs = fs, .limit = limit, .next = 1 };
+  d.lines = malloc((limit > 0 ? limit : 1) * sizeof(struct inodeslot));
+  pthread_t *workers = malloc(numJobs * sizeof(pthread_t));
+  if (d.lines == NULL || workers == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    free(d.lines);
+    free(workers);
+    return;
+  }
+  for (int inumber = 0; inumber < limit; inumber++) {
+    d.lines[inumber].status = INODE_PENDING;
+  }
+  pthread_mutex_init(&d.lock, NULL);
+  pthread_cond_init(&d.ready, NULL);
+
+  int started = 0;
+  while (started < numJobs && pthread_create(&workers[started], NULL, InodeChecksumWorker, &d) == 0) {
+    started++;
+  }
+  if (started == 0) {
+    // No threads available: do the work on this thread instead.
+    InodeChecksumWorker(&d);
+  }
+
+  for (int inumber = 1; inumber < limit; inumber++) {
+    pthread_mutex_lock(&d.lock);
+    while (d.lines[inumber].status == INODE_PENDING) {
+      pthread_cond_wait(&d.ready, &d.lock);
     }
+    int status = d.lines[inumber].status;
+    pthread_mutex_unlock(&d.lock);
 
-    char chksumstring[CHKSUMFILE_STRINGSIZE];
-    chksumfile_cvt2string(chksum, chksumstring);
+    if (status == INODE_STOP) {
+      // Let the workers run out of inodes quickly.
+      __atomic_store_n(&d.next, limit, __ATOMIC_RELAXED);
+      break;
+    }
+    if (status == INODE_LINE) fputs(d.lines[inumber].line, f);
+  }
 
-    int size = inode_getsize(&in);
-    fprintf(f, "Inode %d mode 0x%x size %d checksum %s\n",inumber,in.i_mode, size, chksumstring);
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
   }
+  pthread_cond_destroy(&d.ready);
+  pthread_mutex_destroy(&d.lock);
+  free(workers);
+  free(d.lines);
 }
 
+// Longest pathname the path dump builds.
+#define MAXPATH 1024
+
 /**
- * Output to the specified file the checksum of the specified pathname and
- * inode as well as all its children if it is a directory.
- *
- * This is used by the grading script, so be careful not to change its output
- * format.
+ * Formats the output line of one pathname for the path dump and reports
+ * whether its children should be listed.  Returns INODE_LINE or INODE_SKIP.
+ * Safe to call from several threads at once.
  */
-static void DumpPathAndChildren(struct unixfilesystem *fs, const char *pathname, int inumber, FILE *f) {
+static int FormatPathChecksum(struct unixfilesystem *fs, const char *pathname, int inumber,
+                              char *line, size_t linesize, int *isdir) {
+  *isdir = 0;
+
   struct inode in;
   if (inode_iget(fs, inumber, &in) < 0) {
     fprintf(stderr,"Can't read inode %d \n", inumber);
-    return;
+    return INODE_SKIP;
   }
   assert(in.i_mode & IALLOC);
 
-  char chksum1[CHKSUMFILE_SIZE];
-  if (chksumfile_byinumber(fs, inumber, chksum1) < 0) {
+  // Checksums are memoised, so after the inode dump this reads no data.
+  char chksum[CHKSUMFILE_SIZE];
+  int chksumsize = chksumfile_byinumber(fs, inumber, chksum);
+  if (chksumsize < 0) {
     fprintf(stderr,"Can't checksum inode %d path %s\n", inumber, pathname);
-    return;
-  }
-
-  char chksum2[CHKSUMFILE_SIZE];
-  if (chksumfile_bypathname(fs, pathname, chksum2) < 0) {
-    fprintf(stderr,"Can't checksum inode %d path %s\n", inumber, pathname);
-    return;
+    return INODE_SKIP;
   }
 
-  if (!chksumfile_compare(chksum1, chksum2)) {
-    fprintf(stderr,"Pathname checksum of %s differs from inode %d\n", pathname, inumber);
-    return;
+  if (verifyFlag) {
+    // Resolve the pathname from the root independently of the tree walk.
+    // Only if it leads to another inode do the two checksums get compared.
+    int pathinumber = pathname_lookup(fs, pathname);
+    char chksum2[CHKSUMFILE_SIZE];
+    if (pathinumber < 0 || chksumfile_byinumber(fs, pathinumber, chksum2) < 0) {
+      fprintf(stderr,"Can't checksum inode %d path %s\n", inumber, pathname);
+      return INODE_SKIP;
+    }
+    if (pathinumber != inumber && !chksumfile_compare(chksum, chksum2, chksumsize)) {
+      fprintf(stderr,"Pathname checksum of %s differs from inode %d\n", pathname, inumber);
+      return INODE_SKIP;
+    }
   }
 
   char chksumstring[CHKSUMFILE_STRINGSIZE];
-  chksumfile_cvt2string(chksum2, chksumstring);
+  chksumfile_cvt2string(chksum, chksumsize, chksumstring);
   int size = inode_getsize(&in);
-  fprintf(f, "Path %s %d mode 0x%x size %d checksum %s\n",pathname,inumber,in.i_mode, size, chksumstring);
+  snprintf(line, linesize, "Path %s %d mode 0x%x size %d checksum %s\n",pathname,inumber,in.i_mode, size, chksumstring);
+
+  *isdir = ((in.i_mode & IFMT) == IFDIR);
+  return INODE_LINE;
+}
+
+/**
+ * Returns 1 for the "." and ".." entries of a directory.
+ */
+static int IsDotEntry(const struct direntv6 *d) {
+  const char *n = d->d_name;
+  return n[0] == '.' && ((n[1] == 0) || ((n[1] == '.') && (n[2] == 0)));
+}
 
+/**
+ * Builds the pathname of a directory entry.  d_name is not NUL terminated
+ * when the name uses all of its 14 characters.
+ */
+static void JoinPath(char *nextpath, const char *pathname, const struct direntv6 *d) {
   if (pathname[1] == 0) {
     /* pathame == "/" */
     pathname++; /* Delete extra / character */
   }
+  if (strlen(pathname) > MAXPATH-16) {
+    fprintf(stderr, "Too deep of directories %s\n", pathname);
+  }
+  snprintf(nextpath, MAXPATH, "%s/%.*s", pathname, (int) sizeof(d->d_name), d->d_name);
+}
 
-  if ((in.i_mode & IFMT) == IFDIR) { 
-      const unsigned int MAXPATH = 1024;
-      if (strlen(pathname) > MAXPATH-16) {
-        fprintf(stderr, "Too deep of directories %s\n", pathname);
-      }
-
-      struct direntv6 direntries[10000];
-      int numentries = GetDirEntries(fs, inumber, direntries, 10000);
-      for (int i = 0; i < numentries; i++) {
-        char *n =  direntries[i].d_name;
-        if (n[0] == '.') {
-          if ((n[1] == 0) || ((n[1] == '.') && (n[2] == 0))) {
-            /* Skip over "." and ".." */
-            continue;
-          }
+/**
+ * Output to the specified file the checksum of the specified pathname and
+ * inode as well as all its children if it is a directory.
+ *
+ * This is used by the grading script, so be careful not to change its output
+ * format.
+ */
+static void DumpPathAndChildren(struct unixfilesystem *fs, const char *pathname, int inumber, FILE *f) {
+  char line[MAXPATH + INODE_LINE_SIZE];
+  int isdir;
+  if (FormatPathChecksum(fs, pathname, inumber, line, sizeof(line), &isdir) != INODE_LINE) {
+    return;
+  }
+  fputs(line, f);
+
+  if (isdir) { 
+      struct directory_iterator it;
+      if (directory_iterator_open(fs, inumber, &it) < 0) return;
+      struct direntv6 d;
+      while (directory_iterator_next(&it, &d) > 0) {
+        if (IsDotEntry(&d)) {
+          /* Skip over "." and ".." */
+          continue;
         }
 
         char nextpath[MAXPATH];
-        sprintf(nextpath, "%s/%s",pathname, direntries[i].d_name);
-        DumpPathAndChildren(fs, nextpath,  direntries[i].d_inumber, f);
+        JoinPath(nextpath, pathname, &d);
+        DumpPathAndChildren(fs, nextpath, d.d_inumber, f);
       }
+      directory_iterator_close(&it);
   }
 }
 
+/**
+ * Output to the specified file the checksums of the entries first..end-1
+ * of the directory tree of the sidecar index, which lie below pathname,
+ * in the same order and format as DumpPathAndChildren.
+ */
+static void DumpIndexedPaths(struct unixfilesystem *fs, const struct fsindex_path *paths,
+                             int first, int end, const char *pathname, FILE *f) {
+  for (int i = first; i < end; i = paths[i].end) {
+    char nextpath[MAXPATH];
+    JoinPath(nextpath, pathname, &paths[i].d);
+
+    char line[MAXPATH + INODE_LINE_SIZE];
+    int isdir;
+    if (FormatPathChecksum(fs, nextpath, paths[i].d.d_inumber, line, sizeof(line), &isdir) != INODE_LINE) {
+      continue;
+    }
+    fputs(line, f);
+    if (isdir) DumpIndexedPaths(fs, paths, i + 1, paths[i].end, nextpath, f);
+  }
+}
+
+/**
+ * One pathname of the parallel path dump.  The nodes form a copy of the
+ * directory tree whose children are kept in directory order, so printing it
+ * depth-first reproduces the serial output exactly.
+ */
+struct pathnode {
+  struct unixfilesystem *fs;
+  char *pathname;
+  int inumber;
+  char *line;                   // Output line, or NULL if nothing is printed.
+  int isdir;                    // Set if the children are to be listed.
+  int numChildren;
+  struct pathnode *children;    // Set once the directory has been expanded.
+};
+
+/**
+ * Task body of the parallel path dump: lists one directory, checksums its
+ * entries and spawns a task for every subdirectory.
+ */
+static void ExpandPathTask(struct workpool_worker *self, void *arg) {
+  struct pathnode *node = arg;
+
+  struct directory_iterator it;
+  if (directory_iterator_open(node->fs, node->inumber, &it) < 0) return;
+
+  int capacity = 0;
+  struct direntv6 d;
+  while (directory_iterator_next(&it, &d) > 0) {
+    if (IsDotEntry(&d)) {
+      /* Skip over "." and ".." */
+      continue;
+    }
+
+    if (node->numChildren == capacity) {
+      capacity = capacity ? 2 * capacity : 16;
+      struct pathnode *children = realloc(node->children, capacity * sizeof(struct pathnode));
+      if (children == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        break;
+      }
+      node->children = children;
+    }
+
+    struct pathnode *child = &node->children[node->numChildren++];
+    memset(child, 0, sizeof(*child));
+    char nextpath[MAXPATH];
+    JoinPath(nextpath, node->pathname, &d);
+    child->fs = node->fs;
+    child->pathname = strdup(nextpath);
+    child->inumber = d.d_inumber;
+
+    char line[MAXPATH + INODE_LINE_SIZE];
+    int isdir;
+    if (FormatPathChecksum(child->fs, child->pathname, child->inumber, line, sizeof(line), &isdir) == INODE_LINE) {
+      child->line = strdup(line);
+      child->isdir = isdir;
+    }
+  }
+  directory_iterator_close(&it);
+
+  // Spawn only once the array is final: realloc may move the children.
+  for (int i = 0; i < node->numChildren; i++) {
+    if (node->children[i].isdir) workpool_spawn(self, ExpandPathTask, &node->children[i]);
+  }
+}
+
+/**
+ * Prints a finished path tree depth-first and releases it.
+ */
+static void PrintPathTree(struct pathnode *node, FILE *f) {
+  if (node->line != NULL) fputs(node->line, f);
+  for (int i = 0; i < node->numChildren; i++) {
+    PrintPathTree(&node->children[i], f);
+  }
+  free(node->children);
+  free(node->line);
+  free(node->pathname);
+}
+
 /**
  * Output to the specified file the checksum of files on the disk by
  * tranversing the naming hierarcy. 
  * Note this is used by the grading script so don't alter output format. 
  */
 static void DumpPathnameChecksum(struct unixfilesystem *fs, FILE *f) {
-  DumpPathAndChildren(fs, "/", ROOT_INUMBER, f);
+  int numPaths;
+  const struct fsindex_path *paths = pathIndex ? fsindex_paths(pathIndex, &numPaths) : NULL;
+  if (paths != NULL) {
+    // The index holds the whole tree: no directory has to be read.
+    char line[MAXPATH + INODE_LINE_SIZE];
+    int isdir;
+    if (FormatPathChecksum(fs, "/", ROOT_INUMBER, line, sizeof(line), &isdir) == INODE_LINE) {
+      fputs(line, f);
+      if (isdir) DumpIndexedPaths(fs, paths, 0, numPaths, "/", f);
+    }
+    return;
+  }
+
+  struct workpool *wp = numJobs > 1 ? workpool_create(numJobs) : NULL;
+  if (wp == NULL) {
+    DumpPathAndChildren(fs, "/", ROOT_INUMBER, f);
+    return;
+  }
+
+  struct pathnode root = { .fs = fs, .pathname = strdup("/"), .inumber = ROOT_INUMBER };
+  char line[MAXPATH + INODE_LINE_SIZE];
+  int isdir;
+  if (FormatPathChecksum(fs, root.pathname, root.inumber, line, sizeof(line), &isdir) == INODE_LINE) {
+    root.line = strdup(line);
+    if (isdir) workpool_run(wp, ExpandPathTask, &root);
+  }
+  workpool_free(wp);
+  PrintPathTree(&root, f);
 }
 
 /**
@@ -199,68 +555,83 @@ static void DumpPathnameChecksum(struct unixfilesystem *fs, FILE *f) {
 static void PrintDirectory(struct unixfilesystem *fs,  char *pathname) {
   int inumber = pathname_lookup(fs, pathname);
   if (inumber < 0) {
-    fprintf(stderr, "Can't find %s\n", pathname);
+    fprintf(stderr, "Can't find %s: %s\n", pathname, fserror_string(inumber));
     return;
   }
 
-  struct direntv6 direntries[10000];
-  int numentries = GetDirEntries(fs, inumber, direntries, 10000);
-  if (numentries < 0) {
-    fprintf(stderr, "Can't read entries from %s\n", pathname);
+  struct directory_iterator it;
+  int err = directory_iterator_open(fs, inumber, &it);
+  if (err < 0) {
+    fprintf(stderr, "Can't read entries from %s: %s\n", pathname, fserror_string(err));
     return;
   }
-  
-  for (int i = 0; i < numentries; i++) { 
-    printf("Direntry %s Name %s Inumber %d\n", pathname, direntries[i].d_name, direntries[i].d_inumber);
+
+  struct direntv6 d;
+  while ((err = directory_iterator_next(&it, &d)) > 0) {
+    printf("Direntry %s Name %.*s Inumber %d\n", pathname, (int) sizeof(d.d_name), d.d_name, d.d_inumber);
   }
+  if (err < 0) {
+    fprintf(stderr, "Can't read entries from %s\n", pathname);
+  }
+  directory_iterator_close(&it);
 }
 
+
 /**
- * Fetch as many entries from a directory that will fit in the specified array. Return the 
- * number of entries found. 
+ * Runs the consistency checker, printing its findings and a summary to f.
+ * Returns 0 if the filesystem is consistent.
  */
-static int GetDirEntries(struct unixfilesystem *fs, int inumber, struct direntv6 *entries, int maxNumEntries) {
-  struct inode in;
-  int err = inode_iget(fs, inumber, &in);
-  if (err < 0) return err;
-  
-  if (!(in.i_mode & IALLOC) || ((in.i_mode & IFMT) != IFDIR)) {
-    /* Not allocated or not a directory */
+static int CheckFilesystem(struct unixfilesystem *fs, FILE *f) {
+  struct fsck_result r;
+  int problems = fsck_check(fs, numJobs, f, &r);
+  if (problems < 0) {
+    fprintf(stderr, "Can't check the filesystem\n");
     return -1;
   }
+  fprintf(f, "Check: %d inodes (%d directories), %d blocks used, %d free, %d problems\n",
+          r.inodes, r.directories, r.usedBlocks, r.freeBlocks, problems);
+  return problems > 0 ? -1 : 0;
+}
 
-  if (maxNumEntries < 1) return -1;
-  int size = inode_getsize(&in);
-
-  assert((size % sizeof(struct direntv6)) == 0);
-
+/**
+ * Hashes every allocated inode in one sweep of the disk in block order,
+ * ahead of the dumps, which then print the memoised checksums in their own
+ * order.
+ */
+static void ScanFiles(struct unixfilesystem *fs) {
+  int limit = fs->superblock.s_isize*16;
+  int *inumbers = malloc((limit > 0 ? limit : 1) * sizeof(int));
+  if (inumbers == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return;
+  }
   int count = 0;
-  int numBlocks  = (size + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
-  char buf[DISKIMG_SECTOR_SIZE];
-  struct direntv6 *dir = (struct direntv6 *) buf;
-  for (int bno = 0; bno < numBlocks; bno++) {
-    int bytesLeft, numEntriesInBlock, i;
-    bytesLeft = file_getblock(fs, inumber,bno,dir);
-    if (bytesLeft < 0) {
-      fprintf(stderr, "Error reading directory\n");
-      return -1;
-    }
-    numEntriesInBlock = bytesLeft/sizeof(struct direntv6); 
-    for (i = 0; i <  numEntriesInBlock ; i++) { 
-      entries[count] = dir[i];
-      count++;
-      if (count >= maxNumEntries) return count;
-    }
+  for (int inumber = 1; inumber < limit; inumber++) {
+    if (inode_isallocated(fs, inumber)) inumbers[count++] = inumber;
   }
-  return count;
+  int err = chksumfile_scan(fs, inumbers, count);
+  if (err < 0) fprintf(stderr, "Can't scan the filesystem: %s\n", fserror_string(err));
+  free(inumbers);
 }
 
-
 static void PrintUsageAndExit(char *progname) {
   fprintf(stderr, "Usage: %s <options> diskimagePath\n", progname);
   fprintf(stderr, "where <options> can be:\n");
   fprintf(stderr, "-q     don't print extra info\n"); 
   fprintf(stderr, "-i     print all inode checksums\n"); 
   fprintf(stderr, "-p     print all pathname checksums\n");  
+  fprintf(stderr, "-j n   compute checksums and walk directories with n threads\n");
+  fprintf(stderr, "-m     memory map the disk image\n");
+  fprintf(stderr, "-s     print filesystem statistics to stderr (-sjson for JSON)\n");
+  fprintf(stderr, "-c     check the consistency of the filesystem first (with -j n threads)\n");
+  fprintf(stderr, "-e     read the files in disk order, in one sweep, before dumping them\n");
+  fprintf(stderr, "-v     check that each path of the path dump resolves to its inode\n");
+  fprintf(stderr, "-x f   keep a sidecar index of the image in file f to speed up later runs\n");
+  fprintf(stderr, "-C n   cache up to n disk sectors (0 disables the cache)\n");
+  fprintf(stderr, "-H h   checksum files with hash h:");
+  for (int i = 0; chksumengine_get(i) != NULL; i++) {
+    fprintf(stderr, " %s", chksumengine_get(i)->name);
+  }
+  fprintf(stderr, " (default sha1)\n");
   exit(EXIT_FAILURE);
 }
@@ -1,31 +1,554 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define DISKIMG_HAVE_URING 1
+#endif
 
 #include "diskimg.h"
 
+/**
+ * Disk images opened with diskimg_open_mapped() are mapped in their
+ * entirety.  The mapping is found from the file descriptor so that the
+ * rest of the interface stays fd based.
+ */
+struct diskmap {
+  void *addr;      // Start of the mapping, or NULL if fd isn't mapped.
+  size_t length;   // Length of the mapping in bytes.
+};
+
+static struct diskmap maps[DISKIMG_MAX_MAPPED_FD];
+
+// Sectors gathered per pwritev call (Linux's UIO_MAXIOV).
+#define DISKIMG_MAX_IOV 1024
+
+// System calls made by this module, for benchmarks (see diskimg_getsyscalls).
+static uint64_t numSyscalls;
+#define DISKIMG_SYSCALL() __atomic_fetch_add(&numSyscalls, 1, __ATOMIC_RELAXED)
+
+uint64_t diskimg_getsyscalls(void) {
+  return __atomic_load_n(&numSyscalls, __ATOMIC_RELAXED);
+}
+
 int diskimg_open(char *pathname, int readOnly) {
+  DISKIMG_SYSCALL();
   return open(pathname, readOnly ? O_RDONLY : O_RDWR);
 }
 
+int diskimg_open_mapped(char *pathname, int readOnly) {
+  int fd = diskimg_open(pathname, readOnly);
+  if (fd < 0 || fd >= DISKIMG_MAX_MAPPED_FD) return fd;
+
+  struct stat st;
+  DISKIMG_SYSCALL();
+  if (fstat(fd, &st) < 0 || st.st_size <= 0) return fd;
+
+  int prot = readOnly ? PROT_READ : (PROT_READ | PROT_WRITE);
+  DISKIMG_SYSCALL();
+  void *addr = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    // Fall back to reading through the descriptor.
+    return fd;
+  }
+  // The inode table and directories are small and hit repeatedly; file data
+  // is read front to back.  Ask for the whole image to be paged in early.
+  DISKIMG_SYSCALL();
+  (void) madvise(addr, st.st_size, MADV_WILLNEED);
+
+  maps[fd].addr = addr;
+  maps[fd].length = st.st_size;
+  return fd;
+}
+
 int diskimg_getsize(int fd) {
-  return lseek(fd, 0, SEEK_END);
+  // fstat rather than lseek: the descriptor's offset is shared by every
+  // thread using it and nothing here should move it.
+  struct stat st;
+  DISKIMG_SYSCALL();
+  if (fstat(fd, &st) < 0) return -1;
+  return st.st_size;
+}
+
+const void *diskimg_mapsector(int fd, int sectorNum) {
+  if (fd < 0 || fd >= DISKIMG_MAX_MAPPED_FD || maps[fd].addr == NULL) return NULL;
+  if (sectorNum < 0) return NULL;
+
+  size_t offset = (size_t) sectorNum * DISKIMG_SECTOR_SIZE;
+  if (offset + DISKIMG_SECTOR_SIZE > maps[fd].length) return NULL;
+  return (const char *) maps[fd].addr + offset;
 }
 
 int diskimg_readsector(int fd, int sectorNum,  void *buf) {
-  if (lseek(fd, sectorNum * DISKIMG_SECTOR_SIZE, SEEK_SET) == (off_t) -1) return -1;  
-  return read(fd, buf, DISKIMG_SECTOR_SIZE);
+  const void *sector = diskimg_mapsector(fd, sectorNum);
+  if (sector != NULL) {
+    memcpy(buf, sector, DISKIMG_SECTOR_SIZE);
+    return DISKIMG_SECTOR_SIZE;
+  }
+
+  // Positioned I/O leaves the shared file offset alone, so threads reading
+  // through the same descriptor don't disturb each other.
+  DISKIMG_SYSCALL();
+  return pread(fd, buf, DISKIMG_SECTOR_SIZE, (off_t) sectorNum * DISKIMG_SECTOR_SIZE);
+}
+
+int diskimg_readsectors(int fd, int startSector, int numSectors, void *buf) {
+  size_t length = (size_t) numSectors * DISKIMG_SECTOR_SIZE;
+  const void *first = diskimg_mapsector(fd, startSector);
+  const void *last = diskimg_mapsector(fd, startSector + numSectors - 1);
+  if (numSectors > 0 && first != NULL && last != NULL) {
+    memcpy(buf, first, length);
+    return length;
+  }
+
+  // pread needs no separate seek, so a whole run costs a single system call.
+  off_t offset = (off_t) startSector * DISKIMG_SECTOR_SIZE;
+  size_t done = 0;
+  while (done < length) {
+    DISKIMG_SYSCALL();
+    ssize_t n = pread(fd, (char *) buf + done, length - done, offset + done);
+    if (n < 0) return -1;
+    if (n == 0) break;   // End of the image.
+    done += n;
+  }
+  return done;
 }
 
 int diskimg_writesector(int fd, int sectorNum,  void *buf) {
-  if (lseek(fd, sectorNum * DISKIMG_SECTOR_SIZE, SEEK_SET) == (off_t) -1) {
-    return -1;
+  // A MAP_SHARED mapping sees writes done through the descriptor, so the
+  // mapped case needs no special handling here.
+  DISKIMG_SYSCALL();
+  return pwrite(fd, buf, DISKIMG_SECTOR_SIZE, (off_t) sectorNum * DISKIMG_SECTOR_SIZE);
+}
+
+int diskimg_writesectors(int fd, int startSector, int numSectors, const void *buf) {
+  size_t length = (size_t) numSectors * DISKIMG_SECTOR_SIZE;
+  off_t offset = (off_t) startSector * DISKIMG_SECTOR_SIZE;
+  size_t done = 0;
+  while (done < length) {
+    DISKIMG_SYSCALL();
+    ssize_t n = pwrite(fd, (const char *) buf + done, length - done, offset + done);
+    if (n <= 0) return -1;
+    done += n;
+  }
+  return done;
+}
+
+int diskimg_writesectorv(int fd, int startSector, const void *const *sectors, int numSectors) {
+  struct iovec iov[DISKIMG_MAX_IOV];
+  int maxIov = sizeof(iov) / sizeof(iov[0]);
+  int done = 0;   // Sectors written.
+  while (done < numSectors) {
+    int n = numSectors - done < maxIov ? numSectors - done : maxIov;
+    for (int i = 0; i < n; i++) {
+      iov[i].iov_base = (void *) (uintptr_t) sectors[done + i];   // pwritev only reads it.
+      iov[i].iov_len = DISKIMG_SECTOR_SIZE;
+    }
+    DISKIMG_SYSCALL();
+    ssize_t written = pwritev(fd, iov, n, (off_t) (startSector + done) * DISKIMG_SECTOR_SIZE);
+    if (written <= 0) return -1;
+    if (written < (ssize_t) n * DISKIMG_SECTOR_SIZE) {
+      // Short write: finish the sector it stopped in and go round again.
+      int whole = written / DISKIMG_SECTOR_SIZE;
+      int partial = written % DISKIMG_SECTOR_SIZE;
+      if (partial != 0 &&
+          diskimg_writesectors(fd, startSector + done + whole, 1, sectors[done + whole]) != DISKIMG_SECTOR_SIZE) {
+        return -1;
+      }
+      done += whole + (partial != 0);
+      continue;
+    }
+    done += n;
   }
+  return numSectors * DISKIMG_SECTOR_SIZE;
+}
 
-  return write(fd, buf, DISKIMG_SECTOR_SIZE);
+int diskimg_sync(int fd) {
+  DISKIMG_SYSCALL();
+  return fdatasync(fd);
 }
 
 int diskimg_close(int fd) {
+  if (fd >= 0 && fd < DISKIMG_MAX_MAPPED_FD && maps[fd].addr != NULL) {
+    DISKIMG_SYSCALL();
+    munmap(maps[fd].addr, maps[fd].length);
+    maps[fd].addr = NULL;
+    maps[fd].length = 0;
+  }
+  DISKIMG_SYSCALL();
   return close(fd);
 }
+
+/**
+ * One read of a diskimg_aio queue.  Requests live in a fixed array and are
+ * chained through next on the free list and, for the thread backend, on the
+ * queued and completed lists.
+ */
+struct diskimg_aio_req {
+  void *buf;
+  size_t length;
+  off_t offset;
+  void *tag;
+  ssize_t result;  // Bytes read, or -1.
+  int next;        // Index of the next request on the same list, or -1.
+};
+
+struct diskimg_aio {
+  int fd;
+  int depth;
+  int inFlight;                  // Submitted and not yet returned by wait.
+  struct diskimg_aio_req *reqs;  // depth requests.
+  int freeList;
+
+  // Thread backend: workers pread requests from the queued list and move
+  // them to the completed list.  numThreads is 0 when io_uring is in use.
+  int numThreads;
+  pthread_t threads[DISKIMG_AIO_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t queuedCond;
+  pthread_cond_t completedCond;
+  int queuedHead, queuedTail;
+  int completedHead, completedTail;
+  int stopping;
+
+#ifdef DISKIMG_HAVE_URING
+  // io_uring backend: the shared rings and how many SQEs the kernel hasn't
+  // been told about yet.
+  int ringFd;
+  void *sqRing, *cqRing;
+  size_t sqRingSize, cqRingSize;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned *cqHead, *cqTail, *cqMask;
+  struct io_uring_cqe *cqes;
+  int unsubmitted;
+#endif
+};
+
+/**
+ * Reads the part of r that a short read left over with plain pread.
+ */
+static void diskimg_aio_finishread(struct diskimg_aio *aio, struct diskimg_aio_req *r) {
+  while (r->result >= 0 && (size_t) r->result < r->length) {
+    DISKIMG_SYSCALL();
+    ssize_t n = pread(aio->fd, (char *) r->buf + r->result, r->length - r->result,
+                      r->offset + r->result);
+    if (n < 0) {
+      r->result = -1;
+    } else if (n == 0) {
+      break;   // End of the image.
+    } else {
+      r->result += n;
+    }
+  }
+}
+
+static void diskimg_aio_push(struct diskimg_aio *aio, int *head, int *tail, int i) {
+  aio->reqs[i].next = -1;
+  if (*head < 0) {
+    *head = i;
+  } else {
+    aio->reqs[*tail].next = i;
+  }
+  *tail = i;
+}
+
+static int diskimg_aio_pop(struct diskimg_aio *aio, int *head) {
+  int i = *head;
+  if (i >= 0) *head = aio->reqs[i].next;
+  return i;
+}
+
+static void *diskimg_aio_worker(void *arg) {
+  struct diskimg_aio *aio = arg;
+  pthread_mutex_lock(&aio->lock);
+  for (;;) {
+    while (aio->queuedHead < 0 && !aio->stopping) {
+      pthread_cond_wait(&aio->queuedCond, &aio->lock);
+    }
+    if (aio->queuedHead < 0) break;
+    int i = diskimg_aio_pop(aio, &aio->queuedHead);
+    pthread_mutex_unlock(&aio->lock);
+
+    struct diskimg_aio_req *r = &aio->reqs[i];
+    r->result = 0;
+    diskimg_aio_finishread(aio, r);
+
+    pthread_mutex_lock(&aio->lock);
+    diskimg_aio_push(aio, &aio->completedHead, &aio->completedTail, i);
+    pthread_cond_signal(&aio->completedCond);
+  }
+  pthread_mutex_unlock(&aio->lock);
+  return NULL;
+}
+
+#ifdef DISKIMG_HAVE_URING
+/**
+ * Sets up an io_uring with room for depth reads and maps its rings.
+ * Returns 0 on success, or -1 if the kernel doesn't offer io_uring.
+ */
+static int diskimg_aio_uring_init(struct diskimg_aio *aio) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  DISKIMG_SYSCALL();
+  aio->ringFd = syscall(__NR_io_uring_setup, aio->depth, &p);
+  if (aio->ringFd < 0) return -1;
+
+  aio->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  aio->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && aio->cqRingSize > aio->sqRingSize) aio->sqRingSize = aio->cqRingSize;
+
+  DISKIMG_SYSCALL();
+  aio->sqRing = mmap(NULL, aio->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     aio->ringFd, IORING_OFF_SQ_RING);
+  if (aio->sqRing == MAP_FAILED) {
+    aio->sqRing = NULL;
+    return -1;
+  }
+  if (single) {
+    aio->cqRing = aio->sqRing;
+  } else {
+    DISKIMG_SYSCALL();
+    aio->cqRing = mmap(NULL, aio->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       aio->ringFd, IORING_OFF_CQ_RING);
+    if (aio->cqRing == MAP_FAILED) {
+      aio->cqRing = NULL;
+      return -1;
+    }
+  }
+  aio->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+  DISKIMG_SYSCALL();
+  aio->sqes = mmap(NULL, aio->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   aio->ringFd, IORING_OFF_SQES);
+  if (aio->sqes == MAP_FAILED) {
+    aio->sqes = NULL;
+    return -1;
+  }
+
+  char *sq = aio->sqRing, *cq = aio->cqRing;
+  aio->sqHead = (unsigned *) (sq + p.sq_off.head);
+  aio->sqTail = (unsigned *) (sq + p.sq_off.tail);
+  aio->sqMask = (unsigned *) (sq + p.sq_off.ring_mask);
+  aio->sqArray = (unsigned *) (sq + p.sq_off.array);
+  aio->cqHead = (unsigned *) (cq + p.cq_off.head);
+  aio->cqTail = (unsigned *) (cq + p.cq_off.tail);
+  aio->cqMask = (unsigned *) (cq + p.cq_off.ring_mask);
+  aio->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return 0;
+}
+
+static void diskimg_aio_uring_free(struct diskimg_aio *aio) {
+  if (aio->sqes != NULL) {
+    DISKIMG_SYSCALL();
+    munmap(aio->sqes, aio->sqesSize);
+  }
+  if (aio->cqRing != NULL && aio->cqRing != aio->sqRing) {
+    DISKIMG_SYSCALL();
+    munmap(aio->cqRing, aio->cqRingSize);
+  }
+  if (aio->sqRing != NULL) {
+    DISKIMG_SYSCALL();
+    munmap(aio->sqRing, aio->sqRingSize);
+  }
+  if (aio->ringFd >= 0) {
+    DISKIMG_SYSCALL();
+    close(aio->ringFd);
+  }
+  aio->sqes = NULL;
+  aio->sqRing = aio->cqRing = NULL;
+  aio->ringFd = -1;
+}
+
+/**
+ * Hands the queued SQEs to the kernel and, if wait is set, blocks until at
+ * least one completion is posted.  Returns 0, or -1 on error.
+ */
+static int diskimg_aio_uring_enter(struct diskimg_aio *aio, int wait) {
+  for (;;) {
+    DISKIMG_SYSCALL();
+    int n = syscall(__NR_io_uring_enter, aio->ringFd, aio->unsubmitted, wait ? 1 : 0,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    aio->unsubmitted -= n;
+    return 0;
+  }
+}
+#endif
+
+struct diskimg_aio *diskimg_aio_create(int fd, int depth, int flags) {
+  if (depth < 1) return NULL;
+  struct diskimg_aio *aio = calloc(1, sizeof(struct diskimg_aio));
+  if (aio == NULL) return NULL;
+  aio->fd = fd;
+  aio->depth = depth;
+  aio->reqs = malloc(depth * sizeof(struct diskimg_aio_req));
+  if (aio->reqs == NULL) {
+    free(aio);
+    return NULL;
+  }
+  for (int i = 0; i < depth; i++) {
+    aio->reqs[i].next = i + 1 < depth ? i + 1 : -1;
+  }
+  aio->freeList = 0;
+  aio->queuedHead = aio->completedHead = -1;
+  pthread_mutex_init(&aio->lock, NULL);
+  pthread_cond_init(&aio->queuedCond, NULL);
+  pthread_cond_init(&aio->completedCond, NULL);
+
+#ifdef DISKIMG_HAVE_URING
+  aio->ringFd = -1;
+  if (!(flags & DISKIMG_AIO_NOURING)) {
+    if (diskimg_aio_uring_init(aio) == 0) return aio;
+    // No io_uring here (old kernel, seccomp filter...): use threads.
+    diskimg_aio_uring_free(aio);
+  }
+#endif
+
+  int numThreads = depth < DISKIMG_AIO_THREADS ? depth : DISKIMG_AIO_THREADS;
+  for (int i = 0; i < numThreads; i++) {
+    if (pthread_create(&aio->threads[i], NULL, diskimg_aio_worker, aio) != 0) break;
+    aio->numThreads++;
+  }
+  if (aio->numThreads == 0) {
+    diskimg_aio_free(aio);
+    return NULL;
+  }
+  return aio;
+}
+
+const char *diskimg_aio_backend(const struct diskimg_aio *aio) {
+  return aio->numThreads > 0 ? "threads" : "io_uring";
+}
+
+int diskimg_aio_submit(struct diskimg_aio *aio, int startSector, int numSectors, void *buf, void *tag) {
+  if (numSectors <= 0 || aio->freeList < 0) return -1;
+  int i = diskimg_aio_pop(aio, &aio->freeList);
+  struct diskimg_aio_req *r = &aio->reqs[i];
+  r->buf = buf;
+  r->length = (size_t) numSectors * DISKIMG_SECTOR_SIZE;
+  r->offset = (off_t) startSector * DISKIMG_SECTOR_SIZE;
+  r->tag = tag;
+  r->result = 0;
+  aio->inFlight++;
+
+#ifdef DISKIMG_HAVE_URING
+  if (aio->numThreads == 0) {
+    unsigned tail = *aio->sqTail;
+    unsigned index = tail & *aio->sqMask;
+    struct io_uring_sqe *sqe = &aio->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = aio->fd;
+    sqe->off = r->offset;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = r->length;
+    sqe->user_data = i;
+    aio->sqArray[index] = index;
+    __atomic_store_n(aio->sqTail, tail + 1, __ATOMIC_RELEASE);
+    aio->unsubmitted++;
+    return 0;
+  }
+#endif
+
+  pthread_mutex_lock(&aio->lock);
+  diskimg_aio_push(aio, &aio->queuedHead, &aio->queuedTail, i);
+  pthread_cond_signal(&aio->queuedCond);
+  pthread_mutex_unlock(&aio->lock);
+  return 0;
+}
+
+int diskimg_aio_flush(struct diskimg_aio *aio) {
+#ifdef DISKIMG_HAVE_URING
+  if (aio->numThreads == 0 && aio->unsubmitted > 0) {
+    return diskimg_aio_uring_enter(aio, 0);
+  }
+#endif
+  return 0;
+}
+
+int diskimg_aio_wait(struct diskimg_aio *aio, void **tag) {
+  *tag = NULL;
+  if (aio->inFlight == 0) return -1;
+  int i;
+
+#ifdef DISKIMG_HAVE_URING
+  if (aio->numThreads == 0) {
+    unsigned head = *aio->cqHead;
+    while (head == __atomic_load_n(aio->cqTail, __ATOMIC_ACQUIRE)) {
+      if (diskimg_aio_uring_enter(aio, 1) < 0) return -1;
+    }
+    struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cqMask];
+    i = cqe->user_data;
+    int res = cqe->res;
+    __atomic_store_n(aio->cqHead, head + 1, __ATOMIC_RELEASE);
+
+    struct diskimg_aio_req *r = &aio->reqs[i];
+    if (res < 0) {
+      // The kernel may lack IORING_OP_READ (before 5.6); read it here.
+      r->result = res == -EINVAL || res == -EOPNOTSUPP ? 0 : -1;
+    } else {
+      r->result = res;
+    }
+    diskimg_aio_finishread(aio, r);
+  } else
+#endif
+  {
+    pthread_mutex_lock(&aio->lock);
+    while (aio->completedHead < 0) {
+      pthread_cond_wait(&aio->completedCond, &aio->lock);
+    }
+    i = diskimg_aio_pop(aio, &aio->completedHead);
+    pthread_mutex_unlock(&aio->lock);
+  }
+
+  struct diskimg_aio_req *r = &aio->reqs[i];
+  *tag = r->tag;
+  int result = r->result;
+  r->next = aio->freeList;
+  aio->freeList = i;
+  aio->inFlight--;
+  return result;
+}
+
+void diskimg_aio_free(struct diskimg_aio *aio) {
+  if (aio == NULL) return;
+  void *tag;
+  // The buffers of reads still in flight belong to the caller, who may free
+  // them as soon as this returns.
+  while (aio->inFlight > 0) {
+    int before = aio->inFlight;
+    diskimg_aio_flush(aio);
+    diskimg_aio_wait(aio, &tag);
+    if (aio->inFlight == before) break;   // The ring failed; give up.
+  }
+
+#ifdef DISKIMG_HAVE_URING
+  diskimg_aio_uring_free(aio);
+#endif
+  pthread_mutex_lock(&aio->lock);
+  aio->stopping = 1;
+  pthread_cond_broadcast(&aio->queuedCond);
+  pthread_mutex_unlock(&aio->lock);
+  for (int i = 0; i < aio->numThreads; i++) {
+    pthread_join(aio->threads[i], NULL);
+  }
+  pthread_mutex_destroy(&aio->lock);
+  pthread_cond_destroy(&aio->queuedCond);
+  pthread_cond_destroy(&aio->completedCond);
+  free(aio->reqs);
+  free(aio);
+}
@@ -3,15 +3,32 @@
 
 #include <stdint.h>
 
+/**
+ * Every read and write is positioned (pread/pwrite or a copy from the
+ * mapping), so any number of threads may do I/O on the same descriptor at
+ * once; the descriptor's file offset is never used.  A descriptor must not
+ * be closed while other threads are still using it.
+ */
+
 // Size of a disk sector (e.g. block) in bytes.
 #define DISKIMG_SECTOR_SIZE 512
 
+// Descriptors at or above this value are never memory mapped.
+#define DISKIMG_MAX_MAPPED_FD 1024
+
 /**
  * Opens a disk image for I/O. Returns an open file descriptor, or -1 if
  * unsuccessful.  
  */
 int diskimg_open(char *pathname, int readOnly);
 
+/**
+ * Like diskimg_open(), but also maps the whole image into memory so that
+ * sectors can be read without a system call.  If the image can't be mapped
+ * the descriptor is still returned and reads fall back to pread.
+ */
+int diskimg_open_mapped(char *pathname, int readOnly);
+
 /**
  * Returns the size of the disk imgage in bytes, or -1 if unsuccessful.
  */
@@ -23,16 +40,112 @@ int diskimg_getsize(int fd);
  */
 int diskimg_readsector(int fd, int sectorNum, void *buf); 
 
+/**
+ * Reads numSectors consecutive sectors starting at startSector into buf with
+ * as few system calls as possible.  Returns the number of bytes read, or -1
+ * on error.
+ */
+int diskimg_readsectors(int fd, int startSector, int numSectors, void *buf);
+
+/**
+ * Returns a pointer to the specified sector inside the image mapping, or
+ * NULL if the image isn't mapped or the sector lies past its end.  The
+ * pointer stays valid until diskimg_close().
+ */
+const void *diskimg_mapsector(int fd, int sectorNum);
+
 /**
  * Writes the specified sector from the disk.  Returns the number of bytes
  * written, or -1 on error.
  */
 int diskimg_writesector(int fd, int sectorNum, void *buf); 
 
+/**
+ * Writes numSectors consecutive sectors from buf starting at startSector.
+ * Returns the number of bytes written, or -1 on error.
+ */
+int diskimg_writesectors(int fd, int startSector, int numSectors, const void *buf);
+
+/**
+ * Gathers numSectors sectors, each DISKIMG_SECTOR_SIZE bytes at sectors[i],
+ * and writes them to consecutive sectors from startSector with as few
+ * pwritev calls as possible.  Returns the number of bytes written, or -1 on
+ * error.
+ */
+int diskimg_writesectorv(int fd, int startSector, const void *const *sectors, int numSectors);
+
+/**
+ * Waits until everything written to the image is on stable storage.
+ * Returns 0 on success, -1 on error.
+ */
+int diskimg_sync(int fd);
+
 /**
  * Clean up from a previous diskimg_open() call.  Returns 0 on success, or -1 on
  * error.
  */
 int diskimg_close(int fd);
 
+/**
+ * Returns the number of system calls the diskimg functions have made so far
+ * in this process, over all images.  Used by benchmarks to report syscalls
+ * per operation.
+ */
+uint64_t diskimg_getsyscalls(void);
+
+/**
+ * Asynchronous reads.  A diskimg_aio queue keeps up to depth sector runs in
+ * flight on one image descriptor, through io_uring where the kernel offers
+ * it and otherwise through a few threads calling pread.  Reads go through
+ * the descriptor even when the image is mapped.
+ *
+ * A queue belongs to one thread at a time: submit, flush, wait and free
+ * must not be called concurrently on the same queue.
+ */
+struct diskimg_aio;
+
+// Worker threads of the pread fallback.
+#define DISKIMG_AIO_THREADS 4
+
+// diskimg_aio_create() flag: use the thread backend even if io_uring works.
+#define DISKIMG_AIO_NOURING 1
+
+/**
+ * Creates a queue for up to depth reads in flight on fd.  Returns NULL on
+ * error.
+ */
+struct diskimg_aio *diskimg_aio_create(int fd, int depth, int flags);
+
+/**
+ * Returns "io_uring" or "threads".
+ */
+const char *diskimg_aio_backend(const struct diskimg_aio *aio);
+
+/**
+ * Queues a read of numSectors sectors starting at startSector into buf.
+ * tag is handed back by diskimg_aio_wait() when the read completes.  The
+ * read may not start before the next diskimg_aio_flush() or
+ * diskimg_aio_wait().  Returns 0, or -1 if depth reads are already in
+ * flight.
+ */
+int diskimg_aio_submit(struct diskimg_aio *aio, int startSector, int numSectors, void *buf, void *tag);
+
+/**
+ * Starts every read queued so far, with a single system call for io_uring.
+ * Returns 0, or -1 on error.
+ */
+int diskimg_aio_flush(struct diskimg_aio *aio);
+
+/**
+ * Waits for one read to complete, in any order, and sets *tag to its tag.
+ * Returns the number of bytes read (short only at the end of the image),
+ * or -1 on error.  *tag is left NULL if no read could be waited for.
+ */
+int diskimg_aio_wait(struct diskimg_aio *aio, void **tag);
+
+/**
+ * Waits for the reads still in flight and releases the queue.
+ */
+void diskimg_aio_free(struct diskimg_aio *aio);
+
 #endif // _DISKIMG_H_
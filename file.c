@@ -1,62 +1,83 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "file.h"
 #include "inode.h"
 #include "diskimg.h"
+#include "blockcache.h"
+#include "fsstats.h"
+#include "directory.h"
+#include "chksumfile.h"
+#include "fserror.h"
 #include "unixfilesystem.h"
 
 /**
  * Fetches the specified file block from the specified inode.
- * Returns the number of valid bytes in the block, -1 on error.
+ * Returns the number of valid bytes in the block or a negative FSERR_* code.
  */
 int file_getblock(struct unixfilesystem *fs, int inumber, int blockNum, void *buf) {
-    struct inode inode_data;
+    const void *data;
+    int valid_bytes = file_getblockref(fs, inumber, blockNum, buf, &data);
+    if (valid_bytes > 0 && data != buf) {
+        memcpy(buf, data, DISKIMG_SECTOR_SIZE);
+    }
+    return valid_bytes;
+}
 
-    // 1. Fetch the Inode
-    if (inode_iget(fs, inumber, &inode_data) < 0) {
-        // inode_iget should print its own error
-        return -1; // Error fetching inode
+/**
+ * Zero-copy variant of file_getblock().  *data is pointed at the block
+ * contents, which live in the image mapping when there is one and in
+ * scratch otherwise.
+ */
+int file_getblockref(struct unixfilesystem *fs, int inumber, int blockNum,
+                     void *scratch, const void **data) {
+    // 1. Fetch the file's block map (shared by consecutive calls on one file)
+    int err;
+    struct inode_blockmap *map = inode_getblockmap(fs, inumber, &err);
+    if (map == NULL) {
+        // inode_iget / inode_blockmap_build record their own errors
+        return err; // Error fetching inode
     }
 
     // 2. Get the File Size
-    int file_size_bytes = inode_getsize(&inode_data);
+    int file_size_bytes = map->size;
 
     // 3. Handle empty file case
     if (file_size_bytes == 0) {
         // Any blockNum for an empty file results in 0 valid bytes.
         // No error, just no data.
+        inode_putblockmap(map);
+        *data = scratch;
         return 0;
     }
 
     // 4. Validate blockNum against File Size (for non-empty files)
     // Calculate total number of logical blocks in the file (0-indexed)
-    int num_logical_blocks = (file_size_bytes + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
+    int num_logical_blocks = map->numBlocks;
 
     if (blockNum < 0 || blockNum >= num_logical_blocks) {
-        fprintf(stderr, "Error: blockNum %d is out of bounds for file with %d blocks (size %d bytes).\n",
-                blockNum, num_logical_blocks, file_size_bytes);
-        return -1; // Requested block is out of the file's bounds
+        inode_putblockmap(map);
+        return FSERR_RANGE; // Requested block is out of the file's bounds
     }
 
     // 5. Find the Physical Disk Block Number
-    int disk_sector_num = inode_indexlookup(fs, &inode_data, blockNum);
-    if (disk_sector_num < 0) { // Handles errors from inode_indexlookup (e.g., -1)
-        // inode_indexlookup should print its own error or the error is "block not found"
-        // fprintf(stderr, "Error: Could not find disk sector for inumber %d, blockNum %d.\n", inumber, blockNum);
-        return -1; // Error or block not allocated/found
-    }
-     if (disk_sector_num == 0) { // A disk sector number of 0 is invalid in Unix V6 for data
-        fprintf(stderr, "Error: inode_indexlookup returned disk_sector_num 0 for inumber %d, blockNum %d.\n", inumber, blockNum);
-        return -1;
-    }
-
+    int disk_sector_num = inode_blockmap_lookup(map, blockNum);
+    inode_putblockmap(map);
 
-    // 6. Read the Disk Block
-    if (diskimg_readsector(fs->dfd, disk_sector_num, buf) != DISKIMG_SECTOR_SIZE) {
-        fprintf(stderr, "Error: Failed to read disk sector %d for inumber %d, blockNum %d.\n",
-                disk_sector_num, inumber, blockNum);
-        return -1; // Error reading block from disk
+    // 6. Read the Disk Block (in place when the image is mapped).  A disk
+    // sector number of 0 means the block isn't allocated: a hole reads as
+    // zeros, with no disk access.
+    if (disk_sector_num == 0) {
+        memset(scratch, 0, DISKIMG_SECTOR_SIZE);
+        *data = scratch;
+    } else {
+        *data = blockcache_getsector(fs->cache, disk_sector_num, scratch);
+    }
+    if (*data == NULL) {
+        return fserror_record(fs, FSERR_IO, "Failed to read disk sector %d for inumber %d, blockNum %d",
+                              NULL, disk_sector_num, inumber, blockNum);
     }
 
     // 7. Determine Number of Valid Bytes
@@ -70,6 +91,7 @@ int file_getblock(struct unixfilesystem *fs, int inumber, int blockNum, void *bu
     int remaining_bytes_in_file_from_this_block = file_size_bytes - start_byte_of_block;
 
     if (remaining_bytes_in_file_from_this_block >= DISKIMG_SECTOR_SIZE) {
+        FSSTATS_COUNT(fs->stats, FSSTATS_BYTES_READ, DISKIMG_SECTOR_SIZE);
         return DISKIMG_SECTOR_SIZE; // Full block is valid
     } else {
         // This must be the last block, and it's partially filled.
@@ -77,7 +99,396 @@ int file_getblock(struct unixfilesystem *fs, int inumber, int blockNum, void *bu
         // - file_size_bytes > 0 (checked at the beginning)
         // - blockNum < num_logical_blocks (checked)
         // This means we are not reading past EOF.
+        FSSTATS_COUNT(fs->stats, FSSTATS_BYTES_READ, remaining_bytes_in_file_from_this_block);
         return remaining_bytes_in_file_from_this_block;
     }
 }
 
+
+/**
+ * Reads up to len bytes of the specified file starting at byte offset into
+ * buf, coalescing physically contiguous blocks into single reads.
+ * Returns the number of bytes read or a negative FSERR_* code.
+ */
+static int file_readrange(struct unixfilesystem *fs, int inumber, int offset, int len, void *buf) {
+    if (offset < 0 || len < 0) {
+        return FSERR_INVAL;
+    }
+
+    int err;
+    struct inode_blockmap *map = inode_getblockmap(fs, inumber, &err);
+    if (map == NULL) {
+        return err;
+    }
+
+    // Clip the request to the end of the file.
+    if (offset >= map->size) {
+        inode_putblockmap(map);
+        return 0;
+    }
+    if (len > map->size - offset) {
+        len = map->size - offset;
+    }
+
+    unsigned char *out = buf;
+    unsigned char scratch[DISKIMG_SECTOR_SIZE];
+    int done = 0;
+    int e = inode_blockmap_findextent(map, offset / DISKIMG_SECTOR_SIZE);
+
+    while (done < len) {
+        const struct inode_extent *ext = &map->extents[e];
+        int pos = offset + done;
+        int block = pos / DISKIMG_SECTOR_SIZE;
+        int within = pos % DISKIMG_SECTOR_SIZE;
+        int extent_end = (ext->fileBlock + ext->numBlocks) * DISKIMG_SECTOR_SIZE;
+        int chunk = extent_end - pos < len - done ? extent_end - pos : len - done;
+
+        int disk_sector_num = ext->diskBlock + (block - ext->fileBlock);
+
+        if (ext->diskBlock == 0) {
+            // Unallocated blocks read as zeros: the rest of the hole at once.
+            memset(out + done, 0, chunk);
+            done += chunk;
+        } else if (within != 0 || chunk < DISKIMG_SECTOR_SIZE) {
+            // Partial block at either end of the range: go through the cache.
+            int n = DISKIMG_SECTOR_SIZE - within < chunk ? DISKIMG_SECTOR_SIZE - within : chunk;
+            const unsigned char *sector = blockcache_getsector(fs->cache, disk_sector_num, scratch);
+            if (sector == NULL) {
+                done = fserror_record(fs, FSERR_IO, "Failed to read disk sector %d for inumber %d",
+                                      NULL, disk_sector_num, inumber, 0);
+                break;
+            }
+            memcpy(out + done, sector + within, n);
+            done += n;
+        } else {
+            // Whole blocks: one bulk read for the rest of the extent.
+            int num_blocks = chunk / DISKIMG_SECTOR_SIZE;
+            int nbytes = num_blocks * DISKIMG_SECTOR_SIZE;
+            if (blockcache_readsectors(fs->cache, disk_sector_num, num_blocks, out + done) != nbytes) {
+                done = fserror_record(fs, FSERR_IO, "Failed to read %d sectors at %d for inumber %d",
+                                      NULL, num_blocks, disk_sector_num, inumber);
+                break;
+            }
+            done += nbytes;
+        }
+
+        if (offset + done >= extent_end) {
+            e++;
+        }
+    }
+
+    inode_putblockmap(map);
+    return done;
+}
+
+int file_read(struct unixfilesystem *fs, int inumber, int offset, int len, void *buf) {
+    FSSTATS_TIME_BEGIN(fs->stats, start);
+    int done = file_readrange(fs, inumber, offset, len, buf);
+    FSSTATS_TIME_END(fs->stats, FSSTATS_LAYER_FILE, start);
+    if (done > 0) {
+        FSSTATS_COUNT(fs->stats, FSSTATS_BYTES_READ, done);
+    }
+    return done;
+}
+
+/**
+ * Writes a run of whole blocks that are consecutive on disk.
+ */
+static int file_writerun(struct unixfilesystem *fs, int startSector, int numBlocks, const void *src) {
+    if (numBlocks == 0) {
+        return 0;
+    }
+    int nbytes = numBlocks * DISKIMG_SECTOR_SIZE;
+    if (blockcache_writesectors(fs->cache, startSector, numBlocks, src) != nbytes) {
+        return fserror_record(fs, FSERR_IO, "Failed to write %d sectors at %d", NULL, numBlocks, startSector, 0);
+    }
+    return 0;
+}
+
+int file_write(struct unixfilesystem *fs, int inumber, int offset, int len, const void *buf) {
+    if (offset < 0 || len < 0) {
+        return FSERR_INVAL;
+    }
+    if ((long) offset + len > INODE_MAX_SIZE) {
+        return FSERR_RANGE;
+    }
+
+    unixfilesystem_beginbatch(fs);
+    struct inode in;
+    int err = inode_iget(fs, inumber, &in);
+    if (err < 0) {
+        unixfilesystem_endbatch(fs);
+        return err;
+    }
+    int size = inode_getsize(&in);
+
+    const unsigned char *src = buf;
+    unsigned char block[DISKIMG_SECTOR_SIZE];
+    int done = 0;
+    int failed = 0;  // 0, or the FSERR_* code of the first failure.
+    // Whole blocks waiting to go out with one write.
+    int run_start = 0, run_blocks = 0;
+    const unsigned char *run_src = NULL;
+
+    while (done < len) {
+        int pos = offset + done;
+        int block_num = pos / DISKIMG_SECTOR_SIZE;
+        int within = pos % DISKIMG_SECTOR_SIZE;
+        int n = DISKIMG_SECTOR_SIZE - within < len - done ? DISKIMG_SECTOR_SIZE - within : len - done;
+
+        int fresh;
+        int disk_sector_num = inode_allocblock(fs, &in, block_num, &fresh);
+        if (disk_sector_num < 0) {
+            failed = disk_sector_num;
+            break;
+        }
+
+        if (n == DISKIMG_SECTOR_SIZE) {
+            if (run_blocks > 0 && disk_sector_num == run_start + run_blocks) {
+                run_blocks++;
+            } else {
+                if ((failed = file_writerun(fs, run_start, run_blocks, run_src)) < 0) {
+                    done -= run_blocks * DISKIMG_SECTOR_SIZE;
+                    break;
+                }
+                run_start = disk_sector_num;
+                run_blocks = 1;
+                run_src = src + done;
+            }
+            done += n;
+            continue;
+        }
+
+        // Partial block: merge with its current contents.  Bytes past the
+        // old end of file, and all of a new block, read as zeros.
+        if ((failed = file_writerun(fs, run_start, run_blocks, run_src)) < 0) {
+            done -= run_blocks * DISKIMG_SECTOR_SIZE;
+            break;
+        }
+        run_blocks = 0;
+        int valid = size - block_num * DISKIMG_SECTOR_SIZE;
+        if (fresh || valid <= 0) {
+            memset(block, 0, DISKIMG_SECTOR_SIZE);
+        } else if (blockcache_readsector(fs->cache, disk_sector_num, block) != DISKIMG_SECTOR_SIZE) {
+            failed = fserror_record(fs, FSERR_IO, "Failed to read disk sector %d", NULL, disk_sector_num, 0, 0);
+            break;
+        } else if (valid < DISKIMG_SECTOR_SIZE) {
+            memset(block + valid, 0, DISKIMG_SECTOR_SIZE - valid);
+        }
+        memcpy(block + within, src + done, n);
+        if (blockcache_writesector(fs->cache, disk_sector_num, block) != DISKIMG_SECTOR_SIZE) {
+            failed = fserror_record(fs, FSERR_IO, "Failed to write disk sector %d", NULL, disk_sector_num, 0, 0);
+            break;
+        }
+        done += n;
+    }
+    if (!failed && (failed = file_writerun(fs, run_start, run_blocks, run_src)) < 0) {
+        // None of the run made it out.
+        done -= run_blocks * DISKIMG_SECTOR_SIZE;
+    }
+
+    // Blocks may have been allocated even if nothing was written, so the
+    // inode is always written back.
+    if (offset + done > size) {
+        inode_setsize(&in, offset + done);
+    }
+    uint32_t now = time(NULL);
+    in.i_mtime[0] = now >> 16;
+    in.i_mtime[1] = now & 0xffff;
+    if ((err = inode_iwrite(fs, inumber, &in)) < 0 && !failed) {
+        failed = err;
+    }
+    chksumfile_invalidate(fs, inumber);
+    if ((in.i_mode & IFMT) == IFDIR) {
+        directory_invalidate(fs, inumber);
+    }
+    if (unixfilesystem_endbatch(fs) < 0 && !failed) {
+        failed = FSERR_IO;
+    }
+    return failed && done == 0 ? failed : done;
+}
+
+/**
+ * State of a file_reader.  In async mode chunk c is read into buffer
+ * c % window; slots[] counts the reads of that chunk still in flight and
+ * the bytes they should and did return.
+ */
+struct file_reader_slot {
+    int pending;
+    long expected;
+    long received;
+    int failed;     // 0, or the FSERR_* code of the chunk's failure.
+};
+
+struct file_reader {
+    struct unixfilesystem *fs;
+    int inumber;
+    int chunkSize;
+    int numChunks;
+    int next;                       // Chunk returned by the next call.
+    int window;                     // Chunks in flight, 0 to read synchronously.
+    struct inode_blockmap *map;
+    struct diskimg_aio *aio;
+    struct file_reader_slot *slots;
+    unsigned char *bufs;            // window buffers, or one in sync mode.
+};
+
+/**
+ * Takes one completed read off the queue and accounts it to its chunk.
+ * Returns 0, or -1 if the queue failed.
+ */
+static int file_reader_reap(struct file_reader *r) {
+    void *tag;
+    int n = diskimg_aio_wait(r->aio, &tag);
+    struct file_reader_slot *slot = tag;
+    if (slot == NULL) {
+        return -1;
+    }
+    slot->pending--;
+    if (n < 0) {
+        slot->failed = FSERR_IO;
+    } else {
+        slot->received += n;
+    }
+    return 0;
+}
+
+/**
+ * Queues the reads of chunk c, one per extent piece it covers, into its
+ * buffer.
+ */
+static void file_reader_submit(struct file_reader *r, int c) {
+    struct file_reader_slot *slot = &r->slots[c % r->window];
+    unsigned char *buf = r->bufs + (size_t) (c % r->window) * r->chunkSize;
+    int chunkBlocks = r->chunkSize / DISKIMG_SECTOR_SIZE;
+    int first = c * chunkBlocks;
+    int end = first + chunkBlocks < r->map->numBlocks ? first + chunkBlocks : r->map->numBlocks;
+
+    memset(slot, 0, sizeof(*slot));
+    int e = inode_blockmap_findextent(r->map, first);
+    for (int block = first; block < end; e++) {
+        const struct inode_extent *ext = &r->map->extents[e];
+        int extentEnd = ext->fileBlock + ext->numBlocks;
+        int n = (extentEnd < end ? extentEnd : end) - block;
+        if (ext->diskBlock == 0) {
+            // Unallocated blocks read as zeros, filled in here.
+            memset(buf + (size_t) (block - first) * DISKIMG_SECTOR_SIZE, 0, (size_t) n * DISKIMG_SECTOR_SIZE);
+            block += n;
+            continue;
+        }
+        if (diskimg_aio_submit(r->aio, ext->diskBlock + (block - ext->fileBlock), n,
+                               buf + (size_t) (block - first) * DISKIMG_SECTOR_SIZE, slot) < 0) {
+            slot->failed = FSERR_IO;
+            return;
+        }
+        FSSTATS_COUNT(r->fs->stats, FSSTATS_SECTORS_READ, n);
+        slot->pending++;
+        slot->expected += (long) n * DISKIMG_SECTOR_SIZE;
+        block += n;
+    }
+}
+
+struct file_reader *file_reader_open(struct unixfilesystem *fs, int inumber, int chunkSize) {
+    if (chunkSize <= 0 || chunkSize % DISKIMG_SECTOR_SIZE != 0) {
+        return NULL;
+    }
+    struct file_reader *r = calloc(1, sizeof(struct file_reader));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->fs = fs;
+    r->inumber = inumber;
+    r->chunkSize = chunkSize;
+    r->map = inode_getblockmap(fs, inumber, NULL);
+    if (r->map == NULL) {
+        free(r);
+        return NULL;
+    }
+    r->numChunks = (r->map->size + chunkSize - 1) / chunkSize;
+
+    // Readahead pays off only when there is a later chunk to overlap with
+    // and the data isn't already a memcpy away in the image mapping.  It
+    // reads the image directly, so not while the cache holds writes.
+    int window = fs->readahead < r->numChunks ? fs->readahead : r->numChunks;
+    if (window > 1 && diskimg_mapsector(fs->dfd, SUPERBLOCK_SECTOR) == NULL &&
+        blockcache_dirtysectors(fs->cache) == 0) {
+        int chunkBlocks = chunkSize / DISKIMG_SECTOR_SIZE;
+        r->aio = diskimg_aio_create(fs->dfd, window * chunkBlocks, 0);
+        r->slots = calloc(window, sizeof(struct file_reader_slot));
+        r->bufs = malloc((size_t) window * chunkSize);
+        if (r->aio != NULL && r->slots != NULL && r->bufs != NULL) {
+            r->window = window;
+            return r;
+        }
+        // Fall back to synchronous reads.
+        diskimg_aio_free(r->aio);
+        free(r->slots);
+        free(r->bufs);
+        r->aio = NULL;
+        r->slots = NULL;
+    }
+
+    r->bufs = malloc(chunkSize);
+    if (r->bufs == NULL) {
+        file_reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+int file_reader_next(struct file_reader *r, const void **data) {
+    if (r->next >= r->numChunks) {
+        return 0;
+    }
+    int c = r->next++;
+    int len = r->map->size - c * r->chunkSize;
+    if (len > r->chunkSize) {
+        len = r->chunkSize;
+    }
+
+    if (r->window == 0) {
+        *data = r->bufs;
+        return file_read(r->fs, r->inumber, c * r->chunkSize, len, r->bufs);
+    }
+
+    FSSTATS_TIME_BEGIN(r->fs->stats, start);
+    if (c == 0) {
+        for (int i = 0; i < r->window; i++) {
+            file_reader_submit(r, i);
+        }
+    } else if (c - 1 + r->window < r->numChunks) {
+        // The caller is done with chunk c-1: reuse its buffer for the chunk
+        // window places ahead.
+        file_reader_submit(r, c - 1 + r->window);
+    }
+    diskimg_aio_flush(r->aio);
+
+    struct file_reader_slot *slot = &r->slots[c % r->window];
+    while (slot->pending > 0) {
+        if (file_reader_reap(r) < 0) {
+            slot->failed = FSERR_IO;
+            break;
+        }
+    }
+    FSSTATS_TIME_END(r->fs->stats, FSSTATS_LAYER_FILE, start);
+    if (slot->failed || slot->received != slot->expected) {
+        return fserror_record(r->fs, FSERR_IO, "Failed to read chunk %d of inumber %d", NULL, c, r->inumber, 0);
+    }
+    FSSTATS_COUNT(r->fs->stats, FSSTATS_BYTES_READ, len);
+    *data = r->bufs + (size_t) (c % r->window) * r->chunkSize;
+    return len;
+}
+
+void file_reader_close(struct file_reader *r) {
+    if (r == NULL) {
+        return;
+    }
+    // Waits for reads still in flight into bufs.
+    diskimg_aio_free(r->aio);
+    if (r->map != NULL) {
+        inode_putblockmap(r->map);
+    }
+    free(r->slots);
+    free(r->bufs);
+    free(r);
+}
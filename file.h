@@ -5,8 +5,64 @@
 
 /**
  * Fetches the specified file block from the specified inode.
- * Returns the number of valid bytes in the block, -1 on error.
+ * Returns the number of valid bytes in the block or a negative FSERR_* code
+ * (see fserror.h): FSERR_RANGE for a block past the end of the file.  A
+ * block that isn't allocated (a hole) reads as zeros, without a disk read.
  */
 int file_getblock(struct unixfilesystem *fs, int inumber, int blockNo, void *buf); 
 
+/**
+ * Like file_getblock(), but avoids copying the block when the disk image is
+ * memory mapped: on success *data points either into the mapping or at
+ * scratch, which must hold DISKIMG_SECTOR_SIZE bytes.
+ * Returns the number of valid bytes in the block or a negative FSERR_* code.
+ */
+int file_getblockref(struct unixfilesystem *fs, int inumber, int blockNo,
+                     void *scratch, const void **data);
+
+/**
+ * Reads up to len bytes of the specified file starting at byte offset into
+ * buf.  Blocks that are contiguous on disk are fetched with a single bulk
+ * read, so large ranges cost a handful of system calls rather than one per
+ * block.  Holes read as zeros and cost no I/O.  Returns the number of bytes
+ * read (short only at end of file), or a negative FSERR_* code.
+ */
+int file_read(struct unixfilesystem *fs, int inumber, int offset, int len, void *buf);
+
+/**
+ * Writes len bytes from buf into the specified file starting at byte
+ * offset, allocating blocks as needed and extending the file when the range
+ * runs past its end (a gap left before offset stays unallocated).  Runs of
+ * whole blocks that are contiguous on disk go out with a single write.  The
+ * inode and superblock are flushed once, at the end of the write batch.
+ * Returns the number of bytes written (short if the disk fills up), or a
+ * negative FSERR_* code if nothing was.
+ */
+int file_write(struct unixfilesystem *fs, int inumber, int offset, int len, const void *buf);
+
+/**
+ * Reads a whole file front to back in chunks of chunkSize bytes (a multiple
+ * of DISKIMG_SECTOR_SIZE), keeping the reads of the next fs->readahead
+ * chunks in flight while the caller works on the current one.  The reads
+ * go through a diskimg_aio queue; with no readahead, a mapped image or a
+ * file of a single chunk each chunk is simply file_read().
+ *
+ * A reader belongs to the thread that opened it.
+ */
+struct file_reader;
+
+/**
+ * Opens a reader on inumber.  Returns NULL on error.
+ */
+struct file_reader *file_reader_open(struct unixfilesystem *fs, int inumber, int chunkSize);
+
+/**
+ * Points *data at the next chunk of the file, valid until the next call or
+ * file_reader_close().  Returns the chunk's length (short only for the last
+ * one), 0 at end of file, or a negative FSERR_* code.
+ */
+int file_reader_next(struct file_reader *r, const void **data);
+
+void file_reader_close(struct file_reader *r);
+
 #endif // _FILE_H_
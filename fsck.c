@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fsck.h"
+#include "diskimg.h"
+#include "blockcache.h"
+#include "inode.h"
+
+#define INODES_PER_BLOCK (DISKIMG_SECTOR_SIZE / sizeof(struct inode))
+#define ADDRESSES_PER_BLOCK (DISKIMG_SECTOR_SIZE / sizeof(uint16_t))
+#define ENTRIES_PER_BLOCK (DISKIMG_SECTOR_SIZE / sizeof(struct direntv6))
+#define NADDR (sizeof(((struct inode *) 0)->i_addr) / sizeof(uint16_t))
+#define NFREE (sizeof(((struct filsys *) 0)->s_free) / sizeof(uint16_t))
+#define NINODE (sizeof(((struct filsys *) 0)->s_inode) / sizeof(uint16_t))
+
+// Inodes a thread takes from the table at a time.
+#define FSCK_INODE_RANGE 256
+
+/**
+ * What the parallel pass found out about one inode.  refs is bumped by the
+ * thread reading any directory; the rest only by the thread that owns the
+ * inode, and all of it is read after the threads are joined.
+ */
+struct fsck_inode {
+  int refs;           // Directory entries naming the inode.
+  int badBlocks;      // Addresses in its tree outside the data area.
+  int firstBad;       // The first of them.
+  int badEntries;     // Entries of the directory naming no inode.
+  int ioErrors;       // Indirect or directory blocks that couldn't be read.
+};
+
+struct fsck {
+  struct unixfilesystem *fs;
+  const struct inode *inodes;   // The inode table; inodes[i] is inumber i+1.
+  int numInodes;
+  int dataStart;                // First block of the data area.
+  int fsize;
+  uint8_t *claimed;             // Blocks in use.
+  uint8_t *dup;                 // Blocks in use more than once.
+  uint8_t *free;                // Blocks on the free list.
+  struct fsck_inode *status;    // Indexed by inumber.
+  int usedBlocks;
+  int next;                     // First inumber of the next range to check.
+};
+
+static int fsck_testbit(const uint8_t *map, int n) {
+  return (map[n / 8] >> (n % 8)) & 1;
+}
+
+/**
+ * Claims block bno for inumber.  Returns 0, or -1 if bno is outside the
+ * data area (it is then not followed).
+ */
+static int fsck_claim(struct fsck *c, int inumber, int bno) {
+  if (bno < c->dataStart || bno >= c->fsize) {
+    struct fsck_inode *s = &c->status[inumber];
+    if (s->badBlocks++ == 0) s->firstBad = bno;
+    return -1;
+  }
+  uint8_t bit = 1 << (bno % 8);
+  if (__atomic_fetch_or(&c->claimed[bno / 8], bit, __ATOMIC_RELAXED) & bit) {
+    __atomic_fetch_or(&c->dup[bno / 8], bit, __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_add(&c->usedBlocks, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/**
+ * Counts the entries of block fileBlock (disk block bno) of directory
+ * inumber against the inodes they name.
+ */
+static void fsck_dirblock(struct fsck *c, int inumber, int size, int fileBlock, int bno) {
+  int numEntries = (size - fileBlock * DISKIMG_SECTOR_SIZE) / sizeof(struct direntv6);
+  if (numEntries <= 0) return;
+  if (numEntries > (int) ENTRIES_PER_BLOCK) numEntries = ENTRIES_PER_BLOCK;
+
+  unsigned char buf[DISKIMG_SECTOR_SIZE];
+  const struct direntv6 *entries = blockcache_getsector(c->fs->cache, bno, buf);
+  if (entries == NULL) {
+    c->status[inumber].ioErrors++;
+    return;
+  }
+  for (int i = 0; i < numEntries; i++) {
+    int target = entries[i].d_inumber;
+    if (target == 0) continue;
+    if (target > c->numInodes) {
+      c->status[inumber].badEntries++;
+    } else {
+      __atomic_fetch_add(&c->status[target].refs, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/**
+ * Claims data block bno, logical block fileBlock of inumber, and counts
+ * its entries if the inode is a directory.
+ */
+static void fsck_datablock(struct fsck *c, int inumber, const struct inode *in,
+                           int fileBlock, int bno) {
+  if (bno == 0 || fsck_claim(c, inumber, bno) < 0) return;
+  if ((in->i_mode & IFMT) == IFDIR) {
+    fsck_dirblock(c, inumber, (in->i_size0 << 16) | in->i_size1, fileBlock, bno);
+  }
+}
+
+/**
+ * Claims indirect block bno and the data blocks it lists, the first of
+ * which is logical block fileBlock.
+ */
+static void fsck_indirect(struct fsck *c, int inumber, const struct inode *in,
+                          int fileBlock, int bno) {
+  if (bno == 0 || fsck_claim(c, inumber, bno) < 0) return;
+
+  unsigned char buf[DISKIMG_SECTOR_SIZE];
+  const uint16_t *addrs = blockcache_getsector(c->fs->cache, bno, buf);
+  if (addrs == NULL) {
+    c->status[inumber].ioErrors++;
+    return;
+  }
+  for (int i = 0; i < (int) ADDRESSES_PER_BLOCK; i++) {
+    fsck_datablock(c, inumber, in, fileBlock + i, addrs[i]);
+  }
+}
+
+/**
+ * Walks the whole i_addr tree of inumber, as V6 icheck does: every nonzero
+ * address counts, whatever the file size.
+ */
+static void fsck_inode(struct fsck *c, int inumber) {
+  const struct inode *in = &c->inodes[inumber - 1];
+  int type = in->i_mode & IFMT;
+  if (type == IFCHR || type == IFBLK) {
+    // i_addr[0] holds a device number, not a block.
+    return;
+  }
+
+  if ((in->i_mode & ILARG) == 0) {
+    for (int i = 0; i < (int) NADDR; i++) {
+      fsck_datablock(c, inumber, in, i, in->i_addr[i]);
+    }
+    return;
+  }
+
+  for (int i = 0; i < (int) NADDR - 1; i++) {
+    fsck_indirect(c, inumber, in, i * ADDRESSES_PER_BLOCK, in->i_addr[i]);
+  }
+  int bno = in->i_addr[NADDR - 1];
+  if (bno == 0 || fsck_claim(c, inumber, bno) < 0) return;
+
+  uint16_t addrs[ADDRESSES_PER_BLOCK];
+  if (blockcache_readsector(c->fs->cache, bno, addrs) != DISKIMG_SECTOR_SIZE) {
+    c->status[inumber].ioErrors++;
+    return;
+  }
+  for (int i = 0; i < (int) ADDRESSES_PER_BLOCK; i++) {
+    fsck_indirect(c, inumber, in, (NADDR - 1 + i) * ADDRESSES_PER_BLOCK, addrs[i]);
+  }
+}
+
+static void *fsck_worker(void *arg) {
+  struct fsck *c = arg;
+  for (;;) {
+    int first = __atomic_fetch_add(&c->next, FSCK_INODE_RANGE, __ATOMIC_RELAXED);
+    if (first > c->numInodes) break;
+    int last = first + FSCK_INODE_RANGE - 1;
+    if (last > c->numInodes) last = c->numInodes;
+    for (int inumber = first; inumber <= last; inumber++) {
+      if (c->inodes[inumber - 1].i_mode & IALLOC) fsck_inode(c, inumber);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Puts bno on the free-block bitmap.  Returns 0, or -1 if it is not a data
+ * block or was already there, in which case a chain through it must not be
+ * followed.
+ */
+static int fsck_freeblock(struct fsck *c, int bno, FILE *out, struct fsck_result *r) {
+  if (bno < c->dataStart || bno >= c->fsize) {
+    fprintf(out, "Bad block %d on the free list\n", bno);
+    r->superErrors++;
+    return -1;
+  }
+  if (fsck_testbit(c->free, bno)) {
+    fprintf(out, "Block %d is on the free list twice\n", bno);
+    r->dupBlocks++;
+    return -1;
+  }
+  c->free[bno / 8] |= 1 << (bno % 8);
+  r->freeBlocks++;
+  if (fsck_testbit(c->claimed, bno)) {
+    fprintf(out, "Block %d is both free and in use\n", bno);
+    r->dupBlocks++;
+  }
+  return 0;
+}
+
+/**
+ * Walks the free list from the superblock down its chain of blocks.
+ */
+static void fsck_freelist(struct fsck *c, FILE *out, struct fsck_result *r) {
+  const struct filsys *sb = &c->fs->superblock;
+  int nfree = sb->s_nfree;
+  const uint16_t *list = sb->s_free;
+  uint16_t chain[ADDRESSES_PER_BLOCK];
+  int where = SUPERBLOCK_SECTOR;
+
+  while (nfree > 0) {
+    if (nfree > (int) NFREE) {
+      fprintf(out, "Free list count %d in block %d is out of range\n", nfree, where);
+      r->superErrors++;
+      return;
+    }
+    for (int i = nfree - 1; i >= 1; i--) {
+      fsck_freeblock(c, list[i], out, r);
+    }
+    // list[0] is the next chain block, or 0 at the end of the chain.
+    where = list[0];
+    if (where == 0 || fsck_freeblock(c, where, out, r) < 0) return;
+    if (blockcache_readsector(c->fs->cache, where, chain) != DISKIMG_SECTOR_SIZE) {
+      fprintf(out, "Can't read free list block %d\n", where);
+      r->ioErrors++;
+      return;
+    }
+    nfree = chain[0];
+    list = chain + 1;
+  }
+}
+
+/**
+ * Checks the superblock fields everything else relies on.  Returns 0 if
+ * the rest of the check can go ahead.
+ */
+static int fsck_superblock(struct unixfilesystem *fs, FILE *out, struct fsck_result *r) {
+  const struct filsys *sb = &fs->superblock;
+  int imageBlocks = diskimg_getsize(fs->dfd) / DISKIMG_SECTOR_SIZE;
+  if (sb->s_isize == 0 || INODE_START_SECTOR + sb->s_isize > sb->s_fsize) {
+    fprintf(out, "Superblock s_isize %d doesn't fit in s_fsize %d\n", sb->s_isize, sb->s_fsize);
+    r->superErrors++;
+    return -1;
+  }
+  if (sb->s_fsize > imageBlocks) {
+    fprintf(out, "Superblock s_fsize %d exceeds the image (%d blocks)\n", sb->s_fsize, imageBlocks);
+    r->superErrors++;
+    return -1;
+  }
+  if (sb->s_ninode > NINODE) {
+    fprintf(out, "Superblock s_ninode %d is out of range\n", sb->s_ninode);
+    r->superErrors++;
+  }
+  return 0;
+}
+
+/**
+ * Compares what the parallel pass found with the inode table, in one pass
+ * over the table.
+ */
+static void fsck_inodes(struct fsck *c, FILE *out, struct fsck_result *r) {
+  for (int inumber = 1; inumber <= c->numInodes; inumber++) {
+    const struct inode *in = &c->inodes[inumber - 1];
+    const struct fsck_inode *s = &c->status[inumber];
+
+    if ((in->i_mode & IALLOC) == 0) {
+      if (s->refs > 0) {
+        fprintf(out, "Inode %d is free but named by %d directory entries\n", inumber, s->refs);
+        r->entryErrors += s->refs;
+      }
+      continue;
+    }
+
+    r->inodes++;
+    if ((in->i_mode & IFMT) == IFDIR) r->directories++;
+    if (s->badBlocks > 0) {
+      fprintf(out, "Inode %d has %d block addresses outside the data area (first %d)\n",
+              inumber, s->badBlocks, s->firstBad);
+      r->badBlocks += s->badBlocks;
+    }
+    if (s->badEntries > 0) {
+      fprintf(out, "Directory %d has %d entries naming no inode\n", inumber, s->badEntries);
+      r->entryErrors += s->badEntries;
+    }
+    if (s->ioErrors > 0) {
+      fprintf(out, "Inode %d has %d blocks that can't be read\n", inumber, s->ioErrors);
+      r->ioErrors += s->ioErrors;
+    }
+    if (in->i_nlink != s->refs) {
+      fprintf(out, "Inode %d has link count %d but %d directory entries\n",
+              inumber, in->i_nlink, s->refs);
+      r->linkErrors++;
+    }
+  }
+
+  const struct inode *root = &c->inodes[ROOT_INUMBER - 1];
+  if ((root->i_mode & (IALLOC | IFMT)) != (IALLOC | IFDIR)) {
+    fprintf(out, "Root inode %d is not an allocated directory\n", ROOT_INUMBER);
+    r->entryErrors++;
+  }
+
+  const struct filsys *sb = &c->fs->superblock;
+  for (int i = 0; i < sb->s_ninode && i < (int) NINODE; i++) {
+    int inumber = sb->s_inode[i];
+    if (inumber < ROOT_INUMBER || inumber > c->numInodes ||
+        (c->inodes[inumber - 1].i_mode & IALLOC)) {
+      fprintf(out, "Free inode cache entry %d names inode %d, which isn't free\n", i, inumber);
+      r->superErrors++;
+    }
+  }
+}
+
+static int fsck_run(struct fsck *c, int numThreads, FILE *out, struct fsck_result *r) {
+  int bitmapBytes = c->fsize / 8 + 1;
+  c->claimed = calloc(bitmapBytes, 1);
+  c->dup = calloc(bitmapBytes, 1);
+  c->free = calloc(bitmapBytes, 1);
+  c->status = calloc(c->numInodes + 1, sizeof(struct fsck_inode));
+  if (c->claimed == NULL || c->dup == NULL || c->free == NULL || c->status == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+
+  // Block-claim and link-count pass, over ranges of inodes in parallel.
+  c->next = ROOT_INUMBER;
+  pthread_t *workers = malloc((numThreads > 0 ? numThreads : 1) * sizeof(pthread_t));
+  int started = 0;
+  while (workers != NULL && started < numThreads &&
+         pthread_create(&workers[started], NULL, fsck_worker, c) == 0) {
+    started++;
+  }
+  if (started == 0) {
+    // No threads available: do the work on this thread instead.
+    fsck_worker(c);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  r->usedBlocks = c->usedBlocks;
+
+  fsck_inodes(c, out, r);
+  fsck_freelist(c, out, r);
+
+  for (int bno = c->dataStart; bno < c->fsize; bno++) {
+    if (fsck_testbit(c->dup, bno)) {
+      fprintf(out, "Block %d is in use more than once\n", bno);
+      r->dupBlocks++;
+    } else if (!fsck_testbit(c->claimed, bno) && !fsck_testbit(c->free, bno)) {
+      r->missingBlocks++;
+    }
+  }
+  if (r->missingBlocks > 0) {
+    fprintf(out, "%d blocks are neither in use nor free\n", r->missingBlocks);
+  }
+  return 0;
+}
+
+int fsck_check(struct unixfilesystem *fs, int numThreads, FILE *out, struct fsck_result *result) {
+  struct fsck_result r;
+  memset(&r, 0, sizeof(r));
+
+  unixfilesystem_beginbatch(fs);
+  struct fsck c = { .fs = fs };
+  struct inode *table = NULL;
+  int err = fsck_superblock(fs, out, &r);
+  if (err == 0) {
+    const struct filsys *sb = &fs->superblock;
+    c.numInodes = sb->s_isize * INODES_PER_BLOCK;
+    c.dataStart = INODE_START_SECTOR + sb->s_isize;
+    c.fsize = sb->s_fsize;
+    c.inodes = fs->inodes;
+    if (c.inodes == NULL) {
+      // Read the table with one sequential read, as unixfilesystem does.
+      table = malloc((size_t) sb->s_isize * DISKIMG_SECTOR_SIZE);
+      if (table == NULL ||
+          blockcache_readsectors(fs->cache, INODE_START_SECTOR, sb->s_isize, table) !=
+          sb->s_isize * DISKIMG_SECTOR_SIZE) {
+        fprintf(stderr, "Error reading inode table\n");
+        err = -1;
+      }
+      c.inodes = table;
+    }
+    if (err == 0) {
+      err = fsck_run(&c, numThreads, out, &r);
+    }
+  }
+  unixfilesystem_endbatch(fs);
+
+  free(table);
+  free(c.claimed);
+  free(c.dup);
+  free(c.free);
+  free(c.status);
+  if (result != NULL) *result = r;
+  if (err < 0 && r.superErrors == 0) return -1;
+  return r.badBlocks + r.dupBlocks + r.missingBlocks + r.linkErrors + r.entryErrors +
+         r.superErrors + r.ioErrors;
+}
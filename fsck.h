@@ -0,0 +1,49 @@
+#ifndef _FSCK_H_
+#define _FSCK_H_
+
+#include <stdio.h>
+
+#include "unixfilesystem.h"
+
+/**
+ * Consistency check of a V6 filesystem in the spirit of V6 icheck and
+ * dcheck.  Every block address in the i_addr tree of each allocated inode
+ * must lie in the data area [2+s_isize, s_fsize) and belong to one file
+ * only; every data block must be either in use or on the free list, but
+ * not both; the free inode cache must name free inodes; and the i_nlink of
+ * each inode must equal the number of directory entries naming it ("."
+ * and ".." included).
+ *
+ * The inode table is split into ranges checked in parallel: each thread
+ * walks the trees of its inodes, marks their blocks in a shared claim
+ * bitmap and counts the entries of its directories.  One sequential pass
+ * over the inode table then compares the counts with i_nlink, and the free
+ * list is reconciled against the claim bitmap.
+ */
+
+/**
+ * What a check found.  The counters after usedBlocks are problems.
+ */
+struct fsck_result {
+  int inodes;         // Allocated inodes.
+  int directories;    // Allocated directories.
+  int usedBlocks;     // Data and indirect blocks in use.
+  int freeBlocks;     // Blocks on the free list.
+  int badBlocks;      // Block addresses outside the data area.
+  int dupBlocks;      // Blocks in use twice, or both in use and free.
+  int missingBlocks;  // Data blocks neither in use nor free.
+  int linkErrors;     // Inodes whose i_nlink disagrees with the directories.
+  int entryErrors;    // Directory entries naming bad or free inodes.
+  int superErrors;    // Damaged superblock fields or free lists.
+  int ioErrors;       // Blocks that couldn't be read.
+};
+
+/**
+ * Checks fs with numThreads threads, printing one line per problem to out
+ * and filling *result.  The check runs inside a write batch, so writers
+ * wait for it.  Returns the number of problems found, or -1 if the check
+ * couldn't be run.
+ */
+int fsck_check(struct unixfilesystem *fs, int numThreads, FILE *out, struct fsck_result *result);
+
+#endif // _FSCK_H_
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fserror.h"
+#include "unixfilesystem.h"
+
+struct fserror_log {
+  pthread_mutex_t lock;                  // Protects ring, next and printed.
+  uint64_t next;                         // Sequence number of the next entry.
+  uint64_t printed;                      // Entries before this were printed.
+  struct fserror_entry ring[FSERROR_LOG_ENTRIES];
+  uint64_t counts[FSERROR_NUM_CODES];    // Indexed by -code, bumped atomically.
+};
+
+static const char *const descriptions[FSERROR_NUM_CODES] = {
+  "success",
+  "failure",
+  "invalid argument",
+  "inode not allocated",
+  "out of range",
+  "block not allocated",
+  "not a directory",
+  "no such name",
+  "name too long",
+  "name exists",
+  "no space left",
+  "I/O error",
+  "corrupt filesystem",
+  "out of memory",
+};
+
+struct fserror_log *fserror_create(void) {
+  struct fserror_log *log = calloc(1, sizeof(struct fserror_log));
+  if (log == NULL) return NULL;
+  pthread_mutex_init(&log->lock, NULL);
+  return log;
+}
+
+void fserror_free(struct fserror_log *log) {
+  if (log == NULL) return;
+  pthread_mutex_destroy(&log->lock);
+  free(log);
+}
+
+const char *fserror_string(int code) {
+  if (code > 0 || -code >= FSERROR_NUM_CODES) return "unknown error";
+  return descriptions[-code];
+}
+
+int fserror_record(struct unixfilesystem *fs, int code, const char *fmt,
+                   const char *name, int a, int b, int c) {
+  struct fserror_log *log = fs != NULL ? fs->errors : NULL;
+  if (log == NULL || code >= 0 || -code >= FSERROR_NUM_CODES) return code;
+
+  __atomic_fetch_add(&log->counts[-code], 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&log->lock);
+  struct fserror_entry *e = &log->ring[log->next % FSERROR_LOG_ENTRIES];
+  e->code = code;
+  e->fmt = fmt;
+  e->name[0] = '\0';
+  if (name != NULL) {
+    strncat(e->name, name, FSERROR_NAME_SIZE - 1);
+  }
+  e->args[0] = a;
+  e->args[1] = b;
+  e->args[2] = c;
+  log->next++;
+  pthread_mutex_unlock(&log->lock);
+  return code;
+}
+
+uint64_t fserror_count(struct unixfilesystem *fs, int code) {
+  struct fserror_log *log = fs->errors;
+  if (log == NULL || code > 0 || -code >= FSERROR_NUM_CODES) return 0;
+  return __atomic_load_n(&log->counts[-code], __ATOMIC_RELAXED);
+}
+
+int fserror_print(struct unixfilesystem *fs, FILE *f) {
+  struct fserror_log *log = fs->errors;
+  if (log == NULL) return 0;
+
+  // Copy the entries out so the formatting is done without the lock.
+  struct fserror_entry entries[FSERROR_LOG_ENTRIES];
+  pthread_mutex_lock(&log->lock);
+  uint64_t first = log->printed;
+  if (log->next - first > FSERROR_LOG_ENTRIES) first = log->next - FSERROR_LOG_ENTRIES;
+  uint64_t dropped = first - log->printed;
+  int n = log->next - first;
+  for (int i = 0; i < n; i++) {
+    entries[i] = log->ring[(first + i) % FSERROR_LOG_ENTRIES];
+  }
+  log->printed = log->next;
+  pthread_mutex_unlock(&log->lock);
+
+  if (dropped > 0) {
+    fprintf(f, "(%llu earlier errors dropped)\n", (unsigned long long) dropped);
+  }
+  for (int i = 0; i < n; i++) {
+    const struct fserror_entry *e = &entries[i];
+    fputs("Error: ", f);
+    if (strstr(e->fmt, "%s") != NULL) {
+      fprintf(f, e->fmt, e->name, e->args[0], e->args[1], e->args[2]);
+    } else {
+      fprintf(f, e->fmt, e->args[0], e->args[1], e->args[2]);
+    }
+    fprintf(f, " (%s)\n", fserror_string(e->code));
+  }
+  return n;
+}
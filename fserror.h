@@ -0,0 +1,86 @@
+#ifndef _FSERROR_H_
+#define _FSERROR_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/**
+ * Error codes returned by the inode, file, directory, pathname and alloc
+ * layers.  They are all negative, so callers that only test for a negative
+ * result keep working; FSERR_FAILURE is the plain -1 of old.
+ *
+ * Expected misses (FSERR_NOTALLOC, FSERR_RANGE, FSERR_HOLE, FSERR_NOENT,
+ * FSERR_NAMETOOLONG from lookups) are only returned.  Everything else is
+ * also recorded, with its details, in a small per-filesystem ring of
+ * diagnostics that is formatted only when fserror_print() is called, so a
+ * failing call costs a few stores rather than a formatted write to stderr.
+ */
+enum fserror {
+  FSERR_FAILURE = -1,       // Unspecified failure.
+  FSERR_INVAL = -2,         // Bad argument: inumber out of range, relative path...
+  FSERR_NOTALLOC = -3,      // The inode is not allocated.
+  FSERR_RANGE = -4,         // Block or offset outside the file or the largest file.
+  FSERR_HOLE = -5,          // The file block is not allocated.
+  FSERR_NOTDIR = -6,        // Not a directory.
+  FSERR_NOENT = -7,         // Name not found.
+  FSERR_NAMETOOLONG = -8,   // Name longer than a directory entry holds.
+  FSERR_EXIST = -9,         // Name already present.
+  FSERR_NOSPC = -10,        // No free blocks or inodes.
+  FSERR_IO = -11,           // A sector couldn't be read or written.
+  FSERR_CORRUPT = -12,      // On-disk structures contradict each other.
+  FSERR_NOMEM = -13,        // Out of memory.
+};
+
+#define FSERROR_NUM_CODES 14
+
+// Diagnostics kept per filesystem; older ones are overwritten.
+#define FSERROR_LOG_ENTRIES 64
+
+// Longest name a diagnostic keeps (a directory entry name fits).
+#define FSERROR_NAME_SIZE 16
+
+struct unixfilesystem;
+
+/**
+ * One recorded failure.  fmt is a string literal taking, in this order,
+ * the name (if it has a %s) and then up to three ints.
+ */
+struct fserror_entry {
+  int code;
+  const char *fmt;
+  char name[FSERROR_NAME_SIZE];
+  int args[3];
+};
+
+struct fserror_log;
+
+struct fserror_log *fserror_create(void);
+void fserror_free(struct fserror_log *log);
+
+/**
+ * Returns a short description of code.
+ */
+const char *fserror_string(int code);
+
+/**
+ * Records a diagnostic on fs and returns code, so that a failing function
+ * can end with "return fserror_record(...)".  name may be NULL; it is
+ * truncated to FSERROR_NAME_SIZE-1 characters.  Safe to call from several
+ * threads at once.
+ */
+int fserror_record(struct unixfilesystem *fs, int code, const char *fmt,
+                   const char *name, int a, int b, int c);
+
+/**
+ * Number of failures recorded on fs with the given code since it was
+ * created, including those no longer in the ring.
+ */
+uint64_t fserror_count(struct unixfilesystem *fs, int code);
+
+/**
+ * Formats the diagnostics still in the ring of fs to f, oldest first, and
+ * empties the ring.  Returns the number printed.
+ */
+int fserror_print(struct unixfilesystem *fs, FILE *f);
+
+#endif // _FSERROR_H_
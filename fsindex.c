@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fsindex.h"
+#include "diskimg.h"
+#include "blockcache.h"
+#include "inode.h"
+#include "directory.h"
+#include "chksumfile.h"
+
+#define INODES_PER_BLOCK (DISKIMG_SECTOR_SIZE / sizeof(struct inode))
+
+#define FSINDEX_MAGIC "V6FSIDX"
+#define FSINDEX_VERSION 2
+
+// Deepest directory the tree walk descends into, as a guard against loops
+// in damaged images.  Deeper paths wouldn't fit in a path dump line anyway.
+#define FSINDEX_MAX_DEPTH 512
+
+/**
+ * Identifies the image an index was built from.
+ */
+struct fsindex_key {
+  uint64_t imageSize;
+  int64_t mtimeSec;
+  int64_t mtimeNsec;
+  uint64_t superHash;        // FNV-1a of the superblock.
+  uint32_t numInodes;
+  uint32_t pad;
+};
+
+/**
+ * Start of the index file.  The sections follow at the given offsets, each
+ * 8-byte aligned: numInodes+1 struct chksumfile_memo (indexed by inumber)
+ * and numPaths struct fsindex_path.
+ */
+struct fsindex_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t numPaths;
+  struct fsindex_key key;
+  char engine[16];           // Name of the hash of the checksums.
+  uint64_t chksumsOffset;
+  uint64_t pathsOffset;
+  uint64_t fileSize;
+};
+
+struct fsindex {
+  struct unixfilesystem *fs;
+  char *path;
+  struct fsindex_key key;    // Of the image as it is now.
+  int valid;                 // The file's key matches.
+  int numReused;             // Checksums taken from the file.
+  void *map;                 // The file, or NULL.
+  size_t mapSize;
+  const struct fsindex_header *header;
+};
+
+static uint64_t fsindex_fnv1a(const void *data, size_t len) {
+  const uint8_t *p = data;
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+static const char *fsindex_engine(struct unixfilesystem *fs) {
+  return fs->chksumEngine ? fs->chksumEngine->name : chksumengine_sha1.name;
+}
+
+static int fsindex_getkey(struct unixfilesystem *fs, struct fsindex_key *key) {
+  struct stat st;
+  if (fstat(fs->dfd, &st) < 0) return -1;
+  memset(key, 0, sizeof(*key));
+  key->imageSize = st.st_size;
+  key->mtimeSec = st.st_mtim.tv_sec;
+  key->mtimeNsec = st.st_mtim.tv_nsec;
+  key->superHash = fsindex_fnv1a(&fs->superblock, sizeof(fs->superblock));
+  key->numInodes = fs->superblock.s_isize * INODES_PER_BLOCK;
+  return 0;
+}
+
+static size_t fsindex_align(size_t offset) {
+  return (offset + 7) & ~(size_t) 7;
+}
+
+/**
+ * Returns 1 if the mapped file is an index with sections that fit in it
+ * and a tree whose subtrees stay inside it.
+ */
+static int fsindex_check(const struct fsindex *idx) {
+  const struct fsindex_header *h = idx->header;
+  if (idx->mapSize < sizeof(*h) || memcmp(h->magic, FSINDEX_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != FSINDEX_VERSION || h->fileSize != idx->mapSize ||
+      h->key.numInodes != idx->key.numInodes) {
+    return 0;
+  }
+  size_t n = h->key.numInodes;
+  if (h->chksumsOffset % 8 || h->pathsOffset % 8 ||
+      h->chksumsOffset + (n + 1) * sizeof(struct chksumfile_memo) > h->fileSize ||
+      h->pathsOffset + (size_t) h->numPaths * sizeof(struct fsindex_path) > h->fileSize) {
+    return 0;
+  }
+  const struct fsindex_path *paths = (const void *) ((const char *) idx->map + h->pathsOffset);
+  for (uint32_t i = 0; i < h->numPaths; i++) {
+    if (paths[i].end <= i || paths[i].end > h->numPaths) return 0;
+  }
+  return 1;
+}
+
+/**
+ * Copies the checksums of the file into the checksum memo of fs, if the
+ * file matches the image.  Otherwise none of them can be trusted: a data
+ * block can change without its inode changing, so they are all dropped.
+ */
+static void fsindex_reuse(struct fsindex *idx) {
+  struct unixfilesystem *fs = idx->fs;
+  const struct fsindex_header *h = idx->header;
+  if (!idx->valid || fs->chksums == NULL ||
+      strncmp(h->engine, fsindex_engine(fs), sizeof(h->engine)) != 0) return;
+
+  const struct chksumfile_memo *memo = (const void *) ((const char *) idx->map + h->chksumsOffset);
+  int numInodes = h->key.numInodes;
+  pthread_mutex_lock(&fs->chksumLock);
+  for (int inumber = 1; inumber <= numInodes && inumber < fs->numChksums; inumber++) {
+    if (memo[inumber].size == 0 || memo[inumber].size > CHKSUMFILE_SIZE) continue;
+    fs->chksums[inumber] = memo[inumber];
+    idx->numReused++;
+  }
+  pthread_mutex_unlock(&fs->chksumLock);
+}
+
+struct fsindex *fsindex_open(struct unixfilesystem *fs, const char *path) {
+  struct fsindex *idx = calloc(1, sizeof(struct fsindex));
+  if (idx == NULL) return NULL;
+  idx->fs = fs;
+  idx->path = strdup(path);
+  if (idx->path == NULL || fsindex_getkey(fs, &idx->key) < 0) {
+    fsindex_close(idx);
+    return NULL;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return idx;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      idx->map = map;
+      idx->mapSize = st.st_size;
+      idx->header = map;
+    }
+  }
+  close(fd);
+
+  if (idx->map == NULL || !fsindex_check(idx)) {
+    // Unusable: start from scratch.
+    if (idx->map != NULL) munmap(idx->map, idx->mapSize);
+    idx->map = NULL;
+    idx->header = NULL;
+    return idx;
+  }
+  idx->valid = memcmp(&idx->header->key, &idx->key, sizeof(idx->key)) == 0;
+  fsindex_reuse(idx);
+  return idx;
+}
+
+int fsindex_valid(const struct fsindex *idx) {
+  return idx->valid;
+}
+
+const struct fsindex_path *fsindex_paths(const struct fsindex *idx, int *numPaths) {
+  if (!idx->valid) return NULL;
+  *numPaths = idx->header->numPaths;
+  return (const void *) ((const char *) idx->map + idx->header->pathsOffset);
+}
+
+/**
+ * A growing array of tree entries.
+ */
+struct fsindex_tree {
+  struct fsindex_path *paths;
+  int numPaths;
+  int capacity;
+};
+
+/**
+ * Returns 1 for the "." and ".." entries of a directory.
+ */
+static int fsindex_isdot(const struct direntv6 *d) {
+  const char *n = d->d_name;
+  return n[0] == '.' && ((n[1] == 0) || ((n[1] == '.') && (n[2] == 0)));
+}
+
+/**
+ * Appends the entries of directory dirinumber and, after each
+ * subdirectory, its own entries, in path dump order.  Returns 0 on
+ * success, -1 if out of memory.
+ */
+static int fsindex_walk(struct unixfilesystem *fs, int dirinumber, int depth, struct fsindex_tree *t) {
+  struct directory_iterator it;
+  if (directory_iterator_open(fs, dirinumber, &it) < 0) return 0;
+
+  int err = 0;
+  struct direntv6 d;
+  while (err == 0 && directory_iterator_next(&it, &d) > 0) {
+    if (fsindex_isdot(&d)) continue;
+    if (t->numPaths == t->capacity) {
+      int capacity = t->capacity ? 2 * t->capacity : 64;
+      struct fsindex_path *paths = realloc(t->paths, capacity * sizeof(struct fsindex_path));
+      if (paths == NULL) {
+        err = -1;
+        break;
+      }
+      t->paths = paths;
+      t->capacity = capacity;
+    }
+    int i = t->numPaths++;
+    t->paths[i].d = d;
+
+    struct inode in;
+    if (depth < FSINDEX_MAX_DEPTH && inode_isallocated(fs, d.d_inumber) &&
+        inode_iget(fs, d.d_inumber, &in) == 0 && (in.i_mode & IFMT) == IFDIR) {
+      err = fsindex_walk(fs, d.d_inumber, depth + 1, t);
+    }
+    t->paths[i].end = t->numPaths;
+  }
+  directory_iterator_close(&it);
+  return err;
+}
+
+/**
+ * Writes len bytes of data at offset, zero-filling from the current end of
+ * the file.  Returns 0 on success, -1 on error.
+ */
+static int fsindex_put(FILE *f, uint64_t offset, const void *data, size_t len) {
+  while ((uint64_t) ftell(f) < offset) {
+    if (fputc(0, f) == EOF) return -1;
+  }
+  return fwrite(data, 1, len, f) == len ? 0 : -1;
+}
+
+int fsindex_update(struct fsindex *idx) {
+  struct unixfilesystem *fs = idx->fs;
+  if (fs->superblock.s_fmod || blockcache_dirtysectors(fs->cache) > 0) {
+    fprintf(stderr, "Error: Can't index %s with writes pending\n", idx->path);
+    return -1;
+  }
+
+  // Nothing to do if the file is current and holds every checksum we have.
+  int numChksums = 0;
+  if (fs->chksums != NULL) {
+    pthread_mutex_lock(&fs->chksumLock);
+    for (int i = 0; i < fs->numChksums; i++) {
+      if (fs->chksums[i].size > 0) numChksums++;
+    }
+    pthread_mutex_unlock(&fs->chksumLock);
+  }
+  if (idx->valid && numChksums == idx->numReused) return 0;
+
+  struct fsindex_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, FSINDEX_MAGIC, sizeof(h.magic));
+  h.version = FSINDEX_VERSION;
+  if (fsindex_getkey(fs, &h.key) < 0) return -1;
+  strncpy(h.engine, fsindex_engine(fs), sizeof(h.engine) - 1);
+
+  size_t numInodes = h.key.numInodes;
+  struct chksumfile_memo *memo = calloc(numInodes + 1, sizeof(struct chksumfile_memo));
+  struct fsindex_tree t = { NULL, 0, 0 };
+  const struct fsindex_path *paths = idx->valid ? fsindex_paths(idx, &t.numPaths) : NULL;
+  int err = memo == NULL ? -1 : 0;
+
+  if (err == 0 && paths == NULL) {
+    err = fsindex_walk(fs, ROOT_INUMBER, 0, &t);
+    paths = t.paths;
+  }
+  if (err == 0 && fs->chksums != NULL) {
+    pthread_mutex_lock(&fs->chksumLock);
+    size_t n = (size_t) fs->numChksums < numInodes + 1 ? (size_t) fs->numChksums : numInodes + 1;
+    memcpy(memo, fs->chksums, n * sizeof(struct chksumfile_memo));
+    pthread_mutex_unlock(&fs->chksumLock);
+  }
+
+  h.numPaths = t.numPaths;
+  h.chksumsOffset = fsindex_align(sizeof(h));
+  h.pathsOffset = fsindex_align(h.chksumsOffset + (numInodes + 1) * sizeof(struct chksumfile_memo));
+  h.fileSize = h.pathsOffset + (size_t) t.numPaths * sizeof(struct fsindex_path);
+
+  // Write a new file and move it over the old one, so a reader never sees
+  // a half-written index.
+  size_t tmplen = strlen(idx->path) + 5;
+  char *tmp = malloc(tmplen);
+  FILE *f = NULL;
+  if (err == 0 && tmp != NULL) {
+    snprintf(tmp, tmplen, "%s.tmp", idx->path);
+    f = fopen(tmp, "wb");
+  }
+  if (f == NULL) {
+    err = -1;
+  } else {
+    if (fsindex_put(f, 0, &h, sizeof(h)) < 0 ||
+        fsindex_put(f, h.chksumsOffset, memo, (numInodes + 1) * sizeof(struct chksumfile_memo)) < 0 ||
+        fsindex_put(f, h.pathsOffset, paths, (size_t) t.numPaths * sizeof(struct fsindex_path)) < 0) {
+      err = -1;
+    }
+    if (fclose(f) != 0) err = -1;
+    if (err == 0 && rename(tmp, idx->path) < 0) err = -1;
+    if (err < 0) unlink(tmp);
+  }
+  if (err < 0) fprintf(stderr, "Error: Can't write index %s\n", idx->path);
+
+  free(tmp);
+  free(t.paths);
+  free(memo);
+  return err;
+}
+
+void fsindex_close(struct fsindex *idx) {
+  if (idx == NULL) return;
+  if (idx->map != NULL) munmap(idx->map, idx->mapSize);
+  free(idx->path);
+  free(idx);
+}
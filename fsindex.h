@@ -0,0 +1,65 @@
+#ifndef _FSINDEX_H_
+#define _FSINDEX_H_
+
+#include <stdint.h>
+
+#include "unixfilesystem.h"
+#include "direntv6.h"
+
+/**
+ * A sidecar index file that lets a later run over the same image skip the
+ * work of this one.  It holds the checksum of every inode hashed so far and
+ * the directory tree in path dump order, and is keyed by the image's size
+ * and mtime and a hash of its superblock.
+ *
+ * The file is read through mmap and is only valid on the machine that
+ * wrote it (it is in host byte order).  When its key still matches the
+ * image, every checksum in it is reused and the directory tree can be
+ * listed without reading a directory.  When it doesn't, nothing in it is
+ * used (file data can change without its inode changing) and
+ * fsindex_update() writes a fresh index.
+ */
+
+/**
+ * One entry of the directory tree: the directory entry, "." and ".."
+ * excluded, and the end of its subtree.  Entries are in depth-first order,
+ * each directory's entries in directory order, so the subtree of entry i
+ * is entries i+1 up to end-1.
+ */
+struct fsindex_path {
+  struct direntv6 d;
+  uint32_t end;
+};
+
+struct fsindex;
+
+/**
+ * Opens the index at path for fs and primes the checksum memo of fs with
+ * every checksum it can reuse.  A missing or damaged index file is treated
+ * as empty.  Must be called after the checksum engine of fs is selected.
+ * Returns NULL only if out of memory.
+ */
+struct fsindex *fsindex_open(struct unixfilesystem *fs, const char *path);
+
+/**
+ * Returns 1 if the index matched the image when it was opened.
+ */
+int fsindex_valid(const struct fsindex *idx);
+
+/**
+ * Returns the directory tree below the root, or NULL if the index is not
+ * valid.  *numPaths is set to its number of entries.
+ */
+const struct fsindex_path *fsindex_paths(const struct fsindex *idx, int *numPaths);
+
+/**
+ * Writes the index again if it was stale or the filesystem has memoised
+ * checksums it doesn't hold.  The file is replaced atomically.  Fails if
+ * the filesystem has writes that aren't on the image yet.  Returns 0 on
+ * success, -1 on error.
+ */
+int fsindex_update(struct fsindex *idx);
+
+void fsindex_close(struct fsindex *idx);
+
+#endif // _FSINDEX_H_
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "fsstats.h"
+#include "unixfilesystem.h"
+#include "blockcache.h"
+#include "dcache.h"
+
+static const char *const counterNames[FSSTATS_NUM_COUNTERS] = {
+  "sectors_read",
+  "bytes_read",
+  "inode_fetches",
+  "indirect_reads",
+  "blockmap_builds",
+  "dirents_scanned",
+  "dirindex_builds",
+  "dir_lookups",
+  "path_lookups",
+  "files_hashed",
+  "chksum_memo_hits",
+};
+
+static const char *const layerNames[FSSTATS_NUM_LAYERS] = {
+  "diskimg",
+  "inode",
+  "file",
+  "directory",
+  "pathname",
+  "chksumfile",
+};
+
+struct fsstats *fsstats_create(void) {
+#ifdef FSSTATS
+  return calloc(1, sizeof(struct fsstats));
+#else
+  return NULL;
+#endif
+}
+
+void fsstats_settiming(struct fsstats *stats, int timing) {
+  if (stats != NULL) stats->timing = timing;
+}
+
+static uint64_t fsstats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+uint64_t fsstats_begin(struct fsstats *stats) {
+  if (stats == NULL || !stats->timing) return 0;
+  return fsstats_now();
+}
+
+void fsstats_end(struct fsstats *stats, enum fsstats_layer layer, uint64_t start) {
+  if (start == 0) return;
+  uint64_t ns = fsstats_now() - start;
+  int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+  if (bucket >= FSSTATS_BUCKETS) bucket = FSSTATS_BUCKETS - 1;
+  __atomic_fetch_add(&stats->calls[layer], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->totalNs[layer], ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->histogram[layer][bucket], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns the upper bound in ns of the bucket holding the given fraction of
+ * a layer's calls.
+ */
+static uint64_t fsstats_percentile(const struct fsstats *stats, int layer, double fraction) {
+  uint64_t want = (uint64_t) (stats->calls[layer] * fraction);
+  uint64_t seen = 0;
+  for (int b = 0; b < FSSTATS_BUCKETS; b++) {
+    seen += stats->histogram[layer][b];
+    if (seen > want) return 2ull << b;
+  }
+  return 2ull << (FSSTATS_BUCKETS - 1);
+}
+
+static void fsstats_print_text(const struct fsstats *stats, const struct blockcache_stats *bs,
+                               const struct dcache_stats *ds, FILE *f) {
+  fprintf(f, "Sector cache: hits %llu misses %llu evictions %llu mapped %llu streamed %llu capacity %d\n",
+          (unsigned long long) bs->hits, (unsigned long long) bs->misses,
+          (unsigned long long) bs->evictions, (unsigned long long) bs->mapped,
+          (unsigned long long) bs->streamed, bs->capacity);
+  fprintf(f, "Sector writes: written %llu writebacks %llu flushes %llu\n",
+          (unsigned long long) bs->written, (unsigned long long) bs->writebacks,
+          (unsigned long long) bs->flushes);
+  fprintf(f, "Name cache: hits %llu negative_hits %llu misses %llu\n",
+          (unsigned long long) ds->hits, (unsigned long long) ds->negativeHits,
+          (unsigned long long) ds->misses);
+  if (stats == NULL) {
+    fprintf(f, "Layer counters not compiled in (build with make STATS=1)\n");
+    return;
+  }
+
+  fprintf(f, "Counters:\n");
+  for (int i = 0; i < FSSTATS_NUM_COUNTERS; i++) {
+    fprintf(f, "  %-18s %llu\n", counterNames[i], (unsigned long long) stats->counters[i]);
+  }
+  if (!stats->timing) return;
+
+  fprintf(f, "Latency:     %12s %12s %12s %12s\n", "calls", "mean ns", "p50 ns <", "p99 ns <");
+  for (int l = 0; l < FSSTATS_NUM_LAYERS; l++) {
+    if (stats->calls[l] == 0) continue;
+    fprintf(f, "  %-10s %12llu %12.0f %12llu %12llu\n", layerNames[l],
+            (unsigned long long) stats->calls[l], (double) stats->totalNs[l] / stats->calls[l],
+            (unsigned long long) fsstats_percentile(stats, l, 0.5),
+            (unsigned long long) fsstats_percentile(stats, l, 0.99));
+    for (int b = 0; b < FSSTATS_BUCKETS; b++) {
+      uint64_t n = stats->histogram[l][b];
+      if (n == 0) continue;
+      int bar = (int) (40.0 * n / stats->calls[l] + 0.5);
+      fprintf(f, "    %12llu ns %10llu %.*s\n", 1ull << b, (unsigned long long) n,
+              bar, "########################################");
+    }
+  }
+}
+
+static void fsstats_print_json(const struct fsstats *stats, const struct blockcache_stats *bs,
+                               const struct dcache_stats *ds, FILE *f) {
+  fprintf(f, "{\"blockcache\": {\"hits\": %llu, \"misses\": %llu, \"evictions\": %llu, "
+          "\"mapped\": %llu, \"streamed\": %llu, \"written\": %llu, \"writebacks\": %llu, "
+          "\"flushes\": %llu, \"capacity\": %d}",
+          (unsigned long long) bs->hits, (unsigned long long) bs->misses,
+          (unsigned long long) bs->evictions, (unsigned long long) bs->mapped,
+          (unsigned long long) bs->streamed, (unsigned long long) bs->written,
+          (unsigned long long) bs->writebacks, (unsigned long long) bs->flushes, bs->capacity);
+  fprintf(f, ", \"dcache\": {\"hits\": %llu, \"negative_hits\": %llu, \"misses\": %llu}",
+          (unsigned long long) ds->hits, (unsigned long long) ds->negativeHits,
+          (unsigned long long) ds->misses);
+
+  if (stats != NULL) {
+    fprintf(f, ", \"counters\": {");
+    for (int i = 0; i < FSSTATS_NUM_COUNTERS; i++) {
+      fprintf(f, "%s\"%s\": %llu", i ? ", " : "", counterNames[i], (unsigned long long) stats->counters[i]);
+    }
+    fprintf(f, "}");
+  }
+
+  if (stats != NULL && stats->timing) {
+    fprintf(f, ", \"latency\": {");
+    const char *sep = "";
+    for (int l = 0; l < FSSTATS_NUM_LAYERS; l++) {
+      if (stats->calls[l] == 0) continue;
+      fprintf(f, "%s\"%s\": {\"calls\": %llu, \"total_ns\": %llu, \"histogram\": [", sep, layerNames[l],
+              (unsigned long long) stats->calls[l], (unsigned long long) stats->totalNs[l]);
+      const char *bsep = "";
+      for (int b = 0; b < FSSTATS_BUCKETS; b++) {
+        if (stats->histogram[l][b] == 0) continue;
+        fprintf(f, "%s[%llu, %llu]", bsep, 1ull << b, (unsigned long long) stats->histogram[l][b]);
+        bsep = ", ";
+      }
+      fprintf(f, "]}");
+      sep = ", ";
+    }
+    fprintf(f, "}");
+  }
+  fprintf(f, "}\n");
+}
+
+void fsstats_print(struct unixfilesystem *fs, FILE *f, int json) {
+  struct blockcache_stats bs;
+  struct dcache_stats ds;
+  blockcache_getstats(fs->cache, &bs);
+  dcache_getstats(fs->dcache, &ds);
+
+  // Take a snapshot so the numbers printed are consistent with each other
+  // as far as relaxed loads allow.
+  struct fsstats snapshot;
+  struct fsstats *stats = NULL;
+  if (fs->stats != NULL) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    snapshot = *fs->stats;
+    stats = &snapshot;
+  }
+
+  if (json) {
+    fsstats_print_json(stats, &bs, &ds, f);
+  } else {
+    fsstats_print_text(stats, &bs, &ds, f);
+  }
+}
+
+void fsstats_free(struct fsstats *stats) {
+  free(stats);
+}
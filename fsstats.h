@@ -0,0 +1,100 @@
+#ifndef _FSSTATS_H_
+#define _FSSTATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/**
+ * Per-filesystem instrumentation: event counters for each layer and, when
+ * timing is switched on, log2 histograms of how long each layer's calls
+ * take.  Latencies are inclusive (a pathname lookup includes the directory
+ * searches it makes) and measured with clock_gettime(CLOCK_MONOTONIC).
+ *
+ * Everything here is compiled in only when FSSTATS is defined (make
+ * STATS=1).  Otherwise the FSSTATS_* macros expand to nothing, fs->stats is
+ * always NULL and fsstats_print() reports just the cache counters, which
+ * the caches keep anyway.
+ *
+ * Counters and histograms are updated with relaxed atomics, so they may be
+ * bumped from several threads at once.
+ */
+
+struct unixfilesystem;
+
+enum fsstats_counter {
+  FSSTATS_SECTORS_READ,      // Sectors read from the disk image.
+  FSSTATS_BYTES_READ,        // File bytes returned by file_read/file_getblock.
+  FSSTATS_INODE_FETCHES,     // inode_iget calls.
+  FSSTATS_INDIRECT_READS,    // Indirect blocks read to map file blocks.
+  FSSTATS_BLOCKMAP_BUILDS,   // Block maps built (block map cache misses).
+  FSSTATS_DIRENTS_SCANNED,   // Directory entries examined.
+  FSSTATS_DIRINDEX_BUILDS,   // Directory hash indexes built.
+  FSSTATS_DIR_LOOKUPS,       // directory_findname calls.
+  FSSTATS_PATH_LOOKUPS,      // pathname_lookup calls.
+  FSSTATS_FILES_HASHED,      // Files whose contents were hashed.
+  FSSTATS_CHKSUM_MEMO_HITS,  // Checksums served from the memo.
+  FSSTATS_NUM_COUNTERS
+};
+
+enum fsstats_layer {
+  FSSTATS_LAYER_DISKIMG,     // One diskimg read (single sector or bulk).
+  FSSTATS_LAYER_INODE,       // inode_iget.
+  FSSTATS_LAYER_FILE,        // file_read / file_getblockref.
+  FSSTATS_LAYER_DIRECTORY,   // directory_findname.
+  FSSTATS_LAYER_PATHNAME,    // pathname_lookup.
+  FSSTATS_LAYER_CHKSUMFILE,  // chksumfile_byinumber.
+  FSSTATS_NUM_LAYERS
+};
+
+// Bucket i counts calls that took [2^i, 2^(i+1)) ns; bucket 0 also holds 0.
+#define FSSTATS_BUCKETS 40
+
+struct fsstats {
+  int timing;                                   // Record latencies.
+  uint64_t counters[FSSTATS_NUM_COUNTERS];
+  uint64_t calls[FSSTATS_NUM_LAYERS];           // Timed calls per layer.
+  uint64_t totalNs[FSSTATS_NUM_LAYERS];
+  uint64_t histogram[FSSTATS_NUM_LAYERS][FSSTATS_BUCKETS];
+};
+
+#ifdef FSSTATS
+
+#define FSSTATS_COUNT(stats, counter, n) \
+  do { if ((stats) != NULL) __atomic_fetch_add(&(stats)->counters[counter], (n), __ATOMIC_RELAXED); } while (0)
+
+// Declares the start time of a timed section; 0 when not timing.
+#define FSSTATS_TIME_BEGIN(stats, var) uint64_t var = fsstats_begin(stats)
+#define FSSTATS_TIME_END(stats, layer, var) fsstats_end((stats), (layer), var)
+
+#else
+
+#define FSSTATS_COUNT(stats, counter, n) ((void) 0)
+#define FSSTATS_TIME_BEGIN(stats, var) ((void) 0)
+#define FSSTATS_TIME_END(stats, layer, var) ((void) 0)
+
+#endif // FSSTATS
+
+/**
+ * Allocates a zeroed set of statistics, or returns NULL if they are not
+ * compiled in (or on error).
+ */
+struct fsstats *fsstats_create(void);
+
+/**
+ * Starts or stops recording latencies.
+ */
+void fsstats_settiming(struct fsstats *stats, int timing);
+
+uint64_t fsstats_begin(struct fsstats *stats);
+
+void fsstats_end(struct fsstats *stats, enum fsstats_layer layer, uint64_t start);
+
+/**
+ * Writes the statistics of fs, including its sector and name cache
+ * counters, to f as text, or as a single JSON object if json is set.
+ */
+void fsstats_print(struct unixfilesystem *fs, FILE *f, int json);
+
+void fsstats_free(struct fsstats *stats);
+
+#endif // _FSSTATS_H_
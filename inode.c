@@ -2,8 +2,13 @@
 #include <assert.h>
 #include <stdlib.h> // For malloc, free
 #include <string.h> // For memcpy
+#include <pthread.h>
 #include "inode.h"
 #include "diskimg.h"
+#include "blockcache.h"
+#include "fsstats.h"
+#include "alloc.h"
+#include "fserror.h"
 #include "unixfilesystem.h" // Provides INODE_START_SECTOR, struct filsys, etc.
 #include "ino.h"            // Provides struct inode, IALLOC, ILARG, etc.
 
@@ -14,20 +19,29 @@
 
 /**
  * Fetches the specified inode from the filesystem.
- * Returns 0 on success, -1 on error.
+ * Returns 0 on success or a negative FSERR_* code.
  */
-int inode_iget(struct unixfilesystem *fs, int inumber, struct inode *inp) {
+static int inode_fetch(struct unixfilesystem *fs, int inumber, struct inode *inp) {
     if (inumber < ROOT_INUMBER) { // inumber is 1-indexed, ROOT_INUMBER is 1 [cite: 82, 95]
-        fprintf(stderr, "Error: Invalid inumber %d (must be >= %d)\n", inumber, ROOT_INUMBER);
-        return -1;
+        return fserror_record(fs, FSERR_INVAL, "Invalid inumber %d (must be >= %d)", NULL, inumber, ROOT_INUMBER, 0);
     }
 
     // Calculate total number of inodes possible with s_isize blocks
     // s_isize is the size in blocks of the I-list [cite: 62]
     int max_inumber = fs->superblock.s_isize * INODES_PER_BLOCK;
     if (inumber > max_inumber) {
-        fprintf(stderr, "Error: Invalid inumber %d (max is %d)\n", inumber, max_inumber);
-        return -1;
+        return fserror_record(fs, FSERR_INVAL, "Invalid inumber %d (max is %d)", NULL, inumber, max_inumber, 0);
+    }
+
+    // With the inode table loaded at init time this is just an array index
+    if (fs->inodes != NULL) {
+        if (!inode_isallocated(fs, inumber)) {
+            return FSERR_NOTALLOC;
+        }
+        pthread_rwlock_rdlock(&fs->inodesLock);
+        *inp = fs->inodes[inumber - 1];
+        pthread_rwlock_unlock(&fs->inodesLock);
+        return 0;
     }
 
     // Calculate the block number on disk that contains this inode
@@ -39,17 +53,17 @@ int inode_iget(struct unixfilesystem *fs, int inumber, struct inode *inp) {
     // Calculate the offset of the inode within that block
     int offset_in_block_bytes = ((inumber - 1) % INODES_PER_BLOCK) * sizeof(struct inode);
 
-    // Buffer to read the disk block
+    // Buffer to read the disk block into when the image isn't mapped
     unsigned char block_buffer[DISKIMG_SECTOR_SIZE];
 
-    // Read the block from disk
-    if (diskimg_readsector(fs->dfd, disk_block_num, block_buffer) != DISKIMG_SECTOR_SIZE) {
-        fprintf(stderr, "Error: Failed to read inode block %d for inumber %d\n", disk_block_num, inumber);
-        return -1;
+    // Read the block from disk (in place when the image is mapped)
+    const unsigned char *block = blockcache_getsector(fs->cache, disk_block_num, block_buffer);
+    if (block == NULL) {
+        return fserror_record(fs, FSERR_IO, "Failed to read inode block %d for inumber %d", NULL, disk_block_num, inumber, 0);
     }
 
-    // Copy the inode data from the buffer to the output struct
-    memcpy(inp, block_buffer + offset_in_block_bytes, sizeof(struct inode));
+    // Copy just the inode data from the block to the output struct
+    memcpy(inp, block + offset_in_block_bytes, sizeof(struct inode));
 
     // Check if the inode is allocated [cite: 87, 88]
     if ((inp->i_mode & IALLOC) == 0) {
@@ -57,28 +71,66 @@ int inode_iget(struct unixfilesystem *fs, int inumber, struct inode *inp) {
         // but for typical "get me this file's inode", it implies it doesn't exist or is free.
         // Depending on expected behavior, this could return an error or a specific status.
         // For now, let's consider an unallocated inode as an error for iget.
-        fprintf(stderr, "Error: Inode %d is not allocated (i_mode: %04x)\n", inumber, inp->i_mode);
-        return -1;
+        return FSERR_NOTALLOC;
     }
 
     return 0; // Success
 }
 
+int inode_iget(struct unixfilesystem *fs, int inumber, struct inode *inp) {
+    FSSTATS_COUNT(fs->stats, FSSTATS_INODE_FETCHES, 1);
+    FSSTATS_TIME_BEGIN(fs->stats, start);
+    int err = inode_fetch(fs, inumber, inp);
+    FSSTATS_TIME_END(fs->stats, FSSTATS_LAYER_INODE, start);
+    return err;
+}
+
+/**
+ * Returns 1 if the specified inode is allocated, 0 if it is free or can't be
+ * read.
+ */
+int inode_isallocated(struct unixfilesystem *fs, int inumber) {
+    if (inumber < ROOT_INUMBER) {
+        return 0;
+    }
+
+    if (fs->inodeAlloc != NULL) {
+        int i = inumber - 1;
+        // Writers update the bitmap atomically; see inode_iwrite().
+        return i < fs->numInodes &&
+               (__atomic_load_n(&fs->inodeAlloc[i / 8], __ATOMIC_RELAXED) >> (i % 8)) & 1;
+    }
+
+    int max_inumber = fs->superblock.s_isize * INODES_PER_BLOCK;
+    if (inumber > max_inumber) {
+        return 0;
+    }
+
+    unsigned char block_buffer[DISKIMG_SECTOR_SIZE];
+    int disk_block_num = INODE_START_SECTOR + (inumber - 1) / INODES_PER_BLOCK;
+    const struct inode *inodes = blockcache_getsector(fs->cache, disk_block_num, block_buffer);
+    if (inodes == NULL) {
+        return 0;
+    }
+    return (inodes[(inumber - 1) % INODES_PER_BLOCK].i_mode & IALLOC) != 0;
+}
+
 /**
  * Given an index of a file block (logical block number within the file),
  * retrieves the file's actual disk block number from the given inode.
  *
- * Returns the disk block number on success, -1 on error.
+ * Returns the disk block number on success or a negative FSERR_* code:
+ * FSERR_RANGE past the end of the file and FSERR_HOLE for a block that
+ * isn't allocated, neither of them recorded.
  */
 int inode_indexlookup(struct unixfilesystem *fs, struct inode *inp, int fileBlockNum) {
     if (fileBlockNum < 0) {
-        fprintf(stderr, "Error: fileBlockNum %d cannot be negative.\n", fileBlockNum);
-        return -1;
+        return fserror_record(fs, FSERR_INVAL, "fileBlockNum %d cannot be negative", NULL, fileBlockNum, 0, 0);
     }
 
     int file_size_bytes = inode_getsize(inp);
     if (file_size_bytes == 0 && fileBlockNum == 0) { // Empty file special case
-        return -1; // No blocks for an empty file
+        return FSERR_RANGE; // No blocks for an empty file
     }
     // Allowing fileBlockNum == 0 for a zero-byte file could be valid if we were about to write to it,
     // but for lookup, it means no such block exists.
@@ -88,8 +140,7 @@ int inode_indexlookup(struct unixfilesystem *fs, struct inode *inp, int fileBloc
     int max_logical_block = (file_size_bytes + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
     if (file_size_bytes > 0 && fileBlockNum >= max_logical_block) {
          // Requesting a block beyond the file's content
-        // fprintf(stderr, "Error: fileBlockNum %d is out of bounds for file size %d bytes (max logical block %d).\n", fileBlockNum, file_size_bytes, max_logical_block -1);
-        return -1; // Standard Unix behavior: Holes are zeroes, past EOF is error.
+        return FSERR_RANGE; // Standard Unix behavior: Holes are zeroes, past EOF is error.
     }
     // If file_size_bytes is 0, max_logical_block will be 0.
     // If fileBlockNum is also 0, this condition is fileBlockNum >= 0, which isn't right for an empty file.
@@ -101,15 +152,15 @@ int inode_indexlookup(struct unixfilesystem *fs, struct inode *inp, int fileBloc
     if ((inp->i_mode & ILARG) == 0) { // Small file [cite: 81, 90]
         // Direct blocks only. i_addr contains up to 8 direct block numbers.
         if (fileBlockNum >= (sizeof(inp->i_addr) / sizeof(inp->i_addr[0]))) {
-            fprintf(stderr, "Error (Small File): fileBlockNum %d is out of direct block range.\n", fileBlockNum);
-            return -1;
+            return fserror_record(fs, FSERR_CORRUPT, "Small file of %d bytes has no block %d", NULL,
+                                  file_size_bytes, fileBlockNum, 0);
         }
         data_block_num = inp->i_addr[fileBlockNum];
         if (data_block_num == 0) {
             // This block is not allocated (hole in file or past EOF for allocated size but not written)
             // The problem asks for "disk block number on success, -1 on error".
             // A non-existent block within the file's theoretical span could be an error.
-            return -1;
+            return FSERR_HOLE;
         }
         return data_block_num;
 
@@ -124,29 +175,31 @@ int inode_indexlookup(struct unixfilesystem *fs, struct inode *inp, int fileBloc
 
             uint16_t single_indirect_ptr = inp->i_addr[indirect_block_index_in_i_addr];
             if (single_indirect_ptr == 0) { // Single indirect block itself is not allocated
-                return -1;
+                return FSERR_HOLE;
             }
 
-            if (diskimg_readsector(fs->dfd, single_indirect_ptr, block_buffer) != DISKIMG_SECTOR_SIZE) {
-                fprintf(stderr, "Error: Failed to read single indirect block %d\n", single_indirect_ptr);
-                return -1;
+            FSSTATS_COUNT(fs->stats, FSSTATS_INDIRECT_READS, 1);
+            const uint16_t *indirect = blockcache_getsector(fs->cache, single_indirect_ptr, block_buffer);
+            if (indirect == NULL) {
+                return fserror_record(fs, FSERR_IO, "Failed to read single indirect block %d", NULL, single_indirect_ptr, 0, 0);
             }
             
-            data_block_num = ((uint16_t *)block_buffer)[offset_in_indirect_block];
+            data_block_num = indirect[offset_in_indirect_block];
             if (data_block_num == 0) { // Data block pointed to by indirect block is not allocated
-                 return -1;
+                 return FSERR_HOLE;
             }
             return data_block_num;
 
         } else { // Falls into the double indirect block (i_addr[7])
             uint16_t double_indirect_ptr = inp->i_addr[7];
             if (double_indirect_ptr == 0) { // Double indirect block itself is not allocated
-                return -1;
+                return FSERR_HOLE;
             }
 
-            if (diskimg_readsector(fs->dfd, double_indirect_ptr, block_buffer) != DISKIMG_SECTOR_SIZE) {
-                fprintf(stderr, "Error: Failed to read double indirect block %d\n", double_indirect_ptr);
-                return -1;
+            FSSTATS_COUNT(fs->stats, FSSTATS_INDIRECT_READS, 1);
+            const uint16_t *double_indirect = blockcache_getsector(fs->cache, double_indirect_ptr, block_buffer);
+            if (double_indirect == NULL) {
+                return fserror_record(fs, FSERR_IO, "Failed to read double indirect block %d", NULL, double_indirect_ptr, 0, 0);
             }
 
             // Adjust fileBlockNum relative to the start of the double indirect region
@@ -154,34 +207,35 @@ int inode_indexlookup(struct unixfilesystem *fs, struct inode *inp, int fileBloc
             
             int first_level_index = block_num_in_double_region / ADDRESSES_PER_BLOCK;
             if (first_level_index >= ADDRESSES_PER_BLOCK) { // Index out of bounds for the first level of indirection
-                 fprintf(stderr, "Error (Large File - DI): first_level_index %d is out of bounds.\n", first_level_index);
-                return -1;
+                return FSERR_RANGE;
             }
 
-            uint16_t target_single_indirect_ptr = ((uint16_t *)block_buffer)[first_level_index];
+            uint16_t target_single_indirect_ptr = double_indirect[first_level_index];
             if (target_single_indirect_ptr == 0) { // Target single indirect block is not allocated
-                return -1;
+                return FSERR_HOLE;
             }
 
             // Now read the target single indirect block
             // Can reuse block_buffer
-            if (diskimg_readsector(fs->dfd, target_single_indirect_ptr, block_buffer) != DISKIMG_SECTOR_SIZE) {
-                fprintf(stderr, "Error: Failed to read target single indirect block %d from double indirect path\n", target_single_indirect_ptr);
-                return -1;
+            FSSTATS_COUNT(fs->stats, FSSTATS_INDIRECT_READS, 1);
+            const uint16_t *indirect = blockcache_getsector(fs->cache, target_single_indirect_ptr, block_buffer);
+            if (indirect == NULL) {
+                return fserror_record(fs, FSERR_IO, "Failed to read single indirect block %d from double indirect path", NULL,
+                                      target_single_indirect_ptr, 0, 0);
             }
 
             int second_level_index = block_num_in_double_region % ADDRESSES_PER_BLOCK;
             // No need to check second_level_index bounds as it's derived from % ADDRESSES_PER_BLOCK
 
-            data_block_num = ((uint16_t *)block_buffer)[second_level_index];
+            data_block_num = indirect[second_level_index];
             if (data_block_num == 0) { // Final data block is not allocated
-                return -1;
+                return FSERR_HOLE;
             }
             return data_block_num;
         }
     }
     // Should not be reached if logic is correct
-    return -1; 
+    return FSERR_FAILURE; 
 }
 
 /**
@@ -191,3 +245,474 @@ int inode_getsize(struct inode *inp) {
   // This function is already provided in the skeleton
   return ((inp->i_size0 << 16) | inp->i_size1); 
 }
+
+void inode_setsize(struct inode *inp, int size) {
+    inp->i_size0 = (size >> 16) & 0xff;
+    inp->i_size1 = size & 0xffff;
+}
+
+/**
+ * Writes the inode to the in-memory table (flushed with the batch) or,
+ * without a table, straight into its inode-table sector.
+ */
+int inode_iwrite(struct unixfilesystem *fs, int inumber, const struct inode *inp) {
+    int max_inumber = fs->superblock.s_isize * INODES_PER_BLOCK;
+    if (inumber < ROOT_INUMBER || inumber > max_inumber) {
+        return fserror_record(fs, FSERR_INVAL, "Invalid inumber %d (max is %d)", NULL, inumber, max_inumber, 0);
+    }
+
+    int sector_index = (inumber - 1) / INODES_PER_BLOCK;
+    int err = 0;
+    unixfilesystem_beginbatch(fs);
+    if (fs->inodes != NULL) {
+        int i = inumber - 1;
+        pthread_rwlock_wrlock(&fs->inodesLock);
+        fs->inodes[i] = *inp;
+        pthread_rwlock_unlock(&fs->inodesLock);
+        // Readers test the other bits of this byte without the write lock.
+        if (inp->i_mode & IALLOC) {
+            __atomic_fetch_or(&fs->inodeAlloc[i / 8], 1 << (i % 8), __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_and(&fs->inodeAlloc[i / 8], ~(1 << (i % 8)), __ATOMIC_RELAXED);
+        }
+        fs->inodeDirty[sector_index / 8] |= 1 << (sector_index % 8);
+    } else {
+        unsigned char block_buffer[DISKIMG_SECTOR_SIZE];
+        int disk_block_num = INODE_START_SECTOR + sector_index;
+        if (blockcache_readsector(fs->cache, disk_block_num, block_buffer) != DISKIMG_SECTOR_SIZE) {
+            err = FSERR_IO;
+        } else {
+            memcpy(block_buffer + ((inumber - 1) % INODES_PER_BLOCK) * sizeof(struct inode), inp, sizeof(struct inode));
+            if (blockcache_writesector(fs->cache, disk_block_num, block_buffer) != DISKIMG_SECTOR_SIZE) {
+                err = FSERR_IO;
+            }
+        }
+        if (err < 0) {
+            fserror_record(fs, err, "Failed to write inode block %d for inumber %d", NULL, disk_block_num, inumber, 0);
+        }
+    }
+    inode_invalidateblockmaps(fs, inumber);
+    if (unixfilesystem_endbatch(fs) < 0 && err == 0) {
+        err = FSERR_IO;
+    }
+    return err;
+}
+
+/**
+ * Returns *addr, first pointing it at a newly allocated block if it is 0.
+ * Blocks that will hold addresses are zeroed on disk.
+ */
+static int inode_ensureblock(struct unixfilesystem *fs, uint16_t *addr, int zero, int *fresh) {
+    if (*addr != 0) {
+        return *addr;
+    }
+    int block = alloc_block(fs);
+    if (block < 0) {
+        return block;
+    }
+    if (zero) {
+        static const unsigned char zeroes[DISKIMG_SECTOR_SIZE];
+        if (blockcache_writesector(fs->cache, block, zeroes) != DISKIMG_SECTOR_SIZE) {
+            alloc_freeblock(fs, block);
+            return fserror_record(fs, FSERR_IO, "Failed to zero indirect block %d", NULL, block, 0, 0);
+        }
+    }
+    *addr = block;
+    if (fresh != NULL) {
+        *fresh = 1;
+    }
+    return block;
+}
+
+/**
+ * Like inode_ensureblock() for entry index of indirect block indirect_ptr,
+ * writing the indirect block back when the entry changes.
+ */
+static int inode_ensureentry(struct unixfilesystem *fs, int indirect_ptr, int index, int zero, int *fresh) {
+    uint16_t indirect[ADDRESSES_PER_BLOCK];
+    FSSTATS_COUNT(fs->stats, FSSTATS_INDIRECT_READS, 1);
+    if (blockcache_readsector(fs->cache, indirect_ptr, indirect) != DISKIMG_SECTOR_SIZE) {
+        return fserror_record(fs, FSERR_IO, "Failed to read indirect block %d", NULL, indirect_ptr, 0, 0);
+    }
+    if (indirect[index] != 0) {
+        return indirect[index];
+    }
+    int block = inode_ensureblock(fs, &indirect[index], zero, fresh);
+    if (block < 0) {
+        return block;
+    }
+    if (blockcache_writesector(fs->cache, indirect_ptr, indirect) != DISKIMG_SECTOR_SIZE) {
+        return fserror_record(fs, FSERR_IO, "Failed to write indirect block %d", NULL, indirect_ptr, 0, 0);
+    }
+    return block;
+}
+
+int inode_allocblock(struct unixfilesystem *fs, struct inode *inp, int fileBlockNum, int *fresh) {
+    int num_addrs = sizeof(inp->i_addr) / sizeof(inp->i_addr[0]);
+    int single_indirect_coverage = (num_addrs - 1) * ADDRESSES_PER_BLOCK;
+    *fresh = 0;
+    if (fileBlockNum < 0 || fileBlockNum >= single_indirect_coverage + (int) (ADDRESSES_PER_BLOCK * ADDRESSES_PER_BLOCK)) {
+        return fserror_record(fs, FSERR_RANGE, "fileBlockNum %d is beyond the largest file", NULL, fileBlockNum, 0, 0);
+    }
+
+    if ((inp->i_mode & ILARG) == 0) {
+        if (fileBlockNum < num_addrs) {
+            return inode_ensureblock(fs, &inp->i_addr[fileBlockNum], 0, fresh);
+        }
+        // Too big for direct blocks: the direct addresses move into a new
+        // indirect block, which becomes i_addr[0].
+        uint16_t indirect[ADDRESSES_PER_BLOCK];
+        memset(indirect, 0, sizeof(indirect));
+        memcpy(indirect, inp->i_addr, sizeof(inp->i_addr));
+        int indirect_ptr = alloc_block(fs);
+        if (indirect_ptr < 0) {
+            return indirect_ptr;
+        }
+        if (blockcache_writesector(fs->cache, indirect_ptr, indirect) != DISKIMG_SECTOR_SIZE) {
+            alloc_freeblock(fs, indirect_ptr);
+            return fserror_record(fs, FSERR_IO, "Failed to write indirect block %d", NULL, indirect_ptr, 0, 0);
+        }
+        memset(inp->i_addr, 0, sizeof(inp->i_addr));
+        inp->i_addr[0] = indirect_ptr;
+        inp->i_mode |= ILARG;
+    }
+
+    if (fileBlockNum < single_indirect_coverage) {
+        int indirect_ptr = inode_ensureblock(fs, &inp->i_addr[fileBlockNum / ADDRESSES_PER_BLOCK], 1, NULL);
+        if (indirect_ptr < 0) {
+            return indirect_ptr;
+        }
+        return inode_ensureentry(fs, indirect_ptr, fileBlockNum % ADDRESSES_PER_BLOCK, 0, fresh);
+    }
+
+    int block_num_in_double_region = fileBlockNum - single_indirect_coverage;
+    int double_indirect_ptr = inode_ensureblock(fs, &inp->i_addr[num_addrs - 1], 1, NULL);
+    if (double_indirect_ptr < 0) {
+        return double_indirect_ptr;
+    }
+    int indirect_ptr = inode_ensureentry(fs, double_indirect_ptr,
+                                         block_num_in_double_region / ADDRESSES_PER_BLOCK, 1, NULL);
+    if (indirect_ptr < 0) {
+        return indirect_ptr;
+    }
+    return inode_ensureentry(fs, indirect_ptr, block_num_in_double_region % ADDRESSES_PER_BLOCK, 0, fresh);
+}
+
+/**
+ * Frees the blocks listed in an indirect block; with levels 2 they are
+ * themselves indirect blocks whose blocks are freed first.
+ */
+static int inode_freeindirect(struct unixfilesystem *fs, int indirect_ptr, int levels) {
+    uint16_t indirect[ADDRESSES_PER_BLOCK];
+    if (blockcache_readsector(fs->cache, indirect_ptr, indirect) != DISKIMG_SECTOR_SIZE) {
+        return fserror_record(fs, FSERR_IO, "Failed to read indirect block %d", NULL, indirect_ptr, 0, 0);
+    }
+    int err = 0;
+    for (int i = ADDRESSES_PER_BLOCK - 1; i >= 0; i--) {
+        if (indirect[i] == 0) {
+            continue;
+        }
+        if (levels > 1 && inode_freeindirect(fs, indirect[i], levels - 1) < 0) {
+            err = -1;
+        }
+        if (alloc_freeblock(fs, indirect[i]) < 0) {
+            err = -1;
+        }
+    }
+    return err;
+}
+
+int inode_truncate(struct unixfilesystem *fs, struct inode *inp) {
+    int num_addrs = sizeof(inp->i_addr) / sizeof(inp->i_addr[0]);
+    int err = 0;
+    unixfilesystem_beginbatch(fs);
+    for (int i = num_addrs - 1; i >= 0; i--) {
+        if (inp->i_addr[i] == 0) {
+            continue;
+        }
+        if ((inp->i_mode & ILARG) &&
+            inode_freeindirect(fs, inp->i_addr[i], i == num_addrs - 1 ? 2 : 1) < 0) {
+            err = -1;
+        }
+        if (alloc_freeblock(fs, inp->i_addr[i]) < 0) {
+            err = -1;
+        }
+        inp->i_addr[i] = 0;
+    }
+    inp->i_mode &= ~ILARG;
+    inode_setsize(inp, 0);
+    if (unixfilesystem_endbatch(fs) < 0) {
+        err = -1;
+    }
+    return err;
+}
+
+/**
+ * Appends the mapping fileBlock -> diskBlock to the map, extending the last
+ * extent when the block continues it.  Returns 0 on success, -1 if out of
+ * memory.
+ */
+static int blockmap_append(struct inode_blockmap *map, int *capacity, int fileBlock, int diskBlock) {
+    if (map->numExtents > 0) {
+        struct inode_extent *last = &map->extents[map->numExtents - 1];
+        int continues = (last->diskBlock == 0 && diskBlock == 0) ||
+                        (last->diskBlock != 0 && last->diskBlock + last->numBlocks == diskBlock);
+        if (continues && last->fileBlock + last->numBlocks == fileBlock) {
+            last->numBlocks++;
+            return 0;
+        }
+    }
+
+    if (map->numExtents == *capacity) {
+        int new_capacity = *capacity ? 2 * *capacity : 8;
+        struct inode_extent *extents = realloc(map->extents, new_capacity * sizeof(struct inode_extent));
+        if (extents == NULL) {
+            return -1;
+        }
+        map->extents = extents;
+        *capacity = new_capacity;
+    }
+
+    struct inode_extent *e = &map->extents[map->numExtents++];
+    e->fileBlock = fileBlock;
+    e->diskBlock = diskBlock;
+    e->numBlocks = 1;
+    return 0;
+}
+
+/**
+ * Appends numBlocks unallocated blocks starting at fileBlock as a single
+ * extent, or as the tail of the last one, without walking them one by one.
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int blockmap_append_hole(struct inode_blockmap *map, int *capacity, int fileBlock, int numBlocks) {
+    if (numBlocks <= 0) {
+        return 0;
+    }
+    if (blockmap_append(map, capacity, fileBlock, 0) < 0) {
+        return -1;
+    }
+    map->extents[map->numExtents - 1].numBlocks += numBlocks - 1;
+    return 0;
+}
+
+/**
+ * Appends the entries of one single indirect block covering file blocks
+ * [firstBlock, firstBlock + ADDRESSES_PER_BLOCK) up to the end of the file.
+ */
+static int blockmap_append_indirect(struct unixfilesystem *fs, struct inode_blockmap *map, int *capacity,
+                                    uint16_t indirect_ptr, int firstBlock) {
+    int count = map->numBlocks - firstBlock;
+    if (count > (int) ADDRESSES_PER_BLOCK) {
+        count = ADDRESSES_PER_BLOCK;
+    }
+
+    if (indirect_ptr == 0) {
+        // An unallocated indirect block leaves all its entries unallocated:
+        // one hole, and nothing to read.
+        return blockmap_append_hole(map, capacity, firstBlock, count) < 0 ? FSERR_NOMEM : 0;
+    }
+
+    unsigned char block_buffer[DISKIMG_SECTOR_SIZE];
+    FSSTATS_COUNT(fs->stats, FSSTATS_INDIRECT_READS, 1);
+    const uint16_t *indirect = blockcache_getsector(fs->cache, indirect_ptr, block_buffer);
+    if (indirect == NULL) {
+        return fserror_record(fs, FSERR_IO, "Failed to read indirect block %d", NULL, indirect_ptr, 0, 0);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (blockmap_append(map, capacity, firstBlock + i, indirect[i]) < 0) {
+            return FSERR_NOMEM;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Builds the complete block map of the file described by inp.
+ */
+struct inode_blockmap *inode_blockmap_build(struct unixfilesystem *fs, struct inode *inp, int *err) {
+    int code = FSERR_NOMEM;
+    struct inode_blockmap *map = calloc(1, sizeof(struct inode_blockmap));
+    if (map == NULL) {
+        goto fail;
+    }
+    map->refs = 1;
+    map->size = inode_getsize(inp);
+    map->numBlocks = (map->size + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
+
+    int capacity = 0;
+    int num_addrs = sizeof(inp->i_addr) / sizeof(inp->i_addr[0]);
+
+    if ((inp->i_mode & ILARG) == 0) {
+        // Small file: every i_addr slot is a data block.  A size past the
+        // direct range names blocks the inode has no slot for: unlike a 0
+        // address, that isn't a hole but a corrupt inode.
+        if (map->numBlocks > num_addrs) {
+            code = fserror_record(fs, FSERR_CORRUPT, "Small file of %d bytes has no block %d", NULL,
+                                  map->size, num_addrs, 0);
+            goto fail;
+        }
+        for (int b = 0; b < map->numBlocks; b++) {
+            if (blockmap_append(map, &capacity, b, inp->i_addr[b]) < 0) {
+                goto fail;
+            }
+        }
+        return map;
+    }
+
+    // Large file: i_addr[0]..i_addr[6] are single indirect, i_addr[7] is
+    // double indirect.  Each indirect block is read exactly once.
+    int b = 0;
+    for (int i = 0; i < num_addrs - 1 && b < map->numBlocks; i++, b += ADDRESSES_PER_BLOCK) {
+        if ((code = blockmap_append_indirect(fs, map, &capacity, inp->i_addr[i], b)) < 0) {
+            goto fail;
+        }
+    }
+
+    uint16_t double_indirect_ptr = inp->i_addr[num_addrs - 1];
+    if (b < map->numBlocks && double_indirect_ptr == 0) {
+        // No double indirect block: the rest of the file is one hole.
+        if (blockmap_append_hole(map, &capacity, b, map->numBlocks - b) < 0) {
+            code = FSERR_NOMEM;
+            goto fail;
+        }
+    } else if (b < map->numBlocks) {
+        unsigned char block_buffer[DISKIMG_SECTOR_SIZE];
+        FSSTATS_COUNT(fs->stats, FSSTATS_INDIRECT_READS, 1);
+        const uint16_t *double_indirect = blockcache_getsector(fs->cache, double_indirect_ptr, block_buffer);
+        if (double_indirect == NULL) {
+            code = fserror_record(fs, FSERR_IO, "Failed to read double indirect block %d", NULL, double_indirect_ptr, 0, 0);
+            goto fail;
+        }
+
+        for (int i = 0; i < (int) ADDRESSES_PER_BLOCK && b < map->numBlocks; i++, b += ADDRESSES_PER_BLOCK) {
+            if ((code = blockmap_append_indirect(fs, map, &capacity, double_indirect[i], b)) < 0) {
+                goto fail;
+            }
+        }
+    }
+    return map;
+
+fail:
+    inode_blockmap_free(map);
+    if (err != NULL) {
+        *err = code;
+    }
+    return NULL;
+}
+
+/**
+ * Returns the index of the extent containing logical block fileBlockNum, or
+ * -1 if it lies outside the file.
+ */
+int inode_blockmap_findextent(const struct inode_blockmap *map, int fileBlockNum) {
+    if (fileBlockNum < 0 || fileBlockNum >= map->numBlocks) {
+        return -1;
+    }
+
+    // Binary search for the extent containing fileBlockNum.
+    int lo = 0, hi = map->numExtents - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (map->extents[mid].fileBlock <= fileBlockNum) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Returns the disk block holding logical block fileBlockNum, 0 if that
+ * block is not allocated, or -1 if it lies outside the file.
+ */
+int inode_blockmap_lookup(const struct inode_blockmap *map, int fileBlockNum) {
+    int index = inode_blockmap_findextent(map, fileBlockNum);
+    if (index < 0) {
+        return -1;
+    }
+
+    const struct inode_extent *e = &map->extents[index];
+    if (e->diskBlock == 0) {
+        return 0;
+    }
+    return e->diskBlock + (fileBlockNum - e->fileBlock);
+}
+
+void inode_blockmap_free(struct inode_blockmap *map) {
+    if (map == NULL) {
+        return;
+    }
+    free(map->extents);
+    free(map);
+}
+
+/**
+ * Returns the block map of the specified inode from the per-filesystem map
+ * cache, building and caching it on a miss.
+ */
+struct inode_blockmap *inode_getblockmap(struct unixfilesystem *fs, int inumber, int *err) {
+    int slot = inumber % UNIXFILESYSTEM_BLOCKMAP_SLOTS;
+
+    pthread_mutex_lock(&fs->blockmapLock);
+    struct inode_blockmap *map = fs->blockmaps[slot];
+    if (map != NULL && map->inumber == inumber) {
+        __atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&fs->blockmapLock);
+        return map;
+    }
+    unsigned generation = fs->blockmapGeneration;
+    pthread_mutex_unlock(&fs->blockmapLock);
+
+    // Walk the i_addr tree without holding the lock.
+    FSSTATS_COUNT(fs->stats, FSSTATS_BLOCKMAP_BUILDS, 1);
+    struct inode in;
+    int code = inode_iget(fs, inumber, &in);
+    if (code < 0) {
+        if (err != NULL) {
+            *err = code;
+        }
+        return NULL;
+    }
+    map = inode_blockmap_build(fs, &in, err);
+    if (map == NULL) {
+        return NULL;
+    }
+    map->inumber = inumber;
+
+    // The cache keeps its own reference to the map, unless a writer
+    // invalidated maps while this one was being built: it may be stale.
+    pthread_mutex_lock(&fs->blockmapLock);
+    if (fs->blockmapGeneration == generation) {
+        inode_putblockmap(fs->blockmaps[slot]);
+        map->refs++;
+        fs->blockmaps[slot] = map;
+    }
+    pthread_mutex_unlock(&fs->blockmapLock);
+    return map;
+}
+
+void inode_putblockmap(struct inode_blockmap *map) {
+    if (map != NULL && __atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        inode_blockmap_free(map);
+    }
+}
+
+/**
+ * Drops the cached block map of the specified inode, or of every inode if
+ * inumber is 0.
+ */
+void inode_invalidateblockmaps(struct unixfilesystem *fs, int inumber) {
+    pthread_mutex_lock(&fs->blockmapLock);
+    fs->blockmapGeneration++;
+    for (int slot = 0; slot < UNIXFILESYSTEM_BLOCKMAP_SLOTS; slot++) {
+        struct inode_blockmap *map = fs->blockmaps[slot];
+        if (map != NULL && (inumber == 0 || map->inumber == inumber)) {
+            inode_putblockmap(map);
+            fs->blockmaps[slot] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&fs->blockmapLock);
+}
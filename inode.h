@@ -5,21 +5,133 @@
 
 /**
  * Fetches the specified inode from the filesystem. 
- * Returns 0 on success, -1 on error.  
+ * Returns 0 on success or a negative FSERR_* code (see fserror.h):
+ * FSERR_INVAL for an inumber outside the inode table, FSERR_NOTALLOC for a
+ * free inode and FSERR_IO if its sector can't be read.
  */
 int inode_iget(struct unixfilesystem *fs, int inumber, struct inode *inp); 
 
+/**
+ * Returns 1 if the specified inode is allocated, 0 otherwise.  Uses the
+ * allocation bitmap when the inode table was loaded at init time, so free
+ * inodes can be skipped without touching the disk.
+ */
+int inode_isallocated(struct unixfilesystem *fs, int inumber);
+
 /**
  * Given an index of a file block, retrieves the file's actual block number
  * of from the given inode.
  *
- * Returns the disk block number on success, -1 on error.  
+ * Returns the disk block number on success, FSERR_RANGE if the block is
+ * past the end of the file, FSERR_HOLE if it isn't allocated (the file
+ * layer reads such a block as zeros), or another negative FSERR_* code on
+ * error.  An unallocated indirect block makes a hole of everything under it
+ * without being read.
  */
 int inode_indexlookup(struct unixfilesystem *fs, struct inode *inp, int blockNum);
 
+/**
+ * A run of logically consecutive file blocks that are also consecutive on
+ * disk.  diskBlock is 0 for a run of unallocated blocks.
+ */
+struct inode_extent {
+  int fileBlock;    // First logical block of the run.
+  int diskBlock;    // Disk block holding fileBlock, or 0.
+  int numBlocks;    // Length of the run in blocks.
+};
+
+/**
+ * The complete logical->physical block map of a file, coalesced into
+ * extents sorted by fileBlock.  Built with one walk of the i_addr tree,
+ * reading every indirect block once; an unallocated indirect block adds its
+ * whole range as one hole, in constant time.
+ */
+struct inode_blockmap {
+  int inumber;      // Inode the map belongs to (0 if built from a bare inode).
+  int refs;         // References held by inode_getblockmap() callers and the cache.
+  int size;         // File size in bytes.
+  int numBlocks;    // Logical blocks in the file.
+  int numExtents;
+  struct inode_extent *extents;
+};
+
+/**
+ * Walks the i_addr tree of the given inode and returns its block map, or
+ * NULL on error with the FSERR_* code in *err (if err isn't NULL), which is
+ * FSERR_CORRUPT for a small file whose size runs past its direct blocks.
+ * Release it with inode_blockmap_free().
+ */
+struct inode_blockmap *inode_blockmap_build(struct unixfilesystem *fs, struct inode *inp, int *err);
+
+/**
+ * Returns the disk block holding logical block fileBlockNum, 0 if that block
+ * is not allocated, or -1 if it lies outside the file.
+ */
+int inode_blockmap_lookup(const struct inode_blockmap *map, int fileBlockNum);
+
+/**
+ * Returns the index in map->extents of the extent containing logical block
+ * fileBlockNum, or -1 if it lies outside the file.
+ */
+int inode_blockmap_findextent(const struct inode_blockmap *map, int fileBlockNum);
+
+void inode_blockmap_free(struct inode_blockmap *map);
+
+/**
+ * Returns the block map of the specified inode, served from a small cache
+ * on the filesystem so that consecutive block reads of one file share a
+ * single walk.  Returns NULL on error with the FSERR_* code in *err (if
+ * err isn't NULL).  Every successful call must be paired with
+ * inode_putblockmap().
+ */
+struct inode_blockmap *inode_getblockmap(struct unixfilesystem *fs, int inumber, int *err);
+
+void inode_putblockmap(struct inode_blockmap *map);
+
+/**
+ * Drops the cached block map of the specified inode, or of every inode if
+ * inumber is 0.  Must be called whenever an inode's blocks change.
+ */
+void inode_invalidateblockmaps(struct unixfilesystem *fs, int inumber);
+
 /**
  * Computes the size in bytes of the file identified by the given inode
  */
 int inode_getsize(struct inode *inp);
 
+/**
+ * Sets the size of the inode in memory.  Sizes are 24 bits wide.
+ */
+void inode_setsize(struct inode *inp, int size);
+
+// Largest file size an inode can record.
+#define INODE_MAX_SIZE ((1 << 24) - 1)
+
+/**
+ * Writes the inode back to the filesystem (allocated or not).  With the
+ * inode table in memory only the table is updated and its sector is
+ * flushed at the end of the write batch; otherwise the inode's sector is
+ * rewritten at once.  Drops the inode's cached block map.  Returns 0 on
+ * success or a negative FSERR_* code.
+ */
+int inode_iwrite(struct unixfilesystem *fs, int inumber, const struct inode *inp);
+
+/**
+ * Returns the disk block holding logical block fileBlockNum of the file,
+ * allocating it, and any indirect blocks on the way, if it isn't allocated
+ * yet.  A small file reaching its ninth block is converted to the large
+ * (ILARG) layout as V6 bmap() does.  *fresh is set to 1 when the data block
+ * was just allocated (its contents are then undefined).  The changes to
+ * *inp are only in memory; the caller writes the inode.  Returns a
+ * negative FSERR_* code on error, FSERR_NOSPC if the filesystem is full.
+ */
+int inode_allocblock(struct unixfilesystem *fs, struct inode *inp, int fileBlockNum, int *fresh);
+
+/**
+ * Frees every data and indirect block of the inode and sets its size to 0
+ * (V6 itrunc), in memory; the caller writes the inode.  Returns 0 on
+ * success, -1 on error.
+ */
+int inode_truncate(struct unixfilesystem *fs, struct inode *inp);
+
 #endif // _INODE_
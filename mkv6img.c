@@ -0,0 +1,345 @@
+/**
+ * Writes synthetic Unix V6 disk images for benchmarking.  The output depends
+ * only on the shape, count, size and seed, so the same command always
+ * produces the same image.
+ *
+ * Shapes:
+ *   tiny   count files of 1 to 64 bytes, 256 to a directory
+ *   large  count files of size bytes, big enough to need ILARG and the
+ *          doubly indirect block
+ *   wide   one directory holding count small files
+ *   deep   a chain of count nested directories, each with one small file
+ *
+ * Every block and inode not used is put on the superblock free lists the way
+ * V6 mkfs does, so the images can also be written to.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "diskimg.h"
+#include "unixfilesystem.h"
+
+#define INODES_PER_BLOCK (DISKIMG_SECTOR_SIZE / sizeof(struct inode))
+#define ADDRS_PER_BLOCK (DISKIMG_SECTOR_SIZE / sizeof(uint16_t))
+#define MAX_BLOCKS 65535
+#define MAX_FILE_BLOCKS ((7 + ADDRS_PER_BLOCK) * ADDRS_PER_BLOCK)
+#define TINY_PER_DIR 256
+
+// Free blocks left at the end of every image for writes.
+#define SPARE_BLOCKS 1024
+#define SPARE_INODES 64
+
+struct image {
+  uint8_t *data;             // MAX_BLOCKS sectors.
+  int isize;                 // Blocks of inodes.
+  int nextBlock;             // Next data block to hand out.
+  int nextInode;             // Next inumber to hand out.
+  uint64_t rng;
+};
+
+static uint64_t image_random(struct image *im) {
+  // xorshift64*: small, fast and the same everywhere.
+  im->rng ^= im->rng >> 12;
+  im->rng ^= im->rng << 25;
+  im->rng ^= im->rng >> 27;
+  return im->rng * 2685821657736338717ULL;
+}
+
+static uint8_t *image_block(struct image *im, int bno) {
+  return im->data + (size_t) bno * DISKIMG_SECTOR_SIZE;
+}
+
+static struct inode *image_inode(struct image *im, int inumber) {
+  return (struct inode *) image_block(im, INODE_START_SECTOR) + (inumber - 1);
+}
+
+static int image_balloc(struct image *im) {
+  if (im->nextBlock >= MAX_BLOCKS) {
+    fprintf(stderr, "Image is full (%d blocks)\n", MAX_BLOCKS);
+    exit(EXIT_FAILURE);
+  }
+  return im->nextBlock++;
+}
+
+static int image_ialloc(struct image *im) {
+  if (im->nextInode > im->isize * (int) INODES_PER_BLOCK) {
+    fprintf(stderr, "Out of inodes\n");
+    exit(EXIT_FAILURE);
+  }
+  return im->nextInode++;
+}
+
+/**
+ * Stores data as the contents of inumber.  Data blocks are laid out
+ * contiguously; the indirect blocks of a large file follow its data.
+ */
+static void image_writefile(struct image *im, int inumber, uint16_t mode, int nlink,
+                            const void *data, int size) {
+  int numBlocks = (size + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
+  if (size >= (1 << 24) || numBlocks > (int) MAX_FILE_BLOCKS) {
+    fprintf(stderr, "File of %d bytes is too large for V6\n", size);
+    exit(EXIT_FAILURE);
+  }
+
+  uint16_t *blocks = malloc((numBlocks + 1) * sizeof(uint16_t));
+  for (int i = 0; i < numBlocks; i++) {
+    blocks[i] = image_balloc(im);
+    int n = size - i * DISKIMG_SECTOR_SIZE;
+    memcpy(image_block(im, blocks[i]), (const uint8_t *) data + i * DISKIMG_SECTOR_SIZE,
+           n < DISKIMG_SECTOR_SIZE ? n : DISKIMG_SECTOR_SIZE);
+  }
+
+  struct inode *in = image_inode(im, inumber);
+  memset(in, 0, sizeof(*in));
+  in->i_mode = IALLOC | mode;
+  in->i_nlink = nlink;
+  in->i_size0 = size >> 16;
+  in->i_size1 = size & 0xffff;
+
+  if (numBlocks <= 8) {
+    for (int i = 0; i < numBlocks; i++) in->i_addr[i] = blocks[i];
+  } else {
+    in->i_mode |= ILARG;
+    int done = 0;
+    for (int i = 0; i < 8 && done < numBlocks; i++) {
+      int ind = image_balloc(im);
+      in->i_addr[i] = ind;
+      uint16_t *ia = (uint16_t *) image_block(im, ind);
+      if (i < 7) {
+        for (int j = 0; j < (int) ADDRS_PER_BLOCK && done < numBlocks; j++) ia[j] = blocks[done++];
+      } else {
+        for (int j = 0; j < (int) ADDRS_PER_BLOCK && done < numBlocks; j++) {
+          int ind2 = image_balloc(im);
+          ia[j] = ind2;
+          uint16_t *ia2 = (uint16_t *) image_block(im, ind2);
+          for (int k = 0; k < (int) ADDRS_PER_BLOCK && done < numBlocks; k++) ia2[k] = blocks[done++];
+        }
+      }
+    }
+  }
+  free(blocks);
+}
+
+/**
+ * Writes a regular file of size random bytes.
+ */
+static void image_randomfile(struct image *im, int inumber, int size) {
+  uint8_t *data = malloc(size + 8);
+  for (int i = 0; i < size; i += 8) {
+    uint64_t r = image_random(im);
+    memcpy(data + i, &r, 8);
+  }
+  image_writefile(im, inumber, IREAD | IWRITE, 1, data, size);
+  free(data);
+}
+
+/**
+ * A directory being filled in; entries[0] and [1] are "." and "..".
+ */
+struct dirbuf {
+  int inumber;
+  int numEntries;
+  int numSubdirs;
+  struct direntv6 *entries;
+};
+
+static void dirbuf_init(struct dirbuf *d, int inumber, int parent, int capacity) {
+  d->inumber = inumber;
+  d->numEntries = 0;
+  d->numSubdirs = 0;
+  d->entries = calloc(capacity + 2, sizeof(struct direntv6));
+  d->entries[d->numEntries].d_inumber = inumber;
+  strcpy(d->entries[d->numEntries++].d_name, ".");
+  d->entries[d->numEntries].d_inumber = parent;
+  strcpy(d->entries[d->numEntries++].d_name, "..");
+}
+
+static void dirbuf_add(struct dirbuf *d, const char *name, int inumber, int isdir) {
+  struct direntv6 *e = &d->entries[d->numEntries++];
+  e->d_inumber = inumber;
+  strncpy(e->d_name, name, sizeof(e->d_name));
+  if (isdir) d->numSubdirs++;
+}
+
+static void dirbuf_write(struct image *im, struct dirbuf *d) {
+  image_writefile(im, d->inumber, IFDIR | IREAD | IWRITE | IEXEC, 2 + d->numSubdirs,
+                  d->entries, d->numEntries * sizeof(struct direntv6));
+  free(d->entries);
+}
+
+static void build_tiny(struct image *im, int count) {
+  struct dirbuf root;
+  int numDirs = (count + TINY_PER_DIR - 1) / TINY_PER_DIR;
+  dirbuf_init(&root, image_ialloc(im), ROOT_INUMBER, numDirs);
+  for (int d = 0; d < numDirs; d++) {
+    struct dirbuf dir;
+    char name[16];
+    dirbuf_init(&dir, image_ialloc(im), root.inumber, TINY_PER_DIR);
+    for (int f = d * TINY_PER_DIR; f < count && f < (d + 1) * TINY_PER_DIR; f++) {
+      int inumber = image_ialloc(im);
+      image_randomfile(im, inumber, 1 + image_random(im) % 64);
+      snprintf(name, sizeof(name), "t%d", f);
+      dirbuf_add(&dir, name, inumber, 0);
+    }
+    dirbuf_write(im, &dir);
+    snprintf(name, sizeof(name), "dir%d", d);
+    dirbuf_add(&root, name, dir.inumber, 1);
+  }
+  dirbuf_write(im, &root);
+}
+
+static void build_large(struct image *im, int count, int size) {
+  struct dirbuf root;
+  dirbuf_init(&root, image_ialloc(im), ROOT_INUMBER, count);
+  for (int f = 0; f < count; f++) {
+    char name[16];
+    int inumber = image_ialloc(im);
+    image_randomfile(im, inumber, size);
+    snprintf(name, sizeof(name), "large%d", f);
+    dirbuf_add(&root, name, inumber, 0);
+  }
+  dirbuf_write(im, &root);
+}
+
+static void build_wide(struct image *im, int count) {
+  struct dirbuf root;
+  dirbuf_init(&root, image_ialloc(im), ROOT_INUMBER, count);
+  for (int f = 0; f < count; f++) {
+    char name[16];
+    int inumber = image_ialloc(im);
+    image_randomfile(im, inumber, image_random(im) % 600);
+    // Long names, some using all 14 characters.
+    snprintf(name, sizeof(name), f % 3 ? "wfile_%d" : "w%013d", f);
+    dirbuf_add(&root, name, inumber, 0);
+  }
+  dirbuf_write(im, &root);
+}
+
+/**
+ * Builds level depth of the deep chain below parent and returns its inumber.
+ */
+static int build_deep_level(struct image *im, int parent, int depth, int count) {
+  struct dirbuf dir;
+  dirbuf_init(&dir, image_ialloc(im), parent, 2);
+  if (parent == 0) dir.entries[1].d_inumber = dir.inumber;   // The root is its own parent.
+
+  int inumber = image_ialloc(im);
+  image_randomfile(im, inumber, image_random(im) % 2000);
+  dirbuf_add(&dir, "f", inumber, 0);
+  if (depth + 1 < count) {
+    dirbuf_add(&dir, "d", build_deep_level(im, dir.inumber, depth + 1, count), 1);
+  }
+  dirbuf_write(im, &dir);
+  return dir.inumber;
+}
+
+static void build_deep(struct image *im, int count) {
+  build_deep_level(im, 0, 0, count);
+}
+
+/**
+ * Puts bno on the free list held in the superblock, spilling the list into
+ * bno itself when it is full (V6 free() in alloc.c).
+ */
+static void image_bfree(struct image *im, struct filsys *sb, int bno) {
+  if (sb->s_nfree >= 100) {
+    uint16_t *b = (uint16_t *) image_block(im, bno);
+    b[0] = sb->s_nfree;
+    memcpy(&b[1], sb->s_free, sizeof(sb->s_free));
+    sb->s_nfree = 0;
+  }
+  sb->s_free[sb->s_nfree++] = bno;
+}
+
+static void PrintUsageAndExit(char *progname) {
+  fprintf(stderr, "Usage: %s [-n count] [-b bytes] [-s seed] tiny|large|wide|deep image\n", progname);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  int count = -1;
+  int size = 4 * 1024 * 1024;
+  uint64_t seed = 6;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:b:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'b':
+      size = atoi(optarg);
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 0);
+      break;
+    default:
+      PrintUsageAndExit(argv[0]);
+    }
+  }
+  if (optind != argc - 2) PrintUsageAndExit(argv[0]);
+  const char *shape = argv[optind];
+  const char *path = argv[optind + 1];
+
+  int numInodes;
+  if (strcmp(shape, "tiny") == 0) {
+    if (count < 0) count = 8000;
+    numInodes = 1 + count + (count + TINY_PER_DIR - 1) / TINY_PER_DIR;
+  } else if (strcmp(shape, "large") == 0) {
+    if (count < 0) count = 6;
+    numInodes = 1 + count;
+  } else if (strcmp(shape, "wide") == 0) {
+    if (count < 0) count = 20000;
+    numInodes = 1 + count;
+  } else if (strcmp(shape, "deep") == 0) {
+    if (count < 0) count = 120;
+    numInodes = 2 * count;
+  } else {
+    PrintUsageAndExit(argv[0]);
+  }
+  if (count < 1 || size < 0 || numInodes + SPARE_INODES > 65535) PrintUsageAndExit(argv[0]);
+
+  struct image im = { .rng = seed ? seed : 1, .nextInode = ROOT_INUMBER };
+  im.isize = (numInodes + SPARE_INODES + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+  im.nextBlock = INODE_START_SECTOR + im.isize;
+  im.data = calloc(MAX_BLOCKS, DISKIMG_SECTOR_SIZE);
+  if (im.data == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (strcmp(shape, "tiny") == 0) build_tiny(&im, count);
+  else if (strcmp(shape, "large") == 0) build_large(&im, count, size);
+  else if (strcmp(shape, "wide") == 0) build_wide(&im, count);
+  else build_deep(&im, count);
+
+  int fsize = im.nextBlock + SPARE_BLOCKS;
+  if (fsize > MAX_BLOCKS) fsize = MAX_BLOCKS;
+
+  uint16_t *bootblock = (uint16_t *) image_block(&im, BOOTBLOCK_SECTOR);
+  bootblock[0] = BOOTBLOCK_MAGIC_NUM;
+
+  struct filsys *sb = (struct filsys *) image_block(&im, SUPERBLOCK_SECTOR);
+  sb->s_isize = im.isize;
+  sb->s_fsize = fsize;
+  // Block 0 ends the chain; free the rest from the top down so allocation
+  // hands blocks out in ascending order.
+  image_bfree(&im, sb, 0);
+  for (int bno = fsize - 1; bno >= im.nextBlock; bno--) image_bfree(&im, sb, bno);
+  for (int i = im.nextInode; i <= im.isize * (int) INODES_PER_BLOCK && sb->s_ninode < 100; i++) {
+    sb->s_inode[sb->s_ninode++] = i;
+  }
+
+  FILE *f = fopen(path, "wb");
+  if (f == NULL || fwrite(im.data, DISKIMG_SECTOR_SIZE, fsize, f) != (size_t) fsize || fclose(f) != 0) {
+    fprintf(stderr, "Can't write %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  printf("%s: %s, %d inodes used, %d of %d blocks used\n", path, shape,
+         im.nextInode - 1, im.nextBlock, fsize);
+  free(im.data);
+  return 0;
+}
@@ -4,83 +4,269 @@
 #include "unixfilesystem.h" // Para ROOT_INUMBER y struct inode (aunque inode.h la trae)
 #include "filsys.h"       // Para struct filsys, si es necesario directamente (usualmente no en pathname)
 #include "direntv6.h"     // Para struct direntv6
+#include "dcache.h"       // Cache de búsquedas (directorio, nombre) -> inodo
+#include "fsstats.h"      // Contadores y latencias por capa
+#include "fserror.h"      // Códigos FSERR_* y registro de diagnósticos
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h> // assert no se usa activamente en esta implementación pero es común en el proyecto
 
-// Constante para el valor de retorno en caso de error, según la especificación.
-#define PATHNAME_LOOKUP_FAILURE -1
-// Definir una longitud máxima para las rutas, para la copia local.
-#define MAX_PATHNAME_LEN 256
+// Largo máximo de un componente: el de d_name en una entrada de directorio.
+#define COMPONENT_MAX_LEN ((int) sizeof(((struct direntv6 *) 0)->d_name))
 
 /**
- * Returns the inode number associated with the specified pathname. This need only
- * handle absolute paths. Returns a negative number (-1 is fine) if an error is
- * encountered.
+ * Valida que pathname sea una ruta absoluta.  Returns 0 or FSERR_INVAL.
  */
-int pathname_lookup(struct unixfilesystem *fs, const char *pathname) {
-    // Validar la ruta de entrada
+static int pathname_check(struct unixfilesystem *fs, const char *pathname) {
     if (pathname == NULL || pathname[0] == '\0') {
-        fprintf(stderr, "Error pathname_lookup: Pathname is NULL or empty.\n");
-        return PATHNAME_LOOKUP_FAILURE;
+        return fserror_record(fs, FSERR_INVAL, "pathname_lookup: Pathname is NULL or empty", NULL, 0, 0, 0);
     }
     if (pathname[0] != '/') {
-        fprintf(stderr, "Error pathname_lookup: Pathname '%s' is not an absolute path.\n", pathname);
-        return PATHNAME_LOOKUP_FAILURE;
+        return fserror_record(fs, FSERR_INVAL, "pathname_lookup: Pathname '%s' is not an absolute path",
+                              pathname, 0, 0, 0);
+    }
+    return 0;
+}
+
+/**
+ * Devuelve el siguiente componente de la ruta a partir de *p (salteando las
+ * barras) y deja *p al final del mismo.  Returns its length, 0 at the end of
+ * the path.
+ */
+static int pathname_nextcomponent(const char **p, const char **component) {
+    while (**p == '/') {
+        (*p)++;
     }
+    *component = *p;
+    while (**p != '\0' && **p != '/') {
+        (*p)++;
+    }
+    return *p - *component;
+}
 
-    // Hacer una copia mutable de la ruta para strtok
-    char path_copy[MAX_PATHNAME_LEN];
-    if (strlen(pathname) + 1 > MAX_PATHNAME_LEN) {
-        fprintf(stderr, "Error pathname_lookup: Pathname '%s' exceeds maximum length %d.\n", pathname, MAX_PATHNAME_LEN - 1);
-        return PATHNAME_LOOKUP_FAILURE;
+/**
+ * Busca el componente name, de len bytes y no necesariamente terminado en
+ * NUL, en el directorio dirinumber: primero en el cache de nombres y si no,
+ * recorriendo el directorio.  Returns the inumber it names or a negative
+ * FSERR_* code.
+ */
+static int pathname_step(struct unixfilesystem *fs, int dirinumber, const char *name, int len) {
+    // Verificar que dirinumber es realmente un directorio.
+    struct inode dir_inode_obj;
+    int err = inode_iget(fs, dirinumber, &dir_inode_obj);
+    if (err < 0) {
+        // Error al obtener el inodo del directorio. inode_iget ya registró el error.
+        return err;
     }
-    strcpy(path_copy, pathname);
 
-    // Caso especial: la ruta es "/"
-    if (strcmp(path_copy, "/") == 0) {
-        return ROOT_INUMBER; // El inodo del directorio raíz
+    char component[COMPONENT_MAX_LEN + 1];
+    int n = len < COMPONENT_MAX_LEN ? len : COMPONENT_MAX_LEN;
+    memcpy(component, name, n);
+    component[n] = '\0';
+
+    if ((dir_inode_obj.i_mode & IFMT) != IFDIR) {
+        return fserror_record(fs, FSERR_NOTDIR, "pathname_lookup: Can't look up '%s' in inode %d, not a directory",
+                              component, dirinumber, 0, 0);
+    }
+    if (len > COMPONENT_MAX_LEN) {
+        // Ninguna entrada de directorio puede tener este nombre.
+        return FSERR_NOENT;
     }
 
-    // Iniciar el recorrido desde el directorio raíz.
-    // current_dir_inumber siempre será el inodo del directorio en el que estamos buscando el siguiente componente.
+    int next_inumber;
+    unsigned generation = dcache_generation(fs->dcache);
+    if (!dcache_lookup(fs->dcache, dirinumber, component, &next_inumber)) {
+        struct direntv6 found_entry;
+        err = directory_findname(fs, component, dirinumber, &found_entry);
+        if (err < 0 && err != FSERR_NOENT) {
+            // Error de lectura: no se guarda en el cache, un reintento podría funcionar.
+            return err;
+        }
+        next_inumber = err < 0 ? 0 : found_entry.d_inumber;
+        // Also remember misses so a repeated lookup doesn't rescan the
+        // directory, unless it was invalidated while being searched.
+        dcache_insert(fs->dcache, dirinumber, component, next_inumber, generation);
+    }
+
+    if (next_inumber == 0) {
+        // Componente no encontrado: es un fallo esperado, no se registra.
+        return FSERR_NOENT;
+    }
+    return next_inumber;
+}
+
+/**
+ * Returns the inode number associated with the specified pathname. This need only
+ * handle absolute paths. Returns a negative FSERR_* code if an error is
+ * encountered.
+ */
+static int pathname_resolve(struct unixfilesystem *fs, const char *pathname) {
+    int err = pathname_check(fs, pathname);
+    if (err < 0) {
+        return err;
+    }
+
+    // Recorrer la ruta desde el directorio raíz, componente por componente y
+    // sin copiarla, así que no hay un largo máximo.  "/" es la raíz misma.
     int current_dir_inumber = ROOT_INUMBER;
-    struct inode dir_inode_obj; // Para verificar si current_dir_inumber es un directorio
+    const char *p = pathname;
+    const char *component;
+    int len;
+    while ((len = pathname_nextcomponent(&p, &component)) > 0) {
+        // El inodo de este componente se convierte en el "directorio actual"
+        // para la siguiente iteración o será el resultado final.
+        current_dir_inumber = pathname_step(fs, current_dir_inumber, component, len);
+        if (current_dir_inumber < 0) {
+            return current_dir_inumber;
+        }
+    }
+    return current_dir_inumber;
+}
 
-    // Tokenizar la ruta. path_copy no debe ser "/" aquí.
-    // strtok modificará path_copy. El primer token no será vacío porque path_copy[0] era '/'.
-    char *component = strtok(path_copy, "/");
+int pathname_lookup(struct unixfilesystem *fs, const char *pathname) {
+    FSSTATS_COUNT(fs->stats, FSSTATS_PATH_LOOKUPS, 1);
+    FSSTATS_TIME_BEGIN(fs->stats, start);
+    int inumber = pathname_resolve(fs, pathname);
+    FSSTATS_TIME_END(fs->stats, FSSTATS_LAYER_PATHNAME, start);
+    return inumber;
+}
+
+/**
+ * Un nodo del trie de pathname_lookup_batch: un componente dentro del nodo
+ * parent.  Los nombres de más de COMPONENT_MAX_LEN bytes se guardan
+ * truncados con len = COMPONENT_MAX_LEN + 1; todos resuelven a FSERR_NOENT,
+ * así que compartir el nodo no cambia el resultado.
+ */
+struct pathname_node {
+    int parent;                    // Índice del nodo padre (0 es la raíz).
+    int inumber;                   // Resultado, o un código FSERR_* negativo.
+    int len;
+    char name[COMPONENT_MAX_LEN];
+};
+
+/**
+ * Tabla hash (parent, name) -> nodo del trie, con direccionamiento abierto.
+ * Un slot en 0 está libre; si no, guarda el índice del nodo + 1.
+ */
+struct pathname_trie {
+    struct pathname_node *nodes;
+    int numNodes;
+    int *slots;
+    unsigned mask;
+};
 
-    while (component != NULL) {
-        // Verificar que el inodo del directorio actual (current_dir_inumber) es realmente un directorio.
-        if (inode_iget(fs, current_dir_inumber, &dir_inode_obj) < 0) {
-            // Error al obtener el inodo del directorio actual. inode_iget ya imprimió un error.
-            return PATHNAME_LOOKUP_FAILURE;
+static unsigned pathname_hash(int parent, const char *name, int len) {
+    uint32_t h = 2166136261u ^ (uint32_t) parent;
+    h *= 16777619u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (uint8_t) name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Returns the node for component name under parent, adding it if it isn't
+ * in the trie yet.
+ */
+static int pathname_trie_child(struct pathname_trie *t, int parent, const char *name, int len) {
+    if (len > COMPONENT_MAX_LEN) {
+        len = COMPONENT_MAX_LEN + 1;
+    }
+    int n = len < COMPONENT_MAX_LEN ? len : COMPONENT_MAX_LEN;
+    unsigned slot = pathname_hash(parent, name, n) & t->mask;
+    for (;; slot = (slot + 1) & t->mask) {
+        int index = t->slots[slot] - 1;
+        if (index < 0) {
+            break;
+        }
+        const struct pathname_node *node = &t->nodes[index];
+        if (node->parent == parent && node->len == len && memcmp(node->name, name, n) == 0) {
+            return index;
         }
+    }
+
+    int index = t->numNodes++;
+    struct pathname_node *node = &t->nodes[index];
+    node->parent = parent;
+    node->inumber = 0;
+    node->len = len;
+    memcpy(node->name, name, n);
+    t->slots[slot] = index + 1;
+    return index;
+}
+
+int pathname_lookup_batch(struct unixfilesystem *fs, const char *const *pathnames, int count, int *inumbers) {
+    FSSTATS_COUNT(fs->stats, FSSTATS_PATH_LOOKUPS, count);
+    FSSTATS_TIME_BEGIN(fs->stats, start);
 
-        if ((dir_inode_obj.i_mode & IFMT) != IFDIR) {
-            fprintf(stderr, "Error pathname_lookup: Path component (inode %d) is not a directory while resolving '%s'.\n", current_dir_inumber, pathname);
-            return PATHNAME_LOOKUP_FAILURE;
+    // Cota del número de nodos: la raíz más un nodo por componente.
+    long maxNodes = 1;
+    for (int i = 0; i < count; i++) {
+        const char *p = pathnames[i];
+        const char *component;
+        if (p == NULL || p[0] != '/') {
+            continue;
         }
+        while (pathname_nextcomponent(&p, &component) > 0) {
+            maxNodes++;
+        }
+    }
 
-        // Buscar el componente actual dentro del directorio actual (current_dir_inumber)
-        struct direntv6 found_entry;
-        if (directory_findname(fs, component, current_dir_inumber, &found_entry) < 0) {
-            // Componente no encontrado. directory_findname podría haber impreso un error.
-            fprintf(stderr, "Error pathname_lookup: Component '%s' not found in directory (inode %d) while resolving '%s'.\n", component, current_dir_inumber, pathname);
-            return PATHNAME_LOOKUP_FAILURE;
+    struct pathname_trie t;
+    unsigned capacity = 16;
+    while (capacity < 2 * maxNodes) {
+        capacity *= 2;
+    }
+    t.nodes = malloc(maxNodes * sizeof(struct pathname_node));
+    t.slots = calloc(capacity, sizeof(int));
+    t.mask = capacity - 1;
+    t.numNodes = 1;
+    if (t.nodes == NULL || t.slots == NULL) {
+        free(t.nodes);
+        free(t.slots);
+        return fserror_record(fs, FSERR_NOMEM, "pathname_lookup_batch: No memory for %d pathnames", NULL, count, 0, 0);
+    }
+    t.nodes[0].parent = 0;
+    t.nodes[0].inumber = ROOT_INUMBER;
+    t.nodes[0].len = 0;
+
+    // 1. Insertar cada ruta en el trie; inumbers[i] guarda por ahora el
+    //    nodo de su último componente o el error de la ruta.
+    for (int i = 0; i < count; i++) {
+        const char *p = pathnames[i];
+        const char *component;
+        int len;
+        int err = pathname_check(fs, p);
+        if (err < 0) {
+            inumbers[i] = err;
+            continue;
         }
+        int node = 0;
+        while ((len = pathname_nextcomponent(&p, &component)) > 0) {
+            node = pathname_trie_child(&t, node, component, len);
+        }
+        inumbers[i] = node;
+    }
 
-        // Componente encontrado. El inodo de este componente se convierte en el
-        // "directorio actual" para la siguiente iteración (si hay más componentes)
-        // o será el resultado final.
-        current_dir_inumber = found_entry.d_inumber;
+    // 2. Resolver cada componente distinto una sola vez.  Un nodo se crea
+    //    después que su padre, así que en orden de creación el padre ya está
+    //    resuelto; si falló, sus descendientes heredan el error.
+    for (int i = 1; i < t.numNodes; i++) {
+        struct pathname_node *node = &t.nodes[i];
+        int dirinumber = t.nodes[node->parent].inumber;
+        node->inumber = dirinumber < 0 ? dirinumber : pathname_step(fs, dirinumber, node->name, node->len);
+    }
 
-        // Obtener el siguiente componente
-        component = strtok(NULL, "/");
+    // 3. Los resultados, en el orden de entrada.
+    for (int i = 0; i < count; i++) {
+        if (inumbers[i] >= 0) {
+            inumbers[i] = t.nodes[inumbers[i]].inumber;
+        }
     }
 
-    // Si el bucle termina, current_dir_inumber contiene el número de inodo
-    // del último componente de la ruta.
-    return current_dir_inumber;
+    free(t.nodes);
+    free(t.slots);
+    FSSTATS_TIME_END(fs->stats, FSSTATS_LAYER_PATHNAME, start);
+    return 0;
 }
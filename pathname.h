@@ -5,9 +5,19 @@
 
 /**
  * Returns the inode number associated with the specified pathname.  This need only
- * handle absolute paths.  Returns a negative number (-1 is fine) if an error is 
- * encountered.
+ * handle absolute paths.  Returns a negative FSERR_* code (see fserror.h) if an
+ * error is encountered: FSERR_NOENT if a component doesn't exist, FSERR_NOTDIR
+ * if one that should be a directory isn't, FSERR_INVAL for a relative path.
  */
 int pathname_lookup(struct unixfilesystem *fs, const char *pathname);
 
+/**
+ * Resolves count pathnames at once, storing the result pathname_lookup()
+ * would give for pathnames[i] in inumbers[i].  The paths are merged into a
+ * trie of their components, so a directory shared by many paths is looked
+ * up once rather than once per path.  Returns 0, or FSERR_NOMEM if the trie
+ * couldn't be allocated (inumbers is then left unset).
+ */
+int pathname_lookup_batch(struct unixfilesystem *fs, const char *const *pathnames, int count, int *inumbers);
+
 #endif // _PATHNAME_H_
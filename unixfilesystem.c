@@ -2,6 +2,15 @@
 #include <stdlib.h>
 #include "unixfilesystem.h"
 #include "diskimg.h" 
+#include "blockcache.h"
+#include "dcache.h"
+#include "inode.h"
+#include "directory.h"
+#include "chksumfile.h"
+#include "fsstats.h"
+#include "fserror.h"
+
+static int unixfilesystem_loadinodes(struct unixfilesystem *fs);
 
 /**
  * Allocates and initializes a struct unixfilesystem given a filedescriptor to 
@@ -10,6 +19,22 @@
  */
 
 struct unixfilesystem *unixfilesystem_init(int dfd) {
+  return unixfilesystem_init_options(dfd, NULL);
+}
+
+struct unixfilesystem *unixfilesystem_init_options(int dfd,
+                                                   const struct unixfilesystem_options *opts) {
+  struct unixfilesystem_options defaults = {
+    .cacheSectors = BLOCKCACHE_DEFAULT_SECTORS,
+    .loadInodeTable = 1,
+    .dcacheEntries = DCACHE_DEFAULT_ENTRIES,
+    .indexDirectories = 1,
+    .memoChecksums = 1,
+    .readahead = UNIXFILESYSTEM_READAHEAD_CHUNKS,
+    .writeBack = 1,
+  };
+  if (opts == NULL) opts = &defaults;
+
   // Validate the bootblock.  This will catch the situation where something 
   // other than a descriptor to a valid diskimg is passed in.
   uint16_t bootblock[256];
@@ -28,18 +53,217 @@ struct unixfilesystem *unixfilesystem_init(int dfd) {
             sizeof(struct filsys));
   }
   
-  struct unixfilesystem *fs = malloc(sizeof(struct unixfilesystem));
+  struct unixfilesystem *fs = calloc(1, sizeof(struct unixfilesystem));
   if (fs == NULL) {
     fprintf(stderr,"Out of memory.\n");
     return NULL;
   }
 
   fs->dfd = dfd;  
+  fs->errors = fserror_create();
+  if (fs->errors == NULL) {
+    fprintf(stderr,"Out of memory.\n");
+    free(fs);
+    return NULL;
+  }
+  fs->readahead = opts->readahead;
+  pthread_mutex_init(&fs->blockmapLock, NULL);
+  pthread_mutex_init(&fs->chksumLock, NULL);
+  pthread_rwlock_init(&fs->inodesLock, NULL);
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&fs->writeLock, &attr);
+  pthread_mutexattr_destroy(&attr);
   if (diskimg_readsector(dfd, SUPERBLOCK_SECTOR, &fs->superblock) != DISKIMG_SECTOR_SIZE) {
     fprintf(stderr, "Error reading superblock\n");
+    fserror_free(fs->errors);
     free(fs);
     return NULL;
   }
 
+  // s_fmod is left set on images that weren't cleanly unmounted; here it
+  // means "changed since the last flush".
+  fs->superblock.s_fmod = 0;
+
+  fs->cache = blockcache_create(dfd, opts->cacheSectors);
+  if (fs->cache == NULL) {
+    fprintf(stderr, "Error creating sector cache of %d sectors\n", opts->cacheSectors);
+    fserror_free(fs->errors);
+    free(fs);
+    return NULL;
+  }
+  fs->stats = fsstats_create();
+  blockcache_setstats(fs->cache, fs->stats);
+  if (opts->writeBack) {
+    blockcache_setwriteback(fs->cache, INODE_START_SECTOR + fs->superblock.s_isize);
+  }
+
+  pthread_rwlock_init(&fs->dirindexLock, NULL);
+  int numInumbers = fs->superblock.s_isize * (DISKIMG_SECTOR_SIZE / sizeof(struct inode)) + 1;
+  if (opts->indexDirectories) {
+    fs->numDirindexes = numInumbers;
+    fs->dirindexes = calloc(fs->numDirindexes, sizeof(struct dirindex *));
+    if (fs->dirindexes == NULL) {
+      fprintf(stderr,"Out of memory.\n");
+      unixfilesystem_free(fs);
+      return NULL;
+    }
+  }
+
+  fs->dcache = dcache_create(opts->dcacheEntries);
+  if (fs->dcache == NULL) {
+    fprintf(stderr, "Error creating name cache of %d entries\n", opts->dcacheEntries);
+    unixfilesystem_free(fs);
+    return NULL;
+  }
+
+  if (opts->memoChecksums) {
+    fs->numChksums = numInumbers;
+    fs->chksums = calloc(fs->numChksums, sizeof(struct chksumfile_memo));
+    if (fs->chksums == NULL) {
+      fprintf(stderr,"Out of memory.\n");
+      unixfilesystem_free(fs);
+      return NULL;
+    }
+  }
+
+  fs->inodeDirty = calloc((fs->superblock.s_isize + 7) / 8 + 1, 1);
+  if (fs->inodeDirty == NULL) {
+    fprintf(stderr,"Out of memory.\n");
+    unixfilesystem_free(fs);
+    return NULL;
+  }
+
+  // Without the table (say, an image cut short inside the inode area)
+  // inodes are read sector by sector, so every readable one is still served.
+  if (opts->loadInodeTable) {
+    unixfilesystem_loadinodes(fs);
+  }
+
   return fs;
 }
+
+/**
+ * Reads all s_isize inode blocks with one sequential read and builds the
+ * allocation bitmap from their IALLOC bits.  Returns 0 on success, or -1 if
+ * the table can't be read whole, leaving fs->inodes NULL.
+ */
+static int unixfilesystem_loadinodes(struct unixfilesystem *fs) {
+  int isize = fs->superblock.s_isize;
+  int numInodes = isize * (DISKIMG_SECTOR_SIZE / sizeof(struct inode));
+
+  struct inode *inodes = malloc((size_t) isize * DISKIMG_SECTOR_SIZE);
+  uint8_t *inodeAlloc = calloc((numInodes + 7) / 8, 1);
+  if ((isize > 0 && inodes == NULL) || inodeAlloc == NULL) {
+    free(inodes);
+    free(inodeAlloc);
+    return -1;
+  }
+
+  FSSTATS_COUNT(fs->stats, FSSTATS_SECTORS_READ, isize);
+  int nbytes = diskimg_readsectors(fs->dfd, INODE_START_SECTOR, isize, inodes);
+  if (nbytes != isize * DISKIMG_SECTOR_SIZE) {
+    free(inodes);
+    free(inodeAlloc);
+    return -1;
+  }
+
+  for (int i = 0; i < numInodes; i++) {
+    if (inodes[i].i_mode & IALLOC) {
+      inodeAlloc[i / 8] |= 1 << (i % 8);
+    }
+  }
+
+  fs->numInodes = numInodes;
+  fs->inodes = inodes;
+  fs->inodeAlloc = inodeAlloc;
+  return 0;
+}
+
+void unixfilesystem_beginbatch(struct unixfilesystem *fs) {
+  pthread_mutex_lock(&fs->writeLock);
+  fs->batchDepth++;
+}
+
+int unixfilesystem_endbatch(struct unixfilesystem *fs) {
+  int err = 0;
+  if (--fs->batchDepth == 0) {
+    err = unixfilesystem_flush(fs);
+  }
+  pthread_mutex_unlock(&fs->writeLock);
+  return err;
+}
+
+int unixfilesystem_flush(struct unixfilesystem *fs) {
+  pthread_mutex_lock(&fs->writeLock);
+  int err = 0;
+
+  // Runs of dirty inode-table sectors go out with one write each.  With
+  // the table in memory the sectors are taken from it; otherwise
+  // inode_iwrite() already wrote them through the cache.
+  int isize = fs->superblock.s_isize;
+  for (int i = 0; i < isize; ) {
+    if (!(fs->inodeDirty[i / 8] >> (i % 8) & 1)) {
+      i++;
+      continue;
+    }
+    int n = 0;
+    while (i + n < isize && fs->inodeDirty[(i + n) / 8] >> ((i + n) % 8) & 1) {
+      fs->inodeDirty[(i + n) / 8] &= ~(1 << ((i + n) % 8));
+      n++;
+    }
+    if (fs->inodes != NULL &&
+        blockcache_writesectors(fs->cache, INODE_START_SECTOR + i, n,
+                                (const char *) fs->inodes + (size_t) i * DISKIMG_SECTOR_SIZE) < 0) {
+      fprintf(stderr, "Error writing inode sectors %d-%d\n", INODE_START_SECTOR + i, INODE_START_SECTOR + i + n - 1);
+      err = -1;
+    }
+    i += n;
+  }
+
+  if (fs->superblock.s_fmod) {
+    fs->superblock.s_fmod = 0;
+    if (blockcache_writesector(fs->cache, SUPERBLOCK_SECTOR, &fs->superblock) != DISKIMG_SECTOR_SIZE) {
+      fprintf(stderr, "Error writing superblock\n");
+      fs->superblock.s_fmod = 1;
+      err = -1;
+    }
+  }
+
+  pthread_mutex_unlock(&fs->writeLock);
+  return err;
+}
+
+int unixfilesystem_sync(struct unixfilesystem *fs) {
+  pthread_mutex_lock(&fs->writeLock);
+  int err = unixfilesystem_flush(fs);
+  if (blockcache_flush(fs->cache, 1) < 0) {
+    fprintf(stderr, "Error writing back the sector cache\n");
+    err = -1;
+  }
+  pthread_mutex_unlock(&fs->writeLock);
+  return err;
+}
+
+void unixfilesystem_free(struct unixfilesystem *fs) {
+  if (fs == NULL) return;
+  if (fs->inodeDirty != NULL) unixfilesystem_flush(fs);
+  directory_invalidate(fs, 0);
+  pthread_rwlock_destroy(&fs->dirindexLock);
+  free(fs->dirindexes);
+  inode_invalidateblockmaps(fs, 0);
+  pthread_mutex_destroy(&fs->blockmapLock);
+  blockcache_free(fs->cache);
+  dcache_free(fs->dcache);
+  fsstats_free(fs->stats);
+  fserror_free(fs->errors);
+  pthread_mutex_destroy(&fs->chksumLock);
+  pthread_mutex_destroy(&fs->writeLock);
+  pthread_rwlock_destroy(&fs->inodesLock);
+  free(fs->inodeDirty);
+  free(fs->chksums);
+  free(fs->inodes);
+  free(fs->inodeAlloc);
+  free(fs);
+}
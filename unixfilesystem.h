@@ -1,6 +1,8 @@
 #ifndef _UNIXFILESYSTEM_H_
 #define _UNIXFILESYSTEM_H_
 
+#include <pthread.h>
+
 /**
  * Include the definitions taken from the Unix sources. 
  */
@@ -19,17 +21,148 @@
  * Block 2 + s_isize : The rest of the blocks on disk.
  */
 
+/**
+ * Concurrency contract.  One struct unixfilesystem may be shared by any
+ * number of threads:
+ *
+ *  - Readers (inode_iget, inode_indexlookup, inode_getblockmap, file_getblock,
+ *    file_read, directory_findname, pathname_lookup, chksumfile_by* and the
+ *    file_reader and directory_iterator objects, each used by one thread)
+ *    may run concurrently with each other.  Shared caches are protected by
+ *    their own locks and no layer keeps hidden static state; disk I/O is
+ *    positioned, so the descriptor is shared too.
+ *  - Writers (alloc_*, inode_iwrite, file_write, directory_addentry, the
+ *    flush and sync calls) are serialised by writeLock and may run
+ *    concurrently with readers.  Entries of the loaded inode table are
+ *    copied in and out whole under inodesLock, so a reader never sees half
+ *    of an inode update.  The caches stay coherent: each has a generation that
+ *    invalidation bumps, and a value a reader computed outside the cache's
+ *    lock is only stored if the generation hasn't moved meanwhile.  A reader
+ *    of a file or directory that a writer is changing at the same time may
+ *    still see its contents before, after or between the writer's steps.
+ *  - Setup and teardown (unixfilesystem_init*, unixfilesystem_free,
+ *    chksumfile_setengine, fsstats_settiming) must not overlap any other
+ *    call on the filesystem.
+ */
+
 #define BOOTBLOCK_SECTOR    0
 #define SUPERBLOCK_SECTOR   1
 #define INODE_START_SECTOR  2
 #define ROOT_INUMBER        1
 #define BOOTBLOCK_MAGIC_NUM 0407
 
+// Number of inode block maps cached per filesystem (see inode_getblockmap).
+#define UNIXFILESYSTEM_BLOCKMAP_SLOTS 64
+
+// Chunks a file_reader keeps in flight by default.
+#define UNIXFILESYSTEM_READAHEAD_CHUNKS 4
+
+struct blockcache;
+struct chksumengine;
+struct chksumfile_memo;
+struct dcache;
+struct dirindex;
+struct fserror_log;
+struct fsstats;
+struct inode_blockmap;
+
 struct unixfilesystem {
   int dfd; // Handle from the diskimg module to read the diskimg.
   struct filsys superblock;  // The superblock read from the diskimage.
+  struct blockcache *cache;  // Sector cache all layers read through.
+  struct dcache *dcache;     // (directory, name) -> inumber cache used by pathname_lookup.
+  struct fsstats *stats;     // Layer counters and latencies, NULL unless built with STATS=1.
+  struct fserror_log *errors; // Diagnostics of failed calls (see fserror.h).
+  int readahead;             // Chunks a file_reader reads ahead (0 for none).
+
+  // Decoded copy of the whole inode table, loaded at init time when
+  // requested.  inodes[i] holds inumber i+1 and bit i of inodeAlloc is set
+  // when that inode has IALLOC.  Both are NULL if the table wasn't loaded.
+  // inodesLock guards the entries of inodes; inodeAlloc is updated atomically.
+  int numInodes;
+  pthread_rwlock_t inodesLock;
+  struct inode *inodes;
+  uint8_t *inodeAlloc;
+
+  // Recently used block maps, indexed by inumber % UNIXFILESYSTEM_BLOCKMAP_SLOTS.
+  // blockmapGeneration counts invalidations.
+  pthread_mutex_t blockmapLock;
+  unsigned blockmapGeneration;
+  struct inode_blockmap *blockmaps[UNIXFILESYSTEM_BLOCKMAP_SLOTS];
+
+  // Name index of each directory searched so far, indexed by inumber.
+  // NULL when indexDirectories is off.  dirindexGeneration counts invalidations.
+  pthread_rwlock_t dirindexLock;
+  unsigned dirindexGeneration;
+  int numDirindexes;
+  struct dirindex **dirindexes;
+
+  // Hash used for file checksums (NULL selects SHA-1) and the checksum of
+  // each inode hashed so far, indexed by inumber; chksums is NULL when
+  // checksums aren't memoised.  chksumGeneration counts invalidations.
+  const struct chksumengine *chksumEngine;
+  pthread_mutex_t chksumLock;
+  unsigned chksumGeneration;
+  int numChksums;
+  struct chksumfile_memo *chksums;
+
+  // Write state.  Writers hold writeLock (recursive) for the length of a
+  // batch; superblock.s_fmod and bit i of inodeDirty (inode-table sector
+  // INODE_START_SECTOR + i) record what the batch has to flush.
+  pthread_mutex_t writeLock;
+  int batchDepth;
+  uint8_t *inodeDirty;
+};
+
+/**
+ * Tunables for unixfilesystem_init_options().  A NULL options pointer
+ * selects the defaults.
+ */
+struct unixfilesystem_options {
+  int cacheSectors;    // Capacity of the sector cache (0 disables caching).
+  int loadInodeTable;  // Read the whole inode table into memory at init, if it can be read.
+  int dcacheEntries;   // Capacity of the name lookup cache (0 disables it).
+  int indexDirectories; // Hash-index each directory on its first search (0 scans it).
+  int memoChecksums;   // Hash each inode's contents at most once.
+  int readahead;       // Chunks of a file read ahead by file_reader (0 disables).
+  int writeBack;       // Hold writes in the sector cache until a flush.
 };
 
 struct unixfilesystem *unixfilesystem_init(int fd);
 
+struct unixfilesystem *unixfilesystem_init_options(int fd,
+                                                   const struct unixfilesystem_options *opts);
+
+/**
+ * Brackets a batch of writes.  The superblock and inode-table sectors that
+ * the writes in a batch change are written out once, when the outermost
+ * batch ends, rather than once per allocation.  Every write function opens
+ * its own batch, so a single call is a batch of one; batches nest.  Writers
+ * are serialised: a batch holds the filesystem's write lock from begin to
+ * end.  unixfilesystem_endbatch() returns 0, or -1 if the flush failed.
+ */
+void unixfilesystem_beginbatch(struct unixfilesystem *fs);
+int unixfilesystem_endbatch(struct unixfilesystem *fs);
+
+/**
+ * Writes the superblock if it was modified and every dirty inode-table
+ * sector to the sector cache, which with write-back on holds them until
+ * it is flushed.  Returns 0 on success, -1 on error.
+ */
+int unixfilesystem_flush(struct unixfilesystem *fs);
+
+/**
+ * Makes every write so far durable: flushes the filesystem, then writes
+ * back the sector cache, file data and indirect blocks first and then the
+ * inode table and superblock, syncing the image after each.  Returns 0 on
+ * success, -1 on error.
+ */
+int unixfilesystem_sync(struct unixfilesystem *fs);
+
+/**
+ * Releases a struct unixfilesystem and everything it owns.  The disk image
+ * descriptor is left open for the caller to close.
+ */
+void unixfilesystem_free(struct unixfilesystem *fs);
+
 #endif // _UNIXFILESYSTEM_H_
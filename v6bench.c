@@ -0,0 +1,708 @@
+/**
+ * Benchmarks the filesystem layers on one or more disk images (for example
+ * ones written by mkv6img).  Each benchmark runs its operation in batches of
+ * growing size until a batch takes at least the minimum time, and reports
+ * the time per operation, the data rate where the operation reads or writes
+ * file contents, and the diskimg system calls per operation.  Benchmarks
+ * that write work on a private copy of the image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "diskimg.h"
+#include "unixfilesystem.h"
+#include "inode.h"
+#include "file.h"
+#include "directory.h"
+#include "pathname.h"
+#include "chksumfile.h"
+#include "blockcache.h"
+#include "dcache.h"
+#include "alloc.h"
+#include "fserror.h"
+
+#define MAXPATH 1024
+
+// File written per ingest operation, in INGEST_WRITE byte pieces.
+#define INGEST_BYTES (256 * 1024)
+#define INGEST_WRITE 4096
+
+// Threads sharing one filesystem in the concurrent benchmark.
+#define CONCURRENT_THREADS 4
+
+// The writer of concurrent/write grows a file in the root directory by
+// INGEST_WRITE bytes per round, under this name.
+#define CONCURRENT_WRITE_ROUNDS 16
+#define CONCURRENT_WRITE_NAME "v6bench.w"
+
+/**
+ * What the benchmarks of one image work on, gathered by a walk of the tree.
+ */
+struct corpus {
+  int fd;
+  int scratchFd;                 // Writable private copy of the image.
+  struct unixfilesystem *fs;     // Default options, reused across operations.
+  struct unixfilesystem *rawfs;  // Same, without the inode table or directory indexes.
+  int numInodes;
+  int *inumbers;                 // Allocated inodes.
+  int numPaths;
+  char **paths;                  // Pathnames of the image (up to MAXPATH long).
+  int bigInumber;                // Largest file.
+  struct inode bigInode;
+  int wideInumber;               // Directory with the most entries.
+  int numNames;
+  char (*names)[15];             // Names in that directory.
+  long totalBytes;               // Bytes in all files reached from the root.
+  int *chksumSizes;              // Serial checksum of each inumbers[] entry
+  uint8_t (*chksums)[CHKSUMFILE_SIZE];  // and inumber of each path, what the
+  int *pathInumbers;             // concurrent benchmark must reproduce.
+  int failures;                  // Concurrent results that differed.
+  uint64_t rng;
+};
+
+typedef void (*bench_fn)(struct corpus *c, long iter);
+
+static uint64_t corpus_random(struct corpus *c) {
+  c->rng ^= c->rng >> 12;
+  c->rng ^= c->rng << 25;
+  c->rng ^= c->rng >> 27;
+  return c->rng * 2685821657736338717ULL;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void corpus_walk(struct corpus *c, const char *pathname, int inumber) {
+  struct inode in;
+  if (inode_iget(c->fs, inumber, &in) < 0) return;
+
+  if (strlen(pathname) < MAXPATH) {
+    c->paths = realloc(c->paths, (c->numPaths + 1) * sizeof(char *));
+    c->paths[c->numPaths++] = strdup(pathname);
+  }
+  int size = inode_getsize(&in);
+  c->totalBytes += size;
+  if ((in.i_mode & IFMT) != IFDIR) {
+    if (c->bigInumber == 0 || size > inode_getsize(&c->bigInode)) {
+      c->bigInumber = inumber;
+      c->bigInode = in;
+    }
+    return;
+  }
+
+  struct directory_iterator it;
+  if (directory_iterator_open(c->fs, inumber, &it) < 0) return;
+  struct direntv6 d;
+  int numEntries = 0;
+  while (directory_iterator_next(&it, &d) > 0) {
+    numEntries++;
+  }
+  directory_iterator_close(&it);
+
+  // Remember the widest directory's names for directory_findname.
+  if (numEntries > c->numNames) {
+    c->wideInumber = inumber;
+    c->numNames = 0;
+    c->names = realloc(c->names, numEntries * sizeof(*c->names));
+    directory_iterator_open(c->fs, inumber, &it);
+    while (directory_iterator_next(&it, &d) > 0) {
+      snprintf(c->names[c->numNames++], sizeof(*c->names), "%.*s", (int) sizeof(d.d_name), d.d_name);
+    }
+    directory_iterator_close(&it);
+  }
+
+  directory_iterator_open(c->fs, inumber, &it);
+  while (directory_iterator_next(&it, &d) > 0) {
+    if (strncmp(d.d_name, ".", sizeof(d.d_name)) == 0 || strncmp(d.d_name, "..", sizeof(d.d_name)) == 0) {
+      continue;
+    }
+    char next[MAXPATH + 16];
+    snprintf(next, sizeof(next), "%s/%.*s", pathname[1] ? pathname : "", (int) sizeof(d.d_name), d.d_name);
+    corpus_walk(c, next, d.d_inumber);
+  }
+  directory_iterator_close(&it);
+}
+
+/**
+ * Copies the image to an unlinked temporary file the write benchmarks can
+ * modify.  Returns its descriptor, or -1.
+ */
+static int corpus_scratchcopy(const char *image) {
+  char path[] = "/tmp/v6benchXXXXXX";
+  int out = mkstemp(path);
+  if (out < 0) return -1;
+  unlink(path);
+  int in = open(image, O_RDONLY);
+  char buf[64 * 1024];
+  ssize_t n;
+  while (in >= 0 && (n = read(in, buf, sizeof(buf))) > 0) {
+    if (write(out, buf, n) != n) break;
+  }
+  if (in >= 0) close(in);
+  return out;
+}
+
+static int corpus_open(struct corpus *c, char *image) {
+  memset(c, 0, sizeof(*c));
+  c->rng = 14;
+  c->fd = diskimg_open(image, 1);
+  if (c->fd < 0) return -1;
+  struct unixfilesystem_options opts = { .cacheSectors = BLOCKCACHE_DEFAULT_SECTORS,
+                                         .dcacheEntries = DCACHE_DEFAULT_ENTRIES };
+  c->fs = unixfilesystem_init(c->fd);
+  c->rawfs = unixfilesystem_init_options(c->fd, &opts);
+  if (c->fs == NULL || c->rawfs == NULL) {
+    unixfilesystem_free(c->fs);
+    unixfilesystem_free(c->rawfs);
+    diskimg_close(c->fd);
+    return -1;
+  }
+
+  int maxInumber = c->fs->superblock.s_isize * (DISKIMG_SECTOR_SIZE / sizeof(struct inode));
+  c->inumbers = malloc(maxInumber * sizeof(int));
+  for (int i = 1; i <= maxInumber; i++) {
+    if (inode_isallocated(c->fs, i)) c->inumbers[c->numInodes++] = i;
+  }
+  corpus_walk(c, "/", ROOT_INUMBER);
+  c->scratchFd = corpus_scratchcopy(image);
+  return 0;
+}
+
+static void corpus_close(struct corpus *c) {
+  unixfilesystem_free(c->fs);
+  unixfilesystem_free(c->rawfs);
+  diskimg_close(c->fd);
+  if (c->scratchFd >= 0) close(c->scratchFd);
+  for (int i = 0; i < c->numPaths; i++) free(c->paths[i]);
+  free(c->paths);
+  free(c->names);
+  free(c->inumbers);
+  free(c->chksumSizes);
+  free(c->chksums);
+  free(c->pathInumbers);
+}
+
+// Results the benchmarks fold in so the calls aren't optimised away.
+// Unsigned so it may wrap; threads publish into it with one atomic add.
+static volatile unsigned sink;
+
+static void bench_inode_iget(struct corpus *c, long iter) {
+  struct inode in;
+  for (long i = 0; i < iter; i++) {
+    sink += inode_iget(c->fs, c->inumbers[i % c->numInodes], &in);
+  }
+}
+
+/**
+ * inode_iget without the in-memory inode table (a sector read per call).
+ */
+static void bench_inode_iget_uncached(struct corpus *c, long iter) {
+  struct inode in;
+  for (long i = 0; i < iter; i++) {
+    sink += inode_iget(c->rawfs, c->inumbers[i % c->numInodes], &in);
+  }
+}
+
+static void bench_inode_indexlookup(struct corpus *c, long iter) {
+  int numBlocks = (inode_getsize(&c->bigInode) + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
+  for (long i = 0; i < iter; i++) {
+    sink += inode_indexlookup(c->fs, &c->bigInode, corpus_random(c) % numBlocks);
+  }
+}
+
+static void bench_directory_findname(struct corpus *c, long iter) {
+  struct direntv6 d;
+  for (long i = 0; i < iter; i++) {
+    sink += directory_findname(c->fs, c->names[corpus_random(c) % c->numNames], c->wideInumber, &d);
+  }
+}
+
+/**
+ * directory_findname without the directory index, scanning the directory's
+ * blocks with the direntscan kernel on every call.
+ */
+static void bench_directory_findname_scan(struct corpus *c, long iter) {
+  struct direntv6 d;
+  for (long i = 0; i < iter; i++) {
+    sink += directory_findname(c->rawfs, c->names[corpus_random(c) % c->numNames], c->wideInumber, &d);
+  }
+}
+
+static void bench_pathname_lookup(struct corpus *c, long iter) {
+  for (long i = 0; i < iter; i++) {
+    sink += pathname_lookup(c->fs, c->paths[corpus_random(c) % c->numPaths]);
+  }
+}
+
+/**
+ * pathname_lookup_batch over the image's paths in dump order, up to all of
+ * them per call; an operation is one path.
+ */
+static void bench_pathname_lookup_batch(struct corpus *c, long iter) {
+  int *inumbers = malloc(c->numPaths * sizeof(int));
+  for (long i = 0; i < iter; ) {
+    int n = iter - i < c->numPaths ? iter - i : c->numPaths;
+    pathname_lookup_batch(c->fs, (const char *const *) c->paths, n, inumbers);
+    sink += inumbers[n - 1];
+    i += n;
+  }
+  free(inumbers);
+}
+
+/**
+ * The -i dump: checksum every allocated inode, on a new filesystem object
+ * each time so nothing is memoised between operations.
+ */
+static void bench_dump_inodes(struct corpus *c, long iter) {
+  char chksum[CHKSUMFILE_SIZE];
+  for (long i = 0; i < iter; i++) {
+    struct unixfilesystem *fs = unixfilesystem_init(c->fd);
+    for (int j = 0; j < c->numInodes; j++) {
+      sink += chksumfile_byinumber(fs, c->inumbers[j], chksum);
+    }
+    unixfilesystem_free(fs);
+  }
+}
+
+/**
+ * The -i dump after chksumfile_scan() has hashed every file in one sweep of
+ * the disk in block order.
+ */
+static void bench_dump_inodes_elevator(struct corpus *c, long iter) {
+  char chksum[CHKSUMFILE_SIZE];
+  for (long i = 0; i < iter; i++) {
+    struct unixfilesystem *fs = unixfilesystem_init(c->fd);
+    chksumfile_scan(fs, c->inumbers, c->numInodes);
+    for (int j = 0; j < c->numInodes; j++) {
+      sink += chksumfile_byinumber(fs, c->inumbers[j], chksum);
+    }
+    unixfilesystem_free(fs);
+  }
+}
+
+/**
+ * The -i dump reading each file synchronously, chunk after chunk, to show
+ * what the file_reader readahead buys.
+ */
+static void bench_dump_inodes_noreadahead(struct corpus *c, long iter) {
+  char chksum[CHKSUMFILE_SIZE];
+  struct unixfilesystem_options opts = { .cacheSectors = BLOCKCACHE_DEFAULT_SECTORS,
+                                         .loadInodeTable = 1,
+                                         .dcacheEntries = DCACHE_DEFAULT_ENTRIES,
+                                         .indexDirectories = 1,
+                                         .memoChecksums = 1 };
+  for (long i = 0; i < iter; i++) {
+    struct unixfilesystem *fs = unixfilesystem_init_options(c->fd, &opts);
+    for (int j = 0; j < c->numInodes; j++) {
+      sink += chksumfile_byinumber(fs, c->inumbers[j], chksum);
+    }
+    unixfilesystem_free(fs);
+  }
+}
+
+/**
+ * The -p dump: resolve and checksum every pathname, again on a new
+ * filesystem object each time.
+ */
+static void bench_dump_paths(struct corpus *c, long iter) {
+  char chksum[CHKSUMFILE_SIZE];
+  for (long i = 0; i < iter; i++) {
+    struct unixfilesystem *fs = unixfilesystem_init(c->fd);
+    for (int j = 0; j < c->numPaths; j++) {
+      sink += chksumfile_bypathname(fs, c->paths[j], chksum);
+    }
+    unixfilesystem_free(fs);
+  }
+}
+
+/**
+ * One thread of the concurrent benchmark: checksums every inode and
+ * resolves as many paths, starting at its own offset so the threads touch
+ * different files at any moment, and checks each result against the
+ * serial one.
+ */
+struct concurrent_worker {
+  struct corpus *c;
+  struct unixfilesystem *fs;
+  int first;
+};
+
+static void *concurrent_run(void *arg) {
+  struct concurrent_worker *w = arg;
+  struct corpus *c = w->c;
+  char chksum[CHKSUMFILE_SIZE];
+  for (int k = 0; k < c->numInodes; k++) {
+    int j = (w->first + k) % c->numInodes;
+    int size = chksumfile_byinumber(w->fs, c->inumbers[j], chksum);
+    int bad = size != c->chksumSizes[j] || (size > 0 && memcmp(chksum, c->chksums[j], size) != 0);
+    if (c->numPaths > 0) {
+      int p = j % c->numPaths;
+      bad += pathname_lookup(w->fs, c->paths[p]) != c->pathInumbers[p];
+    }
+    if (bad) __atomic_fetch_add(&c->failures, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/**
+ * Computes the serial results the concurrent benchmarks must reproduce.
+ */
+static void concurrent_prepare(struct corpus *c) {
+  if (c->chksums == NULL) {
+    c->chksumSizes = malloc(c->numInodes * sizeof(int));
+    c->chksums = malloc(c->numInodes * sizeof(*c->chksums));
+    c->pathInumbers = malloc(c->numPaths * sizeof(int));
+    for (int j = 0; j < c->numInodes; j++) {
+      c->chksumSizes[j] = chksumfile_byinumber(c->fs, c->inumbers[j], c->chksums[j]);
+    }
+    // The threads use pathname_lookup, so this also checks the batch path.
+    pathname_lookup_batch(c->fs, (const char *const *) c->paths, c->numPaths, c->pathInumbers);
+  }
+}
+
+/**
+ * The -i dump and path lookups by CONCURRENT_THREADS threads sharing one
+ * filesystem object, without checksum memoisation so every thread reads
+ * and hashes every file.  Differences from the serial results are counted
+ * in c->failures.
+ */
+static void bench_concurrent(struct corpus *c, long iter) {
+  concurrent_prepare(c);
+
+  struct unixfilesystem_options opts = { .cacheSectors = BLOCKCACHE_DEFAULT_SECTORS,
+                                         .loadInodeTable = 1,
+                                         .dcacheEntries = DCACHE_DEFAULT_ENTRIES,
+                                         .indexDirectories = 1,
+                                         .readahead = UNIXFILESYSTEM_READAHEAD_CHUNKS };
+  for (long i = 0; i < iter; i++) {
+    struct unixfilesystem *fs = unixfilesystem_init_options(c->fd, &opts);
+    pthread_t threads[CONCURRENT_THREADS];
+    struct concurrent_worker workers[CONCURRENT_THREADS];
+    int started = 0;
+    for (int t = 0; t < CONCURRENT_THREADS; t++) {
+      workers[t] = (struct concurrent_worker) { c, fs, t * c->numInodes / CONCURRENT_THREADS };
+      if (pthread_create(&threads[started], NULL, concurrent_run, &workers[t]) == 0) started++;
+    }
+    for (int t = 0; t < started; t++) {
+      pthread_join(threads[t], NULL);
+    }
+    unixfilesystem_free(fs);
+  }
+}
+
+/**
+ * What the threads of concurrent/write share: the writer publishes the
+ * file it is changing in inumber and sets done when it has finished; the
+ * readers that were started count the passes they complete.
+ */
+struct concurrent_shared {
+  struct corpus *c;
+  struct unixfilesystem *fs;
+  int readers;
+  int inumber;
+  int done;
+  int passes;
+};
+
+/**
+ * Waits until every reader has started and finished a pass since the
+ * call, so whatever a reader was computing when the writer changed the
+ * file has been stored in the caches (or rightly dropped) by then.
+ */
+static void concurrent_waitreaders(struct concurrent_shared *s) {
+  int start = __atomic_load_n(&s->passes, __ATOMIC_ACQUIRE);
+  while (__atomic_load_n(&s->passes, __ATOMIC_ACQUIRE) < start + 2 * s->readers) {
+    sched_yield();
+  }
+}
+
+/**
+ * Removes name from directory dirinumber by clearing its entry, as V6
+ * unlink does.  Returns 0, or -1 if it isn't there or can't be cleared.
+ */
+static int concurrent_unlink(struct unixfilesystem *fs, int dirinumber, const char *name) {
+  struct direntv6 d;
+  for (int offset = 0; file_read(fs, dirinumber, offset, sizeof(d), &d) == sizeof(d); offset += sizeof(d)) {
+    if (d.d_inumber != 0 && strncmp(d.d_name, name, sizeof(d.d_name)) == 0) {
+      memset(&d, 0, sizeof(d));
+      return file_write(fs, dirinumber, offset, sizeof(d), &d) == sizeof(d) ? 0 : -1;
+    }
+  }
+  return -1;
+}
+
+/**
+ * The writer of concurrent/write: creates CONCURRENT_WRITE_NAME, grows it
+ * round by round and deletes it.  After each change it checks that its
+ * name, contents and checksum read back as written, which fails if a
+ * reader cached what it saw before the change.
+ */
+static void *concurrent_write_run(void *arg) {
+  struct concurrent_shared *s = arg;
+  struct unixfilesystem *fs = s->fs;
+  static unsigned char data[CONCURRENT_WRITE_ROUNDS * INGEST_WRITE];
+  static unsigned char back[CONCURRENT_WRITE_ROUNDS * INGEST_WRITE];
+  char chksum[CHKSUMFILE_SIZE], expected[CHKSUMFILE_SIZE];
+  int bad = 0;
+
+  int inumber = alloc_inode(fs, 0644);
+  if (inumber < 0 || directory_addentry(fs, ROOT_INUMBER, CONCURRENT_WRITE_NAME, inumber) < 0) {
+    bad++;
+  } else {
+    __atomic_store_n(&s->inumber, inumber, __ATOMIC_RELEASE);
+    for (int r = 0; r < CONCURRENT_WRITE_ROUNDS; r++) {
+      int len = (r + 1) * INGEST_WRITE;
+      memset(data + r * INGEST_WRITE, r + 1, INGEST_WRITE);
+      bad += file_write(fs, inumber, r * INGEST_WRITE, INGEST_WRITE, data + r * INGEST_WRITE) != INGEST_WRITE;
+      concurrent_waitreaders(s);
+      bad += pathname_lookup(fs, "/" CONCURRENT_WRITE_NAME) != inumber;
+      bad += file_read(fs, inumber, 0, len, back) != len || memcmp(back, data, len) != 0;
+      void *ctx = chksumengine_sha1.begin();
+      chksumengine_sha1.update(ctx, data, len);
+      int size = chksumengine_sha1.finish(ctx, expected);
+      bad += chksumfile_byinumber(fs, inumber, chksum) != size || memcmp(chksum, expected, size) != 0;
+    }
+    __atomic_store_n(&s->inumber, 0, __ATOMIC_RELEASE);
+    bad += concurrent_unlink(fs, ROOT_INUMBER, CONCURRENT_WRITE_NAME) < 0;
+    bad += alloc_freeinode(fs, inumber) < 0;
+    concurrent_waitreaders(s);
+    bad += pathname_lookup(fs, "/" CONCURRENT_WRITE_NAME) != FSERR_NOENT;
+  }
+  if (bad) __atomic_fetch_add(&s->c->failures, bad, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/**
+ * A reader of concurrent/write: keeps reading, hashing and looking up the
+ * writer's file, whose results depend on the timing and are ignored, and
+ * checks the other files and every path against the serial results as
+ * concurrent_run() does.
+ */
+static void *concurrent_read_run(void *arg) {
+  struct concurrent_shared *s = arg;
+  struct corpus *c = s->c;
+  char chksum[CHKSUMFILE_SIZE];
+  unsigned char buf[INGEST_WRITE];
+  unsigned seen = 0;
+  for (int k = 0; !__atomic_load_n(&s->done, __ATOMIC_ACQUIRE); k++) {
+    int inumber = __atomic_load_n(&s->inumber, __ATOMIC_ACQUIRE);
+    if (inumber > 0) {
+      seen += chksumfile_byinumber(s->fs, inumber, chksum);
+      seen += file_read(s->fs, inumber, 0, sizeof(buf), buf);
+    }
+    seen += pathname_lookup(s->fs, "/" CONCURRENT_WRITE_NAME);
+
+    // The root directory itself is what the writer changes.
+    int j = k % c->numInodes;
+    int bad = 0;
+    if (c->inumbers[j] != ROOT_INUMBER) {
+      int size = chksumfile_byinumber(s->fs, c->inumbers[j], chksum);
+      bad = size != c->chksumSizes[j] || (size > 0 && memcmp(chksum, c->chksums[j], size) != 0);
+    }
+    if (c->numPaths > 0) {
+      int p = j % c->numPaths;
+      bad += pathname_lookup(s->fs, c->paths[p]) != c->pathInumbers[p];
+    }
+    if (bad) __atomic_fetch_add(&c->failures, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->passes, 1, __ATOMIC_RELEASE);
+  }
+  __atomic_fetch_add(&sink, seen, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/**
+ * One writer and CONCURRENT_THREADS - 1 readers sharing one filesystem
+ * object on the scratch copy of the image, with every cache on, checksum
+ * memoisation included, so readers keep refilling the caches the writer
+ * invalidates.  Wrong results are counted in c->failures.
+ */
+static void bench_concurrent_write(struct corpus *c, long iter) {
+  concurrent_prepare(c);
+  struct unixfilesystem_options opts = { .cacheSectors = BLOCKCACHE_DEFAULT_SECTORS,
+                                         .loadInodeTable = 1,
+                                         .dcacheEntries = DCACHE_DEFAULT_ENTRIES,
+                                         .indexDirectories = 1,
+                                         .memoChecksums = 1,
+                                         .readahead = UNIXFILESYSTEM_READAHEAD_CHUNKS };
+  for (long i = 0; i < iter; i++) {
+    struct unixfilesystem *fs = unixfilesystem_init_options(c->scratchFd, &opts);
+    if (fs == NULL) return;
+    struct concurrent_shared shared = { c, fs, 0, 0, 0, 0 };
+    pthread_t threads[CONCURRENT_THREADS];
+    int started = 0;
+    for (int t = 1; t < CONCURRENT_THREADS; t++) {
+      if (pthread_create(&threads[started], NULL, concurrent_read_run, &shared) == 0) started++;
+    }
+    shared.readers = started;
+    if (pthread_create(&threads[started], NULL, concurrent_write_run, &shared) == 0) {
+      started++;
+    } else {
+      __atomic_store_n(&shared.done, 1, __ATOMIC_RELEASE);
+    }
+    for (int t = 0; t < started; t++) {
+      pthread_join(threads[t], NULL);
+    }
+    unixfilesystem_sync(fs);
+    unixfilesystem_free(fs);
+  }
+}
+
+/**
+ * Creates a file of INGEST_BYTES written in small pieces, writes it back to
+ * the image and deletes it, on the scratch copy of the image.  The blocks
+ * and inode freed by one operation are reused by the next.
+ */
+static void bench_ingest_options(struct corpus *c, long iter, int writeBack) {
+  static char data[INGEST_BYTES];
+  struct unixfilesystem_options opts = { .cacheSectors = BLOCKCACHE_DEFAULT_SECTORS,
+                                         .loadInodeTable = 1,
+                                         .writeBack = writeBack };
+  struct unixfilesystem *fs = unixfilesystem_init_options(c->scratchFd, &opts);
+  if (fs == NULL) return;
+  for (long i = 0; i < iter; i++) {
+    int inumber = alloc_inode(fs, 0644);
+    if (inumber < 0) break;
+    unixfilesystem_beginbatch(fs);
+    for (int offset = 0; offset < INGEST_BYTES; offset += INGEST_WRITE) {
+      sink += file_write(fs, inumber, offset, INGEST_WRITE, data + offset);
+    }
+    unixfilesystem_endbatch(fs);
+    // Write it all to the image (without waiting for the disk) before it
+    // is deleted, or write-back would never write the data at all.
+    unixfilesystem_flush(fs);
+    blockcache_flush(fs->cache, 0);
+    alloc_freeinode(fs, inumber);
+  }
+  unixfilesystem_sync(fs);
+  unixfilesystem_free(fs);
+}
+
+static void bench_ingest(struct corpus *c, long iter) {
+  bench_ingest_options(c, iter, 1);
+}
+
+static void bench_ingest_writethrough(struct corpus *c, long iter) {
+  bench_ingest_options(c, iter, 0);
+}
+
+enum bench_bytes {
+  BYTES_NONE,
+  BYTES_CONTENTS,                // Report MB/s over all file contents.
+  BYTES_INGEST,                  // Report MB/s over the INGEST_BYTES written.
+};
+
+struct benchmark {
+  const char *name;
+  bench_fn fn;
+  enum bench_bytes bytes;
+  int writes;                    // Needs the scratch copy of the image.
+};
+
+static const struct benchmark benchmarks[] = {
+  { "inode_iget", bench_inode_iget, BYTES_NONE, 0 },
+  { "inode_iget/uncached", bench_inode_iget_uncached, BYTES_NONE, 0 },
+  { "inode_indexlookup", bench_inode_indexlookup, BYTES_NONE, 0 },
+  { "directory_findname", bench_directory_findname, BYTES_NONE, 0 },
+  { "directory_findname/scan", bench_directory_findname_scan, BYTES_NONE, 0 },
+  { "pathname_lookup", bench_pathname_lookup, BYTES_NONE, 0 },
+  { "pathname_lookup/batch", bench_pathname_lookup_batch, BYTES_NONE, 0 },
+  { "dump/inodes", bench_dump_inodes, BYTES_CONTENTS, 0 },
+  { "dump/inodes/noreadahead", bench_dump_inodes_noreadahead, BYTES_CONTENTS, 0 },
+  { "dump/inodes/elevator", bench_dump_inodes_elevator, BYTES_CONTENTS, 0 },
+  { "dump/paths", bench_dump_paths, BYTES_CONTENTS, 0 },
+  { "concurrent", bench_concurrent, BYTES_NONE, 0 },
+  { "concurrent/write", bench_concurrent_write, BYTES_NONE, 1 },
+  { "ingest", bench_ingest, BYTES_INGEST, 1 },
+  { "ingest/writethrough", bench_ingest_writethrough, BYTES_INGEST, 1 },
+};
+
+static void run_benchmark(struct corpus *c, const struct benchmark *b, double minTime) {
+  b->fn(c, 1);   // Warm up caches and build indexes.
+
+  long iter = 1;
+  double elapsed;
+  uint64_t syscalls;
+  for (;;) {
+    uint64_t startCalls = diskimg_getsyscalls();
+    double start = now_ns();
+    b->fn(c, iter);
+    elapsed = now_ns() - start;
+    syscalls = diskimg_getsyscalls() - startCalls;
+    if (elapsed >= minTime * 1e9 || iter >= (1L << 30)) break;
+    // Aim straight for the minimum time, growing at most tenfold per step.
+    double scale = elapsed > 0 ? minTime * 1e9 * 1.4 / elapsed : 10;
+    iter = scale > 10 ? iter * 10 : (long) (iter * scale) + 1;
+  }
+
+  double nsPerOp = elapsed / iter;
+  printf("%-24s %14.1f %12ld", b->name, nsPerOp, iter);
+  if (b->bytes != BYTES_NONE) {
+    long bytes = b->bytes == BYTES_CONTENTS ? c->totalBytes : INGEST_BYTES;
+    printf(" %10.1f", bytes / (nsPerOp / 1e9) / (1024 * 1024));
+  } else {
+    printf(" %10s", "-");
+  }
+  printf(" %12.2f\n", (double) syscalls / iter);
+}
+
+static void PrintUsageAndExit(char *progname) {
+  fprintf(stderr, "Usage: %s [-t seconds] [-f filter] image...\n", progname);
+  fprintf(stderr, "-t s   run each benchmark for at least s seconds (default 0.5)\n");
+  fprintf(stderr, "-f s   only run benchmarks whose name contains s\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  double minTime = 0.5;
+  const char *filter = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:f:")) != -1) {
+    switch (opt) {
+    case 't':
+      minTime = atof(optarg);
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    default:
+      PrintUsageAndExit(argv[0]);
+    }
+  }
+  if (optind >= argc) PrintUsageAndExit(argv[0]);
+
+  int status = 0;
+  for (int i = optind; i < argc; i++) {
+    struct corpus c;
+    if (corpus_open(&c, argv[i]) < 0) {
+      fprintf(stderr, "Can't open %s\n", argv[i]);
+      status = 1;
+      continue;
+    }
+    printf("%s: %d inodes, %d paths, %ld bytes, widest directory %d entries\n",
+           argv[i], c.numInodes, c.numPaths, c.totalBytes, c.numNames);
+    printf("%-24s %14s %12s %10s %12s\n", "Benchmark", "ns/op", "Iterations", "MB/s", "syscalls/op");
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+      if (filter != NULL && strstr(benchmarks[b].name, filter) == NULL) continue;
+      if (benchmarks[b].writes && c.scratchFd < 0) continue;
+      run_benchmark(&c, &benchmarks[b], minTime);
+    }
+    if (c.failures > 0) {
+      fprintf(stderr, "%s: %d concurrent results differ from the serial ones\n", argv[i], c.failures);
+      status = 1;
+    }
+    printf("\n");
+    corpus_close(&c);
+  }
+  return status;
+}
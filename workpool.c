@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "workpool.h"
+
+struct task {
+  workpool_fn fn;
+  void *arg;
+};
+
+/**
+ * A worker thread and its deque.  The deque is a ring buffer: the owner
+ * pushes and pops at the bottom, thieves take from the top.
+ */
+struct workpool_worker {
+  struct workpool *wp;
+  int index;
+  pthread_t thread;
+  pthread_mutex_t lock;     // Protects tasks, top, size and capacity.
+  struct task *tasks;
+  int top;
+  int size;
+  int capacity;
+};
+
+struct workpool {
+  int numThreads;           // Number of workers (and deques).
+  int numStarted;           // Workers whose thread is running.
+  struct workpool_worker *workers;
+  pthread_mutex_t lock;     // Protects pending and shutdown; used with both conds.
+  pthread_cond_t wake;      // Signalled when a task is queued or on shutdown.
+  pthread_cond_t idle;      // Signalled when pending drops to 0.
+  int queued;               // Tasks sitting in deques.
+  int pending;              // Tasks queued or running.
+  int shutdown;
+};
+
+static int deque_push(struct workpool_worker *w, workpool_fn fn, void *arg) {
+  pthread_mutex_lock(&w->lock);
+  if (w->size == w->capacity) {
+    int capacity = w->capacity ? 2 * w->capacity : 64;
+    struct task *tasks = malloc(capacity * sizeof(struct task));
+    if (tasks == NULL) {
+      pthread_mutex_unlock(&w->lock);
+      return -1;
+    }
+    for (int i = 0; i < w->size; i++) {
+      tasks[i] = w->tasks[(w->top + i) % w->capacity];
+    }
+    free(w->tasks);
+    w->tasks = tasks;
+    w->top = 0;
+    w->capacity = capacity;
+  }
+  w->tasks[(w->top + w->size) % w->capacity] = (struct task) { fn, arg };
+  w->size++;
+  pthread_mutex_unlock(&w->lock);
+  return 0;
+}
+
+/**
+ * Takes the newest task (bottom) if fromTop is 0, the oldest (top) otherwise.
+ */
+static int deque_take(struct workpool_worker *w, int fromTop, struct task *t) {
+  pthread_mutex_lock(&w->lock);
+  if (w->size == 0) {
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+  }
+  if (fromTop) {
+    *t = w->tasks[w->top];
+    w->top = (w->top + 1) % w->capacity;
+  } else {
+    *t = w->tasks[(w->top + w->size - 1) % w->capacity];
+  }
+  w->size--;
+  pthread_mutex_unlock(&w->lock);
+  __atomic_fetch_sub(&w->wp->queued, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+static int workpool_queue(struct workpool_worker *w, workpool_fn fn, void *arg) {
+  struct workpool *wp = w->wp;
+  pthread_mutex_lock(&wp->lock);
+  wp->pending++;
+  pthread_mutex_unlock(&wp->lock);
+
+  if (deque_push(w, fn, arg) < 0) {
+    pthread_mutex_lock(&wp->lock);
+    wp->pending--;
+    pthread_mutex_unlock(&wp->lock);
+    return -1;
+  }
+
+  pthread_mutex_lock(&wp->lock);
+  __atomic_fetch_add(&wp->queued, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&wp->wake);
+  pthread_mutex_unlock(&wp->lock);
+  return 0;
+}
+
+/**
+ * Finds the next task for w: its own newest task, else the oldest task of
+ * some other worker.
+ */
+static int workpool_find(struct workpool_worker *w, struct task *t) {
+  struct workpool *wp = w->wp;
+  if (deque_take(w, 0, t)) return 1;
+  for (int i = 1; i < wp->numThreads; i++) {
+    struct workpool_worker *victim = &wp->workers[(w->index + i) % wp->numThreads];
+    if (deque_take(victim, 1, t)) return 1;
+  }
+  return 0;
+}
+
+static void *workpool_main(void *arg) {
+  struct workpool_worker *w = arg;
+  struct workpool *wp = w->wp;
+
+  for (;;) {
+    struct task t;
+    if (!workpool_find(w, &t)) {
+      pthread_mutex_lock(&wp->lock);
+      while (!wp->shutdown && __atomic_load_n(&wp->queued, __ATOMIC_RELAXED) == 0) {
+        pthread_cond_wait(&wp->wake, &wp->lock);
+      }
+      int shutdown = wp->shutdown;
+      pthread_mutex_unlock(&wp->lock);
+      if (shutdown) break;
+      continue;
+    }
+
+    t.fn(w, t.arg);
+
+    pthread_mutex_lock(&wp->lock);
+    if (--wp->pending == 0) {
+      pthread_cond_broadcast(&wp->idle);
+    }
+    pthread_mutex_unlock(&wp->lock);
+  }
+  return NULL;
+}
+
+struct workpool *workpool_create(int numThreads) {
+  if (numThreads < 1) return NULL;
+
+  struct workpool *wp = calloc(1, sizeof(struct workpool));
+  if (wp == NULL) return NULL;
+  wp->workers = calloc(numThreads, sizeof(struct workpool_worker));
+  if (wp->workers == NULL) {
+    free(wp);
+    return NULL;
+  }
+  pthread_mutex_init(&wp->lock, NULL);
+  pthread_cond_init(&wp->wake, NULL);
+  pthread_cond_init(&wp->idle, NULL);
+
+  // Every deque must exist before the first thread starts stealing.
+  wp->numThreads = numThreads;
+  for (int i = 0; i < numThreads; i++) {
+    struct workpool_worker *w = &wp->workers[i];
+    w->wp = wp;
+    w->index = i;
+    pthread_mutex_init(&w->lock, NULL);
+  }
+
+  // Deques of threads that fail to start are still drained by the others.
+  for (int i = 0; i < numThreads; i++) {
+    if (pthread_create(&wp->workers[i].thread, NULL, workpool_main, &wp->workers[i]) != 0) break;
+    wp->numStarted++;
+  }
+
+  if (wp->numStarted == 0) {
+    workpool_free(wp);
+    return NULL;
+  }
+  return wp;
+}
+
+void workpool_run(struct workpool *wp, workpool_fn fn, void *arg) {
+  if (workpool_queue(&wp->workers[0], fn, arg) < 0) {
+    fn(&wp->workers[0], arg);
+  }
+
+  pthread_mutex_lock(&wp->lock);
+  while (wp->pending > 0) {
+    pthread_cond_wait(&wp->idle, &wp->lock);
+  }
+  pthread_mutex_unlock(&wp->lock);
+}
+
+int workpool_spawn(struct workpool_worker *self, workpool_fn fn, void *arg) {
+  if (workpool_queue(self, fn, arg) < 0) {
+    fn(self, arg);
+    return -1;
+  }
+  return 0;
+}
+
+void workpool_free(struct workpool *wp) {
+  if (wp == NULL) return;
+
+  pthread_mutex_lock(&wp->lock);
+  wp->shutdown = 1;
+  pthread_cond_broadcast(&wp->wake);
+  pthread_mutex_unlock(&wp->lock);
+
+  for (int i = 0; i < wp->numStarted; i++) {
+    pthread_join(wp->workers[i].thread, NULL);
+  }
+  for (int i = 0; i < wp->numThreads; i++) {
+    pthread_mutex_destroy(&wp->workers[i].lock);
+    free(wp->workers[i].tasks);
+  }
+  pthread_cond_destroy(&wp->idle);
+  pthread_cond_destroy(&wp->wake);
+  pthread_mutex_destroy(&wp->lock);
+  free(wp->workers);
+  free(wp);
+}
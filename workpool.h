@@ -0,0 +1,41 @@
+#ifndef _WORKPOOL_H_
+#define _WORKPOOL_H_
+
+/**
+ * A fixed pool of threads that run tasks from per-thread work-stealing
+ * deques.  A task spawned from inside another task goes on the spawning
+ * thread's own deque, which that thread drains newest-first; idle threads
+ * steal the oldest task from another thread's deque.  Recursive work such
+ * as a directory tree walk therefore stays depth-first on each thread while
+ * large subtrees spread across all of them.
+ */
+
+struct workpool;
+struct workpool_worker;
+
+typedef void (*workpool_fn)(struct workpool_worker *self, void *arg);
+
+/**
+ * Creates a pool of numThreads threads.  Returns NULL on error.
+ */
+struct workpool *workpool_create(int numThreads);
+
+/**
+ * Runs fn(arg) as the first task of the pool and returns once it and every
+ * task spawned from it, directly or indirectly, have finished.
+ */
+void workpool_run(struct workpool *wp, workpool_fn fn, void *arg);
+
+/**
+ * Queues fn(arg) as a new task.  Must be called from inside a task; self is
+ * the worker passed to that task.  Returns 0 on success, or -1 if the task
+ * could not be queued (it is then run immediately on the calling thread).
+ */
+int workpool_spawn(struct workpool_worker *self, workpool_fn fn, void *arg);
+
+/**
+ * Stops the threads and releases the pool.
+ */
+void workpool_free(struct workpool *wp);
+
+#endif // _WORKPOOL_H_